@@ -1,2 +1,7 @@
 PLUGIN_NAME = bemani-clef
 include $(ROOTPATH)libclef/config.mak
+
+ifneq ($(CROSS),msvc)
+LDFLAGS_R += -pthread
+LDFLAGS_D += -pthread
+endif
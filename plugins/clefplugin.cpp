@@ -2,137 +2,686 @@
 #include "bankloaders.h"
 #include "iidxsequence.h"
 #include "identify.h"
+#include "bundle.h"
+#include "bytesource.h"
+#include "decodescheduler.h"
+#include "canceltoken.h"
+#include "metadatacache.h"
+#include "renderwindow.h"
 #include "ifs/ifssequence.h"
 #include "ifs/ifs.h"
 #include "plugin/baseplugin.h"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <fstream>
+#include <limits>
+#include <mutex>
+#include <sstream>
+#include <thread>
 
 namespace {
-struct Subsong {
-  Subsong(const std::string& fullName) {
+// Options can follow the filename after a '?', separated by '&'. A bare
+// number picks a subsong of a .2dx bank. For IFS songs, mute=<parts> and
+// solo=<parts> use the same letters as the CLI, and gain=<parts>:<gain>
+// scales parts and can be repeated, e.g. "song.ifs?solo=gd&gain=d:0.5".
+// A bare "parts" loads every part so that the host can change mutes and
+// gains during playback, which any of the part options also do.
+// A bare "compressed" keeps gitadora samples ADPCM-compressed in memory
+// and decodes them while mixing. start=<seconds> and end=<seconds> play
+// only part of a song and only decode the samples heard in it; an end of
+// zero plays to the end of the song. Mute and solo options still apply,
+// but compressed is ignored in a window. Mutes and gains can only change
+// during playback without compressed or a window.
+struct FileOptions {
+  FileOptions(const std::string& fullName) {
     subsong = 0;
+    parts = false;
+    compressed = false;
+    start = 0;
+    end = 0;
     int qPos = fullName.find('?');
-    if (qPos >= 0) {
-      subsong = std::stoi(fullName.substr(qPos + 1));
-      filename = fullName.substr(0, qPos);
-    } else {
+    if (qPos < 0) {
       filename = fullName;
+      return;
+    }
+    filename = fullName.substr(0, qPos);
+    std::istringstream query(fullName.substr(qPos + 1));
+    std::string option;
+    while (std::getline(query, option, '&')) {
+      int eqPos = option.find('=');
+      std::string key = option.substr(0, eqPos);
+      std::string value = eqPos < 0 ? std::string() : option.substr(eqPos + 1);
+      if (option == "compressed") {
+        compressed = true;
+      } else if (option == "parts") {
+        parts = true;
+      } else if (eqPos < 0) {
+        subsong = std::stoi(option);
+      } else if (key == "start") {
+        start = std::stod(value);
+      } else if (key == "end") {
+        end = std::stod(value);
+      } else if (key == "mute") {
+        mute = value;
+      } else if (key == "solo") {
+        solo = value;
+      } else if (key == "gain") {
+        int colonPos = value.find(':');
+        if (colonPos < 0) {
+          throw std::runtime_error("gain option must be <parts>:<gain>");
+        }
+        gains.emplace_back(value.substr(0, colonPos), std::stod(value.substr(colonPos + 1)));
+      }
+    }
+  }
+
+  // Mutes must be set before the song's context is handed to the host,
+  // since they change its channels.
+  void apply(IFSSequence* seq) const {
+    seq->setCompressedSamples(compressed);
+    if (!mute.empty()) {
+      seq->setMutes(mute);
+    }
+    if (!solo.empty()) {
+      seq->setSolo(solo);
+    }
+    for (const auto& gain : gains) {
+      seq->setPartGain(IFSSequence::stringToSpaces(gain.first), gain.second);
     }
   }
 
+  bool hasWindow() const {
+    return start > 0 || end > 0;
+  }
+
+  bool hasParts() const {
+    return parts || !mute.empty() || !solo.empty() || !gains.empty();
+  }
+
   int subsong;
+  bool parts;
+  bool compressed;
+  double start, end;
   std::string filename;
+  std::string mute, solo;
+  std::vector<std::pair<std::string, double>> gains;
 };
 
-struct FilePtr : public Subsong {
-  FilePtr(ClefContext* clef, const std::string& fullName, std::istream& fileRef)
-  : Subsong(fullName) {
-    if (fileRef) {
-      file = &fileRef;
-    } else {
-      owned = clef->openFile(filename);
-      file = owned.get();
+// Files on disk are mapped by name. Anything else is read through the
+// stream the host passed in.
+struct FileSource : public FileOptions {
+  FileSource(ClefContext* clef, const std::string& fullName, std::istream& fileRef)
+  : FileOptions(fullName) {
+    source.reset(ByteSource::open(clef, filename));
+    if (!source && fileRef) {
+      source.reset(new ByteSource(fileRef));
     }
   }
 
-  operator std::istream*() { return file; }
+  operator ByteSource*() { return source.get(); }
 
 private:
-  std::istream* file;
-  std::unique_ptr<std::istream> owned;
+  std::unique_ptr<ByteSource> source;
+};
+
+// Everything that belongs to one loaded song. A prefetched song brings the
+// context its samples were decoded into.
+struct Song {
+  std::unique_ptr<ClefContext> ownContext;
+  // The sequences' tracks refer to the scheduler, so it's destroyed after them
+  std::unique_ptr<DecodeScheduler> scheduler;
+  std::unique_ptr<StreamSequence> stream;
+  std::unique_ptr<IIDXSequence> iidx;
+  std::unique_ptr<IFSSequence> ifs;
+  std::unique_ptr<BundleSequence> bundle;
+  // Plays the tracks above, so it's destroyed first
+  std::unique_ptr<RenderWindow> window;
+  SynthContext* synth = nullptr;
+  // 2dx streams hand the host a SynthContext that it deletes
+  bool hostOwnsSynth = false;
+  bool handedOut = false;
+
+  ~Song() {
+    if (hostOwnsSynth && !handedOut) {
+      delete synth;
+    }
+  }
 };
 }
 
 struct ClefPluginInfo {
   CLEF_PLUGIN_STATIC_FIELDS
 
+  static MetadataCache& metadata() {
+    // Persisted so that rescanning a library doesn't reparse unchanged files
+    static MetadataCache cache(MetadataCache::defaultPath());
+    return cache;
+  }
+
+  // Returns the other files that a song's type and length depend on, which
+  // may not exist: the other half of an IFS pair and the banks of a chart.
+  static std::vector<std::string> pairedFiles(const std::string& filename) {
+    std::string path = FileOptions(filename).filename;
+    std::vector<std::string> files{ IFS::pairedFile(path) };
+    size_t dotPos = path.rfind('.');
+    if (dotPos != std::string::npos && path.substr(dotPos) == ".1") {
+      std::string basePath = path.substr(0, dotPos + 1);
+      files.push_back(basePath + "s3p");
+      files.push_back(basePath + "2dx");
+    }
+    return files;
+  }
+
+  static BemaniFileType cachedFileType(ClefContext* clef, const std::string& filename, std::istream& file) {
+    MetadataCache::Entry entry;
+    bool cacheable = metadata().get(filename, entry);
+    uint64_t pairedStamp = MetadataCache::pairedStamp(pairedFiles(filename));
+    if (entry.fileType >= 0 && entry.pairedStamp == pairedStamp) {
+      return BemaniFileType(entry.fileType);
+    }
+    BemaniFileType fileType = identifyFileType(clef, filename, &file);
+    if (cacheable) {
+      entry = MetadataCache::Entry();
+      entry.fileType = fileType;
+      entry.pairedStamp = pairedStamp;
+      metadata().put(filename, entry);
+    }
+    return fileType;
+  }
+
   static std::vector<std::string> getSubsongs(ClefContext* clef, const std::string& filename, std::istream& file) {
+    MetadataCache::Entry entry;
+    bool cacheable = metadata().get(filename, entry);
+    if (entry.hasSubsongs) {
+      return entry.subsongs;
+    }
     std::vector<std::string> subsongs;
-    BemaniFileType fileType = identifyFileType(clef, filename, &file);
-    if (fileType == FT_2dx) {
-      FilePtr fp(clef, filename, file);
-      std::vector<uint64_t> ids = get2DXSampleIDs(clef, fp);
+    if (cachedFileType(clef, filename, file) == FT_2dx) {
+      FileSource fp(clef, filename, file);
+      std::vector<uint64_t> ids;
+      if (fp) {
+        ids = get2DXSampleIDs(clef, fp);
+      }
       for (uint64_t id : ids) {
         subsongs.push_back(fp.filename + "?" + std::to_string(id - 1));
       }
+      if (cacheable && !ids.empty()) {
+        // The host asks for each subsong's length next, so read them all now
+        std::vector<double> lengths = get2DXSampleLengths(fp);
+        for (size_t i = 0; i < ids.size(); i++) {
+          MetadataCache::Entry subsong;
+          subsong.duration = ids[i] <= lengths.size() ? lengths[ids[i] - 1] : 0;
+          metadata().put(subsongs[i], subsong);
+        }
+      }
+    }
+    if (cacheable) {
+      entry = MetadataCache::Entry();
+      entry.hasSubsongs = true;
+      entry.subsongs = subsongs;
+      metadata().put(filename, entry);
     }
     return subsongs;
   }
 
   static bool isPlayable(ClefContext* clef, const std::string& filename, std::istream& file) {
-    return identifyFileType(clef, filename, &file) != FT_invalid;
+    return cachedFileType(clef, filename, file) != FT_invalid;
   }
 
   static double length(ClefContext* clef, const std::string& filename, std::istream& file) {
-    BemaniFileType fileType = identifyFileType(clef, filename, &file);
-    if (fileType == FT_ifs) {
+    MetadataCache::Entry entry;
+    bool cacheable = metadata().get(filename, entry);
+    uint64_t pairedStamp = MetadataCache::pairedStamp(pairedFiles(filename));
+    if (entry.duration >= 0 && entry.pairedStamp == pairedStamp) {
+      return entry.duration;
+    }
+    double length = 0;
+    BemaniFileType type = cachedFileType(clef, filename, file);
+    if (type == FT_ifs) {
+      FileSource fp(clef, filename, file);
       IFSSequence seq(clef);
-      seq.addIFS(new IFS(file));
-      return seq.duration();
-    } else if (fileType == FT_2dx) {
-      FilePtr fp(clef, filename, file);
-      return get2DXSampleLength(fp, fp.subsong + 1);
+      if (fp) {
+        seq.addIFS(new IFS(*fp));
+      }
+      // The backing track is in the other half of a pair
+      std::unique_ptr<ByteSource> paired(ByteSource::open(clef, IFS::pairedFile(fp.filename)));
+      if (paired) {
+        seq.addIFS(new IFS(*paired));
+      }
+      length = seq.duration();
+    } else if (type == FT_2dx) {
+      FileSource fp(clef, filename, file);
+      length = fp ? get2DXSampleLength(fp, fp.subsong + 1) : 0;
+    } else if (type == FT_bundle) {
+      BundleSequence::probe(file, nullptr, &length);
+    } else {
+      IIDXSequence seq(clef, FileOptions(filename).filename);
+      length = seq.duration();
+    }
+    FileOptions options(filename);
+    if (options.hasWindow()) {
+      // Only the window plays
+      length = std::max(0.0, (options.end > 0 ? std::min(options.end, length) : length) - options.start);
     }
-    IIDXSequence seq(clef, filename);
-    return seq.duration();
+    if (cacheable) {
+      entry = MetadataCache::Entry();
+      entry.duration = length;
+      entry.pairedStamp = pairedStamp;
+      metadata().put(filename, entry);
+    }
+    return length;
   }
 
   static TagMap readTags(ClefContext* ctx, const std::string& filename, std::istream& /* unused */) {
+    size_t slashPos = filename.find_last_of("/\\");
+    std::string tagsFile = (slashPos == std::string::npos ? std::string() : filename.substr(0, slashPos + 1)) + "!tags.m3u";
+    int64_t tagsModified = MetadataCache::modifiedTime(tagsFile);
+    MetadataCache::Entry entry;
+    bool cacheable = metadata().get(filename, entry);
+    if (entry.hasTags && entry.tagsModified == tagsModified) {
+      return entry.tags;
+    }
     TagMap tagMap = TagsM3UMixin::readTags(ctx, filename);
     if (!tagMap.count("title")) {
-      tagMap = TagsM3UMixin::readTags(ctx, IFS::pairedFile(filename));
+      tagMap = TagsM3UMixin::readTags(ctx, IFS::pairedFile(FileOptions(filename).filename));
+    }
+    if (cacheable) {
+      entry = MetadataCache::Entry();
+      entry.hasTags = true;
+      entry.tags = tagMap;
+      entry.tagsModified = tagsModified;
+      metadata().put(filename, entry);
     }
     return tagMap;
   }
 
-  static int sampleRate(ClefContext*, const std::string&, std::istream& file) {
-    if (isIfsFile(file)) {
-      return 48000;
+  static int sampleRate(ClefContext*, const std::string& filename, std::istream& file) {
+    MetadataCache::Entry entry;
+    bool cacheable = metadata().get(filename, entry);
+    if (entry.sampleRate > 0) {
+      return entry.sampleRate;
+    }
+    double bundleRate;
+    int rate;
+    if (BundleSequence::probe(file, &bundleRate)) {
+      rate = bundleRate;
+    } else if (isIfsFile(file)) {
+      rate = 48000;
     } else {
       // TODO: any known 48kHz IIDX tracks?
-      return 44100;
+      rate = 44100;
     }
+    if (cacheable) {
+      entry = MetadataCache::Entry();
+      entry.sampleRate = rate;
+      metadata().put(filename, entry);
+    }
+    return rate;
+  }
+
+  ~ClefPluginInfo() {
+    cancelPrefetch();
   }
 
   SynthContext* prepare(ClefContext* clef, const std::string& filename, std::istream& file) {
-    BemaniFileType fileType = identifyFileType(clef, filename, &file);
+    SynthContext* synth = prepareSong(clef, filename, file);
+    std::string next = synth && prefetchBudget ? nextInPlaylist(filename) : std::string();
+    if (!next.empty()) {
+      // The next song loads while this one plays
+      prefetch(next);
+    }
+    return synth;
+  }
+
+  SynthContext* prepareSong(ClefContext* clef, const std::string& filename, std::istream& file) {
+    std::unique_ptr<Song> prefetchedSong = takePrefetch(filename);
+    std::shared_ptr<CancelToken> token(prefetchedSong ? prefetchToken : std::shared_ptr<CancelToken>(new CancelToken));
+    {
+      std::lock_guard<std::mutex> lock(loadMutex);
+      if (cancel) {
+        cancel->cancel();
+      }
+      cancel = token;
+      loading = !prefetchedSong;
+      freeSong();
+      if (prefetchedSong) {
+        song = std::move(prefetchedSong);
+        song->handedOut = true;
+        return song->synth;
+      }
+    }
+
+    BemaniFileType fileType = cachedFileType(clef, filename, file);
+    std::unique_ptr<Song> next(new Song);
+    try {
+      load(*next, clef, fileType, filename, file, token.get());
+    } catch (CancelledException&) {
+      // handled below
+    } catch (...) {
+      std::lock_guard<std::mutex> lock(loadMutex);
+      loading = false;
+      throw;
+    }
+
+    {
+      // The song is published under the lock so that a release() racing
+      // with the end of loading either cancels it or frees it afterward
+      std::lock_guard<std::mutex> lock(loadMutex);
+      loading = false;
+      if (!token->isCancelled()) {
+        song = std::move(next);
+        song->handedOut = true;
+        return song->synth;
+      }
+    }
+    // release() was called while loading, and it left the cleanup to us
+    std::cerr << "Cancelled loading " << filename << std::endl;
+    next.reset();
+    clef->purgeSamples();
+    return nullptr;
+  }
+
+  void load(Song& song, ClefContext* clef, BemaniFileType fileType, const std::string& filename, std::istream& file, const CancelToken* cancel) {
+    auto started = std::chrono::steady_clock::now();
+    FileOptions options(filename);
     if (fileType == FT_ifs) {
-      iidx.reset();
-      ifs.reset(new IFSSequence(clef));
-      ifs->addIFS(new IFS(file));
-      try {
-        auto paired(clef->openFile(IFS::pairedFile(filename)));
-        if (paired) {
-          ifs->addIFS(new IFS(*paired));
-        }
-      } catch (...) {
-        // no paired file, ignore
+      song.ifs.reset(new IFSSequence(clef));
+      FileSource fp(clef, filename, file);
+      if (!fp) {
+        return;
+      }
+      // Load every part so that mute/solo changes don't need a reload
+      song.ifs->setSplitParts(fp.hasParts());
+      // A window is cut from decoded samples, so it can't play compressed ones
+      fp.compressed = fp.compressed && !fp.hasWindow();
+      song.ifs->setLiveChanges(fp.hasParts() && !fp.compressed && !fp.hasWindow());
+      if (!fp.compressed) {
+        // Samples decode in the background in the order the chart uses them
+        song.scheduler.reset(new DecodeScheduler(clef, cancel));
+      }
+      std::vector<ByteSource*> sources{ fp };
+      std::unique_ptr<ByteSource> paired(ByteSource::open(clef, IFS::pairedFile(fp.filename)));
+      if (paired) {
+        sources.push_back(paired.get());
+      }
+      // The seq and bgm archives are parsed side by side
+      for (std::unique_ptr<IFS>& ifs : IFS::parseAll(sources)) {
+        song.ifs->addIFS(ifs.release());
       }
       clef->purgeSamples();
-      ifs->load();
-      return ifs->initContext();
+      song.ifs->setDecodeScheduler(song.scheduler.get());
+      song.ifs->setCancelToken(cancel);
+      fp.apply(song.ifs.get());
+      song.ifs->load();
+      if (fp.hasWindow()) {
+        // The window is cut from decoded samples. Otherwise the streams
+        // start playing from their compressed data right away.
+        song.ifs->waitForStreams();
+      }
+      song.synth = song.ifs->initContext();
+      if (song.scheduler) {
+        std::vector<ITrack*> tracks;
+        for (int i = 0; i < song.ifs->numTracks(); i++) {
+          tracks.push_back(song.ifs->getTrack(i));
+        }
+        startDecoding(song, tracks, options, started);
+      } else {
+        uint64_t compressedBytes, decodedBytes;
+        song.ifs->compressedMemory(compressedBytes, decodedBytes);
+        std::cerr << "Samples kept compressed: " << (compressedBytes >> 20) << " MB instead of " << (decodedBytes >> 20) << " MB decoded" << std::endl;
+      }
     } else if (fileType == FT_2dx) {
-      FilePtr fp(clef, filename, file);
-      if (!::load2DX(clef, fp, fp.subsong)) {
-        return nullptr;
+      FileSource fp(clef, filename, file);
+      if (!fp || !::load2DX(clef, fp, fp.subsong, 0, cancel)) {
+        return;
       }
-      SynthContext* synth = new SynthContext(clef, 44100);
-      stream.reset(new StreamSequence(clef, fp.subsong + 1));
-      synth->addChannel(stream->getTrack(0));
-      return synth;
+      song.synth = new SynthContext(clef, 44100);
+      song.hostOwnsSynth = true;
+      song.stream.reset(new StreamSequence(clef, fp.subsong + 1));
+      song.synth->addChannel(song.stream->getTrack(0));
+    } else if (fileType == FT_bundle) {
+      clef->purgeSamples();
+      // A mapped bundle stays open while it plays
+      ByteSource* source = ByteSource::open(clef, options.filename);
+      song.bundle.reset(new BundleSequence(clef, source ? source : new ByteSource(file)));
+      song.synth = song.bundle->initContext();
+    } else {
+      song.scheduler.reset(new DecodeScheduler(clef, cancel));
+      song.iidx.reset(new IIDXSequence(clef, options.filename));
+      song.iidx->setDecodeScheduler(song.scheduler.get());
+      song.iidx->setCancelToken(cancel);
+      song.synth = song.iidx->initContext();
+      startDecoding(song, { song.iidx->getTrack(0) }, options, started);
+    }
+    if (song.synth && options.hasWindow()) {
+      song.window.reset(new RenderWindow(clef, song.synth, options.start, options.end));
+      if (song.hostOwnsSynth) {
+        // The host deletes whichever context it's given
+        delete song.synth;
+        song.synth = song.window->releaseSynth();
+      } else {
+        song.synth = song.window->synth();
+      }
+    }
+  }
+
+  void startDecoding(Song& song, const std::vector<ITrack*>& tracks, const FileOptions& options, std::chrono::steady_clock::time_point started) {
+    if (options.hasWindow()) {
+      song.scheduler->setWindow(options.start, options.end);
+      song.scheduler->start(tracks);
+      // The window is cut from the decoded samples, so it needs all of them
+      song.scheduler->waitUntil(options.end > 0 ? options.end : std::numeric_limits<double>::infinity());
+    } else {
+      song.scheduler->start(tracks);
+      // Anything needed later is decoded while the first second plays
+      song.scheduler->waitUntil(1.0);
     }
-    ifs.reset();
-    iidx.reset(new IIDXSequence(clef, filename));
-    return iidx->initContext();
+    auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - started);
+    std::cerr << "First audio ready after " << elapsed.count() << " ms (" << song.scheduler->numDecoded() << " of "
+      << song.scheduler->numSamples() << " samples decoded)" << std::endl;
   }
 
+  // Change the parts heard in the song that's playing. These may be called
+  // from any thread and take effect within about 50 ms. They return false
+  // unless the song is an IFS song opened with part options and without a
+  // window or compressed samples.
+  bool setMutes(const std::string& parts) {
+    std::lock_guard<std::mutex> lock(loadMutex);
+    return song && song->ifs && song->ifs->queueMutes(parts);
+  }
+
+  bool setSolo(const std::string& parts) {
+    std::lock_guard<std::mutex> lock(loadMutex);
+    return song && song->ifs && song->ifs->queueSolo(parts);
+  }
+
+  bool setPartGain(const std::string& parts, double gain) {
+    std::lock_guard<std::mutex> lock(loadMutex);
+    return song && song->ifs && song->ifs->queuePartGain(IFSSequence::stringToSpaces(parts), gain);
+  }
+
+  // May be called from another thread while prepare() is running. Loading
+  // stops within a few milliseconds and prepare() returns null.
   void release() {
-    ifs.reset();
-    iidx.reset();
+    std::lock_guard<std::mutex> lock(loadMutex);
+    if (cancel) {
+      cancel->cancel();
+    }
+    if (!loading) {
+      freeSong();
+    }
   }
 
-  std::unique_ptr<IIDXSequence> iidx;
-  std::unique_ptr<IFSSequence> ifs;
-  std::unique_ptr<StreamSequence> stream;
+  // Only called with loadMutex held.
+  void freeSong() {
+    if (song && song->hostOwnsSynth) {
+      // The host deletes the SynthContext, which may still refer to the
+      // stream, so it's kept until the next song is freed.
+      retired = std::move(song);
+    }
+    song.reset();
+  }
+
+  // Loads the next file in the playlist on a background thread while the
+  // current one plays, so that a prepare() for the same filename returns
+  // as soon as the thread is done. The prefetched song decodes into its own
+  // context, and it's dropped if its samples would take more than
+  // prefetchBudget bytes. prepare() calls this with the song after the one
+  // it prepared.
+  void prefetch(const std::string& filename) {
+    cancelPrefetch();
+    prefetchFilename = filename;
+    prefetchToken.reset(new CancelToken);
+    prefetchAdopting = false;
+    prefetchThread = std::thread(&ClefPluginInfo::runPrefetch, this, filename, prefetchToken);
+  }
+
+  // Returns the entry after filename in the !tags.m3u playlist of its
+  // directory, or an empty string if there isn't one.
+  static std::string nextInPlaylist(const std::string& filename) {
+    size_t slashPos = filename.find_last_of("/\\");
+    std::string dir = slashPos == std::string::npos ? std::string() : filename.substr(0, slashPos + 1);
+    std::string name = filename.substr(dir.size());
+    std::ifstream playlist(dir + "!tags.m3u");
+    std::string line;
+    bool found = false;
+    while (std::getline(playlist, line)) {
+      if (!line.empty() && line.back() == '\r') {
+        line.pop_back();
+      }
+      if (line.empty() || line[0] == '#') {
+        continue;
+      } else if (found) {
+        return dir + line;
+      }
+      found = line == name;
+    }
+    return std::string();
+  }
+
+  // Returns the size of a file, or 0 if it can't be opened.
+  static uint64_t fileSize(ClefContext* clef, const std::string& filename) {
+    auto file = filename.empty() ? nullptr : clef->openFile(filename);
+    if (!file) {
+      return 0;
+    }
+    file->seekg(0, std::ios::end);
+    std::streamoff size = file->tellg();
+    return size > 0 ? size : 0;
+  }
+
+  // Read from BEMANI_CLEF_PREFETCH_MB, where 0 turns prefetching off
+  static uint64_t defaultPrefetchBudget() {
+    const char* budget = std::getenv("BEMANI_CLEF_PREFETCH_MB");
+    return uint64_t(budget && *budget ? std::strtoull(budget, nullptr, 10) : 512) << 20;
+  }
+
+  // Returns the memory a loaded song's samples take so far: keysounds
+  // decoded by its scheduler, samples and streams kept compressed, decoded
+  // phased streams, and a 2dx stream.
+  static uint64_t loadedBytes(const Song& song, ClefContext* clef, const FileOptions& options) {
+    uint64_t bytes = song.scheduler ? song.scheduler->decodedBytes() : 0;
+    if (song.ifs) {
+      uint64_t compressedBytes, decodedBytes;
+      song.ifs->compressedMemory(compressedBytes, decodedBytes);
+      bytes += compressedBytes + song.ifs->decodedStreamBytes();
+    }
+    if (song.stream) {
+      SampleData* sample = clef->getSample(options.subsong + 1);
+      bytes += sample ? sample->numSamples() * sample->channels.size() * sizeof(int16_t) : 0;
+    }
+    return bytes;
+  }
+
+  void runPrefetch(std::string filename, std::shared_ptr<CancelToken> token) {
+    std::unique_ptr<Song> next(new Song);
+    next->ownContext.reset(new ClefContext);
+    ClefContext* clef = next->ownContext.get();
+    try {
+      std::string path = FileOptions(filename).filename;
+      auto file = clef->openFile(path);
+      if (!file) {
+        return;
+      }
+      // Decoded samples are at least as large as the files they come from,
+      // which include the banks next to a chart and the other half of an
+      // IFS pair
+      uint64_t fileBytes = fileSize(clef, path);
+      for (const std::string& paired : pairedFiles(filename)) {
+        fileBytes += fileSize(clef, paired);
+      }
+      if (fileBytes > prefetchBudget) {
+        std::cerr << "Not prefetching " << filename << ": larger than the memory budget" << std::endl;
+        return;
+      }
+      BemaniFileType fileType = cachedFileType(clef, filename, *file);
+      if (fileType == FT_invalid) {
+        return;
+      }
+      load(*next, clef, fileType, filename, *file, token.get());
+      FileOptions options(filename);
+      DecodeScheduler* scheduler = next->scheduler.get();
+      // Keep decoding the rest until prepare() takes the song
+      while (true) {
+        if (loadedBytes(*next, clef, options) > prefetchBudget) {
+          std::cerr << "Dropping prefetch of " << filename << ": over the memory budget" << std::endl;
+          token->cancel();
+          return;
+        }
+        if (!scheduler || prefetchAdopting || scheduler->numDecoded() >= scheduler->numSamples()) {
+          break;
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        scheduler->publish();
+      }
+    } catch (CancelledException&) {
+      return;
+    } catch (std::exception& e) {
+      std::cerr << "Prefetch of " << filename << " failed: " << e.what() << std::endl;
+      return;
+    }
+    if (next->synth) {
+      prefetched = std::move(next);
+    }
+  }
+
+  std::unique_ptr<Song> takePrefetch(const std::string& filename) {
+    if (!prefetchThread.joinable()) {
+      return nullptr;
+    }
+    if (filename != prefetchFilename) {
+      cancelPrefetch();
+      return nullptr;
+    }
+    // Anything still decoding continues in the background during playback
+    prefetchAdopting = true;
+    prefetchThread.join();
+    return std::move(prefetched);
+  }
+
+  void cancelPrefetch() {
+    if (prefetchThread.joinable()) {
+      prefetchToken->cancel();
+      prefetchThread.join();
+    }
+    prefetched.reset();
+  }
+
+  // Guarded by loadMutex, along with retired, cancel, and loading
+  std::unique_ptr<Song> song;
+  std::unique_ptr<Song> retired;
+  std::mutex loadMutex;
+  std::shared_ptr<CancelToken> cancel;
+  bool loading = false;
+
+  std::thread prefetchThread;
+  std::string prefetchFilename;
+  std::shared_ptr<CancelToken> prefetchToken;
+  std::atomic<bool> prefetchAdopting{false};
+  std::unique_ptr<Song> prefetched;
+  uint64_t prefetchBudget = defaultPrefetchBudget();
 };
 
 const std::string ClefPluginInfo::version = "0.3.5";
@@ -144,6 +693,7 @@ ConstPairList ClefPluginInfo::extensions = {
   { "ssp", "Konami .ssp sample banks (*.ssp)" },
   // { "s3p", "Konami .s3p sample banks (*.s3p)" },
   { "ifs", "Konami IFS files (*.ifs)" },
+  { "bclef", "bemani-clef song bundles (*.bclef)" },
 };
 const std::string ClefPluginInfo::about =
   "bemani-clef copyright (C) 2020-2025 Adam Higerd\n"
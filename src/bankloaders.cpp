@@ -3,43 +3,49 @@
 #include "codec/riffcodec.h"
 #include "wma/asfcodec.h"
 #include "wma/wmacodec.h"
+#include "samplecache.h"
+#include "canceltoken.h"
+#include "bytesource.h"
+#include <algorithm>
 #include <iostream>
+#include <string>
 
-int loadS3P(ClefContext* ctx, std::istream* file, uint64_t space)
+int loadS3P(ClefContext* ctx, ByteSource* file, uint64_t space, const CancelToken* cancel, int downsample)
 {
   AsfCodec wmaCodec(ctx);
-  std::vector<char> buffer(12);
-  if (!file->read(buffer.data(), 8)) {
+  wmaCodec.setCancelToken(cancel);
+  wmaCodec.setDownsample(downsample);
+  // Reduced-rate decodes are cached separately from full ones
+  std::string params = downsample > 1 ? "wma/" + std::to_string(downsample) : "wma";
+  const uint8_t* header = file->view(0, 8);
+  if (!header || parseIntBE<uint32_t>(header, 0) != 'S3P0') {
     return 0;
   }
-  if (parseIntBE<uint32_t>(buffer, 0) != 'S3P0') {
-    return 0;
-  }
-  uint32_t numSamples = parseInt<uint32_t>(buffer, 4);
+  uint32_t numSamples = parseInt<uint32_t>(header, 4);
   std::vector<uint32_t> offsets;
   offsets.reserve(numSamples);
-  for (int i = 0; file && i < numSamples; i++) {
-    file->read(buffer.data(), 8);
-    offsets.push_back(parseInt<uint32_t>(buffer, 0));
+  for (int i = 0; i < numSamples; i++) {
+    const uint8_t* entry = file->view(8 + i * 8, 8);
+    if (!entry) {
+      return 0;
+    }
+    offsets.push_back(parseInt<uint32_t>(entry, 0));
   }
   int samplesRead = 0;
-  int wmaOffset;
-  while (file && samplesRead < numSamples) {
+  while (samplesRead < numSamples) {
+    CancelToken::check(cancel);
     //std::cerr << samplesRead << " loading " << offsets[samplesRead] << std::endl;
-    if (!file->seekg(offsets[samplesRead])) {
-      return 0;
-    }
-    if (!file->read(buffer.data(), 12) || parseIntBE<uint32_t>(buffer, 0) != 'S3V0') {
+    const uint8_t* sampleHeader = file->view(offsets[samplesRead], 12);
+    if (!sampleHeader || parseIntBE<uint32_t>(sampleHeader, 0) != 'S3V0') {
       return 0;
     }
-    wmaOffset = parseInt<uint32_t>(buffer, 4);
-    std::vector<uint8_t> wmaData(parseInt<uint32_t>(buffer, 8));
-    file->ignore(wmaOffset - 12);
-    if (!file->read(reinterpret_cast<char*>(wmaData.data()), wmaData.size())) {
+    uint32_t wmaOffset = parseInt<uint32_t>(sampleHeader, 4);
+    std::vector<uint8_t> wmaData(parseInt<uint32_t>(sampleHeader, 8));
+    if (!file->read(uint64_t(offsets[samplesRead]) + wmaOffset, wmaData.data(), wmaData.size())) {
       return 0;
     }
     try {
-      wmaCodec.decode(wmaData, (samplesRead + 1) | space);
+      SampleCache::decode(&wmaCodec, params, wmaData, (samplesRead + 1) | space);
     } catch (WmaException& w) {
       std::cerr << "Ignoring error in sample #" << samplesRead << ": " << w.what() << std::endl;
     }
@@ -49,46 +55,53 @@ int loadS3P(ClefContext* ctx, std::istream* file, uint64_t space)
   return samplesRead == numSamples;
 }
 
-static std::vector<int> get2DXSampleOffsets(std::istream* file)
+static std::vector<int> get2DXSampleOffsets(ByteSource* file)
 {
   std::vector<int> offsets;
-  std::vector<char> buffer(4);
-  if (!file->read(buffer.data(), 4)) {
+  const uint8_t* magic = file->view(0, 1);
+  if (!magic) {
     return offsets;
   }
   uint32_t offsetBase = 0;
-  if (buffer[0] == '%') {
-    file->ignore(24);
+  uint64_t countPos = 20;
+  if (magic[0] == '%') {
     offsetBase = 8;
-  } else {
-    file->ignore(16);
+    countPos = 28;
   }
-  if (!file->read(buffer.data(), 4)) {
+  const uint8_t* count = file->view(countPos, 4);
+  if (!count) {
+    return offsets;
+  }
+  uint32_t numSamples = parseInt<uint32_t>(count, 0);
+  // A truncated table keeps the entries that are present
+  uint64_t tablePos = countPos + 52;
+  uint64_t available = file->size() > tablePos ? (file->size() - tablePos) / 4 : 0;
+  numSamples = std::min<uint64_t>(numSamples, available);
+  const uint8_t* table = file->view(tablePos, numSamples * 4);
+  if (!table) {
     return offsets;
   }
-  uint32_t numSamples = parseInt<uint32_t>(buffer, 0);
-  file->ignore(48);
   offsets.reserve(numSamples);
-  for (int i = 0; file && i < numSamples; i++) {
-    file->read(buffer.data(), 4);
-    offsets.push_back(parseInt<uint32_t>(buffer, 0) + offsetBase);
+  for (int i = 0; i < numSamples; i++) {
+    offsets.push_back(parseInt<uint32_t>(table, i * 4) + offsetBase);
   }
   return offsets;
 }
 
-int load2DX(ClefContext* ctx, std::istream* file, uint64_t space, uint64_t onlySample)
+int load2DX(ClefContext* ctx, ByteSource* file, uint64_t space, uint64_t onlySample, const CancelToken* cancel)
 {
   std::vector<int> offsets = get2DXSampleOffsets(file);
   int numSamples = offsets.size();
   if (!numSamples) {
     return 0;
   }
-  std::vector<char> buffer(18);
+  uint8_t buffer[18];
   int samplesRead = 0;
   int bgSamplesRead = 0;
   int riffOffset;
   RiffCodec riffCodec(ctx);
-  while (file && samplesRead < numSamples) {
+  while (samplesRead < numSamples) {
+    CancelToken::check(cancel);
     if (!offsets[samplesRead]) {
       // Sample table entry is null
       samplesRead++;
@@ -98,7 +111,7 @@ int load2DX(ClefContext* ctx, std::istream* file, uint64_t space, uint64_t onlyS
       samplesRead++;
       continue;
     }
-    if (!file->seekg(offsets[samplesRead]) || !file->read(buffer.data(), 18)) {
+    if (!file->read(offsets[samplesRead], buffer, 18)) {
       return 0;
     }
     uint32_t magic = parseIntBE<uint32_t>(buffer, 0);
@@ -110,11 +123,10 @@ int load2DX(ClefContext* ctx, std::istream* file, uint64_t space, uint64_t onlyS
     uint16_t sampleType = parseInt<uint16_t>(buffer, 12);
     //std::cerr << sampleID << " @ offset " << offsets[samplesRead] << ": " << std::hex << sampleType << std::dec << std::endl;
     std::vector<uint8_t> riffData(parseInt<uint32_t>(buffer, 8));
-    file->ignore(riffOffset - 18);
-    if (!file->read(reinterpret_cast<char*>(riffData.data()), riffData.size())) {
+    if (!file->read(uint64_t(offsets[samplesRead]) + riffOffset, riffData.data(), riffData.size())) {
       return 0;
     }
-    riffCodec.decode(riffData, sampleID);
+    SampleCache::decode(&riffCodec, "riff", riffData, sampleID);
     // 0x3231 appears to be IIDX
     // 0x3230 appears to be pop'n, but maybe IIDX system bgm
     // SDVX apparently also uses .2dx?
@@ -125,7 +137,7 @@ int load2DX(ClefContext* ctx, std::istream* file, uint64_t space, uint64_t onlyS
       if (tracks == 0x0000) {
         // Keep track of the last background sample
         sampleID = 0x10001 | space;
-        riffCodec.decode(riffData, sampleID);
+        SampleCache::decode(&riffCodec, "riff", riffData, sampleID);
       }
     }
     samplesRead++;
@@ -137,7 +149,7 @@ int load2DX(ClefContext* ctx, std::istream* file, uint64_t space, uint64_t onlyS
   return 0;
 }
 
-std::vector<uint64_t> get2DXSampleIDs(ClefContext* ctx, std::istream* file, uint64_t space)
+std::vector<uint64_t> get2DXSampleIDs(ClefContext* ctx, ByteSource* file, uint64_t space)
 {
   std::vector<uint64_t> ids;
   std::vector<int> offsets = get2DXSampleOffsets(file);
@@ -154,33 +166,113 @@ std::vector<uint64_t> get2DXSampleIDs(ClefContext* ctx, std::istream* file, uint
   return ids;
 }
 
-double get2DXSampleLength(std::istream* file, uint64_t sampleID)
+double riffDuration(ByteSource* file, uint64_t riffStart, uint32_t riffSize)
 {
-  sampleID -= 1;
-  std::vector<int> offsets = get2DXSampleOffsets(file);
-  int numSamples = offsets.size();
-  if (!numSamples || numSamples < sampleID || !offsets[sampleID]) {
+  uint8_t buffer[20];
+  if (!file->read(riffStart, buffer, 12) || parseIntBE<uint32_t>(buffer, 0) != 'RIFF' || parseIntBE<uint32_t>(buffer, 8) != 'WAVE') {
+    return 0;
+  }
+  uint16_t formatTag = 0, channels = 0, blockAlign = 0, samplesPerBlock = 0;
+  uint32_t sampleRate = 0, factFrames = 0, dataSize = 0;
+  bool hasFormat = false, hasFact = false, hasData = false;
+  uint64_t pos = 12;
+  while (!hasData && pos + 8 <= riffSize && file->read(riffStart + pos, buffer, 8)) {
+    uint32_t chunkID = parseIntBE<uint32_t>(buffer, 0);
+    uint32_t chunkSize = parseInt<uint32_t>(buffer, 4);
+    uint64_t skip = uint64_t(chunkSize) + (chunkSize & 1);
+    pos += 8;
+    if (chunkID == 'fmt ' && chunkSize >= 16) {
+      uint32_t readSize = std::min<uint32_t>(chunkSize, 20);
+      if (!file->read(riffStart + pos, buffer, readSize)) {
+        return 0;
+      }
+      formatTag = parseInt<uint16_t>(buffer, 0);
+      channels = parseInt<uint16_t>(buffer, 2);
+      sampleRate = parseInt<uint32_t>(buffer, 4);
+      blockAlign = parseInt<uint16_t>(buffer, 12);
+      if (readSize >= 20 && parseInt<uint16_t>(buffer, 16) >= 2) {
+        // ADPCM formats store the frames per block after cbSize
+        samplesPerBlock = parseInt<uint16_t>(buffer, 18);
+      }
+      hasFormat = true;
+    } else if (chunkID == 'fact' && chunkSize >= 4) {
+      if (!file->read(riffStart + pos, buffer, 4)) {
+        return 0;
+      }
+      factFrames = parseInt<uint32_t>(buffer, 0);
+      hasFact = true;
+    } else if (chunkID == 'data') {
+      // The payload size can overstate a truncated data chunk
+      dataSize = std::min<uint64_t>(chunkSize, riffSize - pos);
+      hasData = true;
+    }
+    pos += skip;
+  }
+  if (!hasFormat || !hasData || !channels || !sampleRate || !blockAlign) {
     return 0;
   }
-  std::vector<char> buffer(18);
-  RiffCodec riffCodec(nullptr);
-  if (!file->seekg(offsets[sampleID]) || !file->read(buffer.data(), 18)) {
+
+  uint64_t frames;
+  if (formatTag == 2 || formatTag == 0x11) {
+    // MS-ADPCM blocks start with a 7-byte header per channel holding two
+    // frames; IMA ADPCM blocks with a 4-byte header holding one.
+    int headerBytes = (formatTag == 2 ? 7 : 4) * channels;
+    int headerFrames = formatTag == 2 ? 2 : 1;
+    if (!samplesPerBlock && blockAlign > headerBytes) {
+      samplesPerBlock = (blockAlign - headerBytes) * 2 / channels + headerFrames;
+    }
+    frames = uint64_t(dataSize / blockAlign) * samplesPerBlock;
+    uint32_t partial = dataSize % blockAlign;
+    if (partial >= headerBytes) {
+      frames += std::min<uint64_t>(samplesPerBlock, (partial - headerBytes) * 2 / channels + headerFrames);
+    }
+    // fact gives the exact count when the last block is padded, but a bogus
+    // one mustn't claim more than the blocks hold
+    if (hasFact) {
+      frames = std::min<uint64_t>(frames, factFrames);
+    }
+  } else if (hasFact && formatTag != 1) {
+    frames = factFrames;
+  } else {
+    frames = dataSize / blockAlign;
+  }
+  return double(frames) / sampleRate;
+}
+
+// Returns the duration of the 2DX sample at the given offset by reading its
+// headers.
+static double read2DXSampleLength(ByteSource* file, int offset)
+{
+  uint8_t buffer[18];
+  if (!offset || !file->read(offset, buffer, 18)) {
     return 0;
   }
   uint32_t magic = parseIntBE<uint32_t>(buffer, 0);
   if (magic != '2DX9' && magic != 'SD9\0') {
     return 0;
   }
-  int riffOffset = parseInt<uint32_t>(buffer, 4);
-  uint16_t sampleType = parseInt<uint16_t>(buffer, 12);
-  std::vector<uint8_t> riffData(parseInt<uint32_t>(buffer, 8));
-  file->ignore(riffOffset - 18);
-  if (!file->read(reinterpret_cast<char*>(riffData.data()), riffData.size())) {
+  uint32_t riffOffset = parseInt<uint32_t>(buffer, 4);
+  uint32_t riffSize = parseInt<uint32_t>(buffer, 8);
+  return riffDuration(file, uint64_t(offset) + riffOffset, riffSize);
+}
+
+double get2DXSampleLength(ByteSource* file, uint64_t sampleID)
+{
+  sampleID -= 1;
+  std::vector<int> offsets = get2DXSampleOffsets(file);
+  if (sampleID >= offsets.size()) {
     return 0;
   }
-  std::unique_ptr<SampleData> sample(riffCodec.decode(riffData, SampleData::Uncached));
-  if (!sample) {
-    return 0;
+  return read2DXSampleLength(file, offsets[sampleID]);
+}
+
+std::vector<double> get2DXSampleLengths(ByteSource* file)
+{
+  std::vector<int> offsets = get2DXSampleOffsets(file);
+  std::vector<double> lengths;
+  lengths.reserve(offsets.size());
+  for (int offset : offsets) {
+    lengths.push_back(read2DXSampleLength(file, offset));
   }
-  return sample->duration();
+  return lengths;
 }
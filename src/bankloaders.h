@@ -1,14 +1,24 @@
 #ifndef B2W_BANKLOADERS_H
 #define B2W_BANKLOADERS_H
 
-#include <fstream>
 #include <vector>
 #include <stdint.h>
 
 class ClefContext;
-int loadS3P(ClefContext* ctx, std::istream* file, uint64_t space = 0);
-int load2DX(ClefContext* ctx, std::istream* file, uint64_t space = 0, uint64_t onlySample = 0);
-std::vector<uint64_t> get2DXSampleIDs(ClefContext* ctx, std::istream* file, uint64_t space = 0);
-double get2DXSampleLength(std::istream* file, uint64_t sampleID);
+class CancelToken;
+class ByteSource;
+
+// The loaders throw CancelledException if the token is cancelled partway.
+// A downsample factor of 2 or 4 decodes S3P samples at a reduced rate.
+int loadS3P(ClefContext* ctx, ByteSource* file, uint64_t space = 0, const CancelToken* cancel = nullptr, int downsample = 1);
+int load2DX(ClefContext* ctx, ByteSource* file, uint64_t space = 0, uint64_t onlySample = 0, const CancelToken* cancel = nullptr);
+std::vector<uint64_t> get2DXSampleIDs(ClefContext* ctx, ByteSource* file, uint64_t space = 0);
+// Durations are read from the sample headers without decoding.
+double get2DXSampleLength(ByteSource* file, uint64_t sampleID);
+// Returns the duration of every sample in the bank in one pass. Index i
+// holds sample ID i + 1; empty table entries are 0.
+std::vector<double> get2DXSampleLengths(ByteSource* file);
+// The duration of a RIFF WAVE file starting at the given offset
+double riffDuration(ByteSource* file, uint64_t riffStart, uint32_t riffSize);
 
 #endif
@@ -0,0 +1,210 @@
+#include "batchrunner.h"
+#include "clefcontext.h"
+#include "ifs/ifs.h"
+#include "pathutils.h"
+#include "samplestore.h"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <fstream>
+#include <iostream>
+#include <mutex>
+#include <stdexcept>
+#include <thread>
+
+static bool isPlayable(const std::string& filename)
+{
+  int extPos = filename.rfind('.');
+  if (extPos == std::string::npos) {
+    return false;
+  }
+  std::string ext = filename.substr(extPos + 1);
+  std::transform(ext.begin(), ext.end(), ext.begin(), ::tolower);
+  return ext == "1" || ext == "ifs" || ext == "2dx" || ext == "ssp" || ext == "bclef";
+}
+
+static void findInDirectory(const std::string& path, std::vector<std::string>& inputs)
+{
+  for (const std::string& name : listDirectory(path)) {
+    std::string child = path + "/" + name;
+    if (isDirectory(child)) {
+      findInDirectory(child, inputs);
+    } else if (isPlayable(name)) {
+      inputs.push_back(child);
+    }
+  }
+}
+
+// Drops files that are loaded alongside another input: the bgm half of a
+// gitadora IFS pair and the sample bank next to a .1 chart.
+static void removeCompanions(std::vector<std::string>& inputs)
+{
+  std::vector<std::string> sorted(inputs);
+  std::sort(sorted.begin(), sorted.end());
+  auto found = [&sorted](const std::string& path) {
+    return !path.empty() && std::binary_search(sorted.begin(), sorted.end(), path);
+  };
+  inputs.erase(std::remove_if(inputs.begin(), inputs.end(), [&found](const std::string& input) {
+    int extPos = input.rfind('.');
+    std::string ext = input.substr(extPos + 1);
+    std::transform(ext.begin(), ext.end(), ext.begin(), ::tolower);
+    if (ext == "2dx" || ext == "ssp") {
+      return found(input.substr(0, extPos + 1) + "1");
+    }
+    return input.rfind("bgm.ifs") != std::string::npos && found(IFS::pairedFile(input));
+  }), inputs.end());
+}
+
+std::vector<std::string> BatchRunner::findInputs(const std::string& listOrDirectory)
+{
+  std::vector<std::string> inputs;
+  if (isDirectory(listOrDirectory)) {
+    std::string path = listOrDirectory;
+    while (path.size() > 1 && (path.back() == '/' || path.back() == '\\')) {
+      path.pop_back();
+    }
+    findInDirectory(path, inputs);
+    removeCompanions(inputs);
+    return inputs;
+  }
+  std::ifstream list(listOrDirectory);
+  if (!list) {
+    throw std::runtime_error("unable to open " + listOrDirectory);
+  }
+  std::string line;
+  while (std::getline(list, line)) {
+    while (!line.empty() && (line.back() == '\r' || line.back() == ' ' || line.back() == '\t')) {
+      line.pop_back();
+    }
+    if (!line.empty() && line[0] != '#') {
+      inputs.push_back(line);
+    }
+  }
+  return inputs;
+}
+
+BatchRunner::BatchRunner(const std::string& outputTemplate, const std::string& extension)
+: outputTemplate(outputTemplate.empty() ? "{path}.{ext}" : outputTemplate), extension(extension)
+{
+  // initializers only
+}
+
+std::string BatchRunner::outputFilename(const std::string& input) const
+{
+  int slashPos = input.find_last_of("/\\");
+  std::string dir = slashPos == std::string::npos ? "." : input.substr(0, slashPos);
+  std::string name = slashPos == std::string::npos ? input : input.substr(slashPos + 1);
+  int extPos = name.rfind('.');
+  if (extPos != std::string::npos && extPos > 0) {
+    name = name.substr(0, extPos);
+  }
+
+  std::string result;
+  for (size_t i = 0; i < outputTemplate.size(); i++) {
+    if (outputTemplate[i] == '{') {
+      size_t end = outputTemplate.find('}', i);
+      if (end != std::string::npos) {
+        std::string key = outputTemplate.substr(i + 1, end - i - 1);
+        const std::string* value = nullptr;
+        if (key == "path") {
+          value = &input;
+        } else if (key == "dir") {
+          value = &dir;
+        } else if (key == "name") {
+          value = &name;
+        } else if (key == "ext") {
+          value = &extension;
+        }
+        if (value) {
+          result += *value;
+          i = end;
+          continue;
+        }
+      }
+    }
+    result += outputTemplate[i];
+  }
+  return result;
+}
+
+int BatchRunner::run(const std::vector<std::string>& inputs, int numWorkers, const Job& job)
+{
+  if (numWorkers < 1) {
+    numWorkers = std::max(1u, std::thread::hardware_concurrency());
+  }
+  if (numWorkers > inputs.size()) {
+    numWorkers = std::max<int>(1, inputs.size());
+  }
+
+  std::mutex mutex;
+  std::atomic<size_t> nextInput(0);
+  int completed = 0;
+  std::vector<std::string> failures;
+  auto startTime = std::chrono::steady_clock::now();
+
+  auto worker = [&]{
+    ClefContext clef;
+    SampleStore* store = SampleStore::get();
+    if (store) {
+      store->lend(&clef);
+    }
+    for (size_t i = nextInput++; i < inputs.size(); i = nextInput++) {
+      const std::string& input = inputs[i];
+      std::string error;
+      try {
+        std::string output = outputFilename(input);
+        createParentDirectories(output);
+        if (job(&clef, input, output) != 0) {
+          error = "failed";
+        }
+      } catch (std::exception& e) {
+        error = e.what();
+      } catch (...) {
+        error = "unknown error";
+      }
+      if (store) {
+        store->release(&clef);
+      }
+      clef.purgeSamples();
+
+      std::lock_guard<std::mutex> lock(mutex);
+      completed++;
+      std::cerr << "[" << completed << "/" << inputs.size() << "] " << input;
+      if (error.empty()) {
+        std::cerr << ": done" << std::endl;
+      } else {
+        std::cerr << ": " << error << std::endl;
+        failures.push_back(input);
+      }
+    }
+    if (store) {
+      store->lend(&clef, false);
+    }
+  };
+
+  std::vector<std::thread> pool;
+  for (int i = 1; i < numWorkers; i++) {
+    pool.emplace_back(worker);
+  }
+  worker();
+  for (std::thread& thread : pool) {
+    thread.join();
+  }
+
+  double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - startTime).count();
+  int succeeded = inputs.size() - failures.size();
+  std::cerr << "Processed " << succeeded << " of " << inputs.size() << " inputs in " << (int(seconds * 10) * .1)
+    << " seconds using " << numWorkers << " workers (" << (int(succeeded * 600 / std::max(seconds, 0.001)) * .1)
+    << " songs per minute)" << std::endl;
+  if (SampleStore* store = SampleStore::get()) {
+    store->report(std::cerr);
+  }
+  if (!failures.empty()) {
+    std::sort(failures.begin(), failures.end());
+    std::cerr << failures.size() << " failed:" << std::endl;
+    for (const std::string& input : failures) {
+      std::cerr << "  " << input << std::endl;
+    }
+  }
+  return failures.size();
+}
@@ -0,0 +1,36 @@
+#ifndef B2W_BATCHRUNNER_H
+#define B2W_BATCHRUNNER_H
+
+#include <functional>
+#include <string>
+#include <vector>
+class ClefContext;
+
+// Processes a list of input files on a fixed pool of worker threads. Each
+// worker owns a ClefContext that is reused from one input to the next, and
+// a failure in one input is reported without stopping the others.
+class BatchRunner {
+public:
+  // Returns 0 on success. Exceptions are caught and count as failures.
+  using Job = std::function<int(ClefContext* clef, const std::string& input, const std::string& output)>;
+
+  // The output template may contain {path} (the input path), {dir} (the
+  // directory containing the input), {name} (the input filename without its
+  // extension), and {ext} (the output extension).
+  BatchRunner(const std::string& outputTemplate, const std::string& extension);
+
+  // Reads a list file with one input per line, or searches a directory
+  // recursively for playable files.
+  static std::vector<std::string> findInputs(const std::string& listOrDirectory);
+
+  std::string outputFilename(const std::string& input) const;
+
+  // Returns the number of inputs that failed
+  int run(const std::vector<std::string>& inputs, int numWorkers, const Job& job);
+
+private:
+  std::string outputTemplate;
+  std::string extension;
+};
+
+#endif
@@ -1,19 +1,83 @@
 #include "bmpcodec.h"
 #include "utility.h"
 #include "codec/adpcmcodec.h"
+#include "compressedsample.h"
+#include "canceltoken.h"
+#include "clefcontext.h"
+#include <algorithm>
+
+static double bytesPerSecond(const std::vector<uint8_t>& data)
+{
+  // Stereo streams store one byte per sample frame, mono streams store two frames per byte
+  int channels = data[16];
+  double sampleRate = parseIntBE<int32_t>(data, 20);
+  return channels > 1 ? sampleRate : sampleRate / 2;
+}
+
+double BmpCodec::duration(const std::vector<uint8_t>& data)
+{
+  if (data.size() < 32) {
+    return 0;
+  }
+  return (data.size() - 32) / bytesPerSecond(data);
+}
+
+CompressedSample* BmpCodec::compress(const std::vector<uint8_t>& data)
+{
+  if (data.size() <= 32) {
+    return nullptr;
+  }
+  int channels = data[16] == 2 ? 2 : 1;
+  if (!CompressedSample::canCompress(channels)) {
+    return nullptr;
+  }
+  return new CompressedSample(data.data() + 32, data.size() - 32, channels, parseIntBE<int32_t>(data, 20));
+}
 
 BmpCodec::BmpCodec(ClefContext* ctx)
-: ICodec(ctx)
+: ICodec(ctx), cancel(nullptr)
 {
   // initializers only
 }
 
 SampleData* BmpCodec::decodeRange(std::vector<uint8_t>::const_iterator start, std::vector<uint8_t>::const_iterator end, uint64_t sampleID)
 {
+  CancelToken::check(cancel);
   int channels = start[16];
   int32_t sampleRate = parseIntBE<int32_t>(start, 20);
+  if (cancel && end - start > 32) {
+    // libclef decodes a stream in a single call that can't be interrupted,
+    // and our own decoder produces the same output.
+    int layout = channels == 2 ? 2 : 1;
+    const uint8_t* data = &*(start + 32);
+    size_t size = end - start - 32;
+    SampleData* sample = new SampleData(context(), sampleID, sampleRate);
+    sample->channels.resize(layout);
+    for (auto& channel : sample->channels) {
+      channel.resize(layout > 1 ? size : size * 2);
+    }
+    CompressedSample::decodeAll(data, size, layout, sample->channels[0].data(), layout > 1 ? sample->channels[1].data() : nullptr, cancel);
+    return sample;
+  }
   AdpcmCodec adpcm(context(), AdpcmCodec::OKI4s, channels == 2 ? -1 : 0);
   SampleData* sample = adpcm.decodeRange(start + 32, end, sampleID);
   sample->sampleRate = sampleRate;
+  CancelToken::check(cancel);
   return sample;
 }
+
+void BmpCodec::setCancelToken(const CancelToken* cancel)
+{
+  this->cancel = cancel;
+}
+
+SampleData* BmpCodec::decodePrefix(const std::vector<uint8_t>& data, double seconds, uint64_t sampleID)
+{
+  // ADPCM decoding only depends on earlier data, so a prefix decodes to
+  // exactly the same samples as the start of a full decode.
+  size_t length = 32 + size_t(seconds * bytesPerSecond(data));
+  if (length > data.size()) {
+    length = data.size();
+  }
+  return decodeRange(data.begin(), data.begin() + length, sampleID);
+}
@@ -2,13 +2,28 @@
 #define GD2W_BMPCODEC_H
 
 #include "codec/icodec.h"
+class CompressedSample;
+class CancelToken;
 
 class BmpCodec : public ICodec
 {
 public:
+  static double duration(const std::vector<uint8_t>& data);
+
+  // Returns the stream as a sample that decodes on demand, or null if
+  // compressed storage isn't available for its channel layout.
+  static CompressedSample* compress(const std::vector<uint8_t>& data);
+
   BmpCodec(ClefContext* ctx);
 
   virtual SampleData* decodeRange(std::vector<uint8_t>::const_iterator start, std::vector<uint8_t>::const_iterator end, uint64_t sampleID = 0);
+  SampleData* decodePrefix(const std::vector<uint8_t>& data, double seconds, uint64_t sampleID = 0);
+
+  // Makes decodeRange() throw CancelledException once the token is set.
+  void setCancelToken(const CancelToken* cancel);
+
+private:
+  const CancelToken* cancel;
 };
 
 #endif
@@ -0,0 +1,319 @@
+#include "bundle.h"
+#include "bytesource.h"
+#include "clefcontext.h"
+#include "codec/sampledata.h"
+#include <cstring>
+#include <fstream>
+#include <stdexcept>
+#include <unordered_map>
+
+static const uint32_t bundleVersion = 1;
+static const uint64_t pageSize = 4096;
+
+namespace {
+
+struct BundleHeader {
+  char magic[4];
+  uint32_t version;
+  double sampleRate;
+  double length;
+  uint32_t numTracks;
+  uint32_t numSamples;
+  uint64_t numEvents;
+  uint64_t eventOffset;
+  uint64_t sampleOffset;
+};
+
+struct BundleEvent {
+  double timestamp;
+  double duration;
+  double volume;
+  double pan;
+  uint64_t sampleID;
+  uint64_t playbackID;
+  uint32_t track;
+  uint32_t type;
+};
+
+struct BundleSample {
+  uint64_t sampleID;
+  uint64_t offset;
+  uint64_t numSamples;
+  double sampleRate;
+  uint32_t numChannels;
+  int32_t loopStart;
+  int32_t loopEnd;
+  uint32_t reserved;
+};
+
+static_assert(sizeof(BundleHeader) == 56, "unexpected bundle header layout");
+static_assert(sizeof(BundleEvent) == 56, "unexpected bundle event layout");
+static_assert(sizeof(BundleSample) == 48, "unexpected bundle sample layout");
+
+uint64_t alignPage(uint64_t offset)
+{
+  return (offset + pageSize - 1) & ~(pageSize - 1);
+}
+
+}
+
+void BundleSequence::write(const std::string& filename, ClefContext* ctx, double sampleRate, const std::vector<ITrack*>& tracks)
+{
+  std::vector<BundleEvent> events;
+  std::vector<SampleData*> samples;
+  std::unordered_map<uint64_t, int> sampleIndex;
+  double length = 0;
+  for (int i = 0; i < tracks.size(); i++) {
+    ITrack* track = tracks[i];
+    track->reset();
+    if (track->length() > length) {
+      length = track->length();
+    }
+    while (!track->isFinished()) {
+      std::shared_ptr<SequenceEvent> event = track->nextEvent();
+      if (!event) {
+        break;
+      }
+      BundleEvent record;
+      std::memset(&record, 0, sizeof(record));
+      record.timestamp = event->timestamp;
+      record.track = i;
+      double end = record.timestamp;
+      if (SampleEvent* sampleEvent = dynamic_cast<SampleEvent*>(event.get())) {
+        SampleData* sample = ctx->getSample(sampleEvent->sampleID);
+        if (!sample) {
+          // A bundle without the sample would play silence in its place
+          throw std::runtime_error("sample " + std::to_string(sampleEvent->sampleID) + " is played but not loaded");
+        }
+        record.type = SampleEvent::TypeID;
+        record.sampleID = sampleEvent->sampleID;
+        record.playbackID = sampleEvent->playbackID;
+        record.volume = sampleEvent->volume;
+        record.pan = sampleEvent->pan;
+        // A duration of zero plays the whole sample, which isn't the same
+        // as a duration of its length, so it's stored as it was
+        record.duration = sampleEvent->duration;
+        end += record.duration > 0 ? record.duration : sample->duration();
+        if (!sampleIndex.count(sample->sampleID)) {
+          sampleIndex[sample->sampleID] = samples.size();
+          samples.push_back(sample);
+        }
+      } else if (KillEvent* kill = dynamic_cast<KillEvent*>(event.get())) {
+        record.type = KillEvent::TypeID;
+        record.playbackID = kill->playbackID;
+      } else {
+        continue;
+      }
+      if (end > length) {
+        length = end;
+      }
+      events.push_back(record);
+    }
+    track->reset();
+  }
+
+  BundleHeader header;
+  std::memset(&header, 0, sizeof(header));
+  std::memcpy(header.magic, "B2WB", 4);
+  header.version = bundleVersion;
+  header.sampleRate = sampleRate;
+  header.length = length;
+  header.numTracks = tracks.size();
+  header.numSamples = samples.size();
+  header.numEvents = events.size();
+  header.eventOffset = pageSize;
+  header.sampleOffset = header.eventOffset + events.size() * sizeof(BundleEvent);
+
+  std::vector<BundleSample> sampleTable;
+  uint64_t offset = alignPage(header.sampleOffset + samples.size() * sizeof(BundleSample));
+  for (SampleData* sample : samples) {
+    BundleSample record;
+    std::memset(&record, 0, sizeof(record));
+    record.sampleID = sample->sampleID;
+    record.offset = offset;
+    record.numSamples = sample->channels.empty() ? 0 : sample->channels[0].size();
+    record.sampleRate = sample->sampleRate;
+    record.numChannels = sample->channels.size();
+    record.loopStart = sample->loopStart;
+    record.loopEnd = sample->loopEnd;
+    sampleTable.push_back(record);
+    offset = alignPage(offset + record.numSamples * record.numChannels * sizeof(int16_t));
+  }
+
+  std::ofstream file(filename, std::ios::out | std::ios::binary | std::ios::trunc);
+  if (!file) {
+    throw std::runtime_error("unable to open " + filename);
+  }
+  std::vector<char> padding(pageSize, 0);
+  auto padTo = [&file, &padding](uint64_t target) {
+    uint64_t pos = file.tellp();
+    if (target > pos) {
+      file.write(padding.data(), target - pos);
+    }
+  };
+  file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+  padTo(header.eventOffset);
+  file.write(reinterpret_cast<const char*>(events.data()), events.size() * sizeof(BundleEvent));
+  file.write(reinterpret_cast<const char*>(sampleTable.data()), sampleTable.size() * sizeof(BundleSample));
+  for (int i = 0; i < samples.size(); i++) {
+    padTo(sampleTable[i].offset);
+    for (const auto& channel : samples[i]->channels) {
+      file.write(reinterpret_cast<const char*>(channel.data()), sampleTable[i].numSamples * sizeof(int16_t));
+    }
+  }
+  padTo(offset);
+  if (!file) {
+    throw std::runtime_error("error writing " + filename);
+  }
+}
+
+bool BundleSequence::probe(std::istream& file, double* sampleRate, double* length)
+{
+  std::streampos start = file.tellg();
+  BundleHeader header;
+  bool valid = file.read(reinterpret_cast<char*>(&header), sizeof(header)) &&
+    std::memcmp(header.magic, "B2WB", 4) == 0 && header.version == bundleVersion;
+  file.clear();
+  file.seekg(start);
+  if (valid && sampleRate) {
+    *sampleRate = header.sampleRate;
+  }
+  if (valid && length) {
+    *length = header.length;
+  }
+  return valid;
+}
+
+// Loads each sample the first time the track plays it
+class BundleSequence::LazyTrack : public BasicTrack {
+public:
+  LazyTrack(BundleSequence* seq)
+  : seq(seq)
+  {
+    // initializers only
+  }
+
+protected:
+  virtual std::shared_ptr<SequenceEvent> readNextEvent()
+  {
+    std::shared_ptr<SequenceEvent> event = BasicTrack::readNextEvent();
+    if (SampleEvent* sampleEvent = dynamic_cast<SampleEvent*>(event.get())) {
+      seq->loadSample(sampleEvent->sampleID);
+    }
+    return event;
+  }
+
+private:
+  BundleSequence* seq;
+};
+
+BundleSequence::BundleSequence(ClefContext* ctx, ByteSource* source)
+: BaseSequence(ctx), source(source)
+{
+  BundleHeader header;
+  if (!source->read(0, &header, sizeof(header)) || std::memcmp(header.magic, "B2WB", 4) != 0) {
+    throw std::runtime_error("not a bundle");
+  } else if (header.version != bundleVersion) {
+    throw std::runtime_error("unsupported bundle version");
+  }
+  sampleRate = header.sampleRate;
+  length = header.length;
+
+  std::vector<BundleEvent> events(header.numEvents);
+  std::vector<BundleSample> sampleTable(header.numSamples);
+  if (!source->read(header.eventOffset, events.data(), events.size() * sizeof(BundleEvent)) ||
+      !source->read(header.sampleOffset, sampleTable.data(), sampleTable.size() * sizeof(BundleSample))) {
+    throw std::runtime_error("truncated bundle");
+  }
+
+  for (const BundleSample& record : sampleTable) {
+    if (record.offset > source->size() || record.numSamples * record.numChannels * sizeof(int16_t) > source->size() - record.offset) {
+      throw std::runtime_error("truncated bundle");
+    }
+    pending[record.sampleID] = PendingSample{ record.offset, record.numSamples, record.sampleRate, record.numChannels, record.loopStart, record.loopEnd };
+  }
+  if (!source->isMapped()) {
+    loadSamples();
+  }
+
+  for (int i = 0; i < header.numTracks; i++) {
+    addTrack(new LazyTrack(this));
+  }
+  for (const BundleEvent& record : events) {
+    if (record.track >= header.numTracks) {
+      throw std::runtime_error("corrupt bundle");
+    }
+    if (record.type == SampleEvent::TypeID) {
+      SampleEvent* event = new SampleEvent;
+      event->timestamp = record.timestamp;
+      event->duration = record.duration;
+      event->volume = record.volume;
+      event->pan = record.pan;
+      event->sampleID = record.sampleID;
+      event->playbackID = record.playbackID;
+      tracks[record.track]->addEvent(event);
+    } else if (record.type == KillEvent::TypeID) {
+      tracks[record.track]->addEvent(new KillEvent(record.playbackID, record.timestamp));
+    }
+  }
+}
+
+BundleSequence::~BundleSequence()
+{
+  // defined here, where ByteSource is complete
+}
+
+void BundleSequence::loadSample(uint64_t sampleID)
+{
+  auto iter = pending.find(sampleID);
+  if (iter == pending.end()) {
+    return;
+  }
+  const PendingSample& record = iter->second;
+  SampleData* sample = new SampleData(context(), sampleID, record.sampleRate, record.loopStart, record.loopEnd);
+  sample->channels.resize(record.numChannels);
+  uint64_t offset = record.offset;
+  for (auto& channel : sample->channels) {
+    // Mapped memory is copied straight into the channel
+    channel.resize(record.numSamples);
+    source->read(offset, channel.data(), record.numSamples * sizeof(int16_t));
+    offset += record.numSamples * sizeof(int16_t);
+  }
+  pending.erase(iter);
+}
+
+void BundleSequence::loadSamples()
+{
+  while (!pending.empty()) {
+    loadSample(pending.begin()->first);
+  }
+  // Nothing else is read from the source
+  source.reset();
+}
+
+double BundleSequence::duration() const
+{
+  return length;
+}
+
+SynthContext* BundleSequence::initContext()
+{
+  synth.reset(new SynthContext(context(), sampleRate));
+  for (int i = 0; i < numTracks(); i++) {
+    getTrack(i)->reset();
+    synth->addChannel(getTrack(i));
+  }
+  return synth.get();
+}
+
+KeysoundMixer* BundleSequence::initMixer()
+{
+  // The mixer looks up every sample when it reads the tracks
+  loadSamples();
+  mixer.reset(new KeysoundMixer(context(), sampleRate));
+  for (int i = 0; i < numTracks(); i++) {
+    getTrack(i)->reset();
+    mixer->addTrack(getTrack(i));
+  }
+  return mixer.get();
+}
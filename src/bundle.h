@@ -0,0 +1,63 @@
+#ifndef B2W_BUNDLE_H
+#define B2W_BUNDLE_H
+
+#include "seq/isequence.h"
+#include "synth/synthcontext.h"
+#include "keysoundmixer.h"
+#include <iostream>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+class ClefContext;
+class ByteSource;
+
+// A song compiled into a single file: the event timeline of every playing
+// track as the synthesizer sees it (with sample references already resolved
+// and kills paired), followed by the decoded PCM of every sample it uses.
+// Each sample's PCM starts on a page boundary and is stored one channel
+// after another, so it can be mapped or read straight into sample buffers.
+class BundleSequence : public BaseSequence<BasicTrack> {
+public:
+  // Reads events from the tracks (rewinding them afterward) and writes them
+  // with the samples they use from ctx. Throws if a track plays a sample
+  // that ctx doesn't have.
+  static void write(const std::string& filename, ClefContext* ctx, double sampleRate, const std::vector<ITrack*>& tracks);
+
+  // Returns true if the stream holds a bundle. The stream position is restored.
+  static bool probe(std::istream& file, double* sampleRate = nullptr, double* length = nullptr);
+
+  // Takes ownership of the source. The samples of a mapped bundle are
+  // copied out of the mapping when a track first plays them, so only the
+  // samples that are heard take memory. A bundle read through a stream is
+  // loaded up front, since the stream may not outlive loading.
+  BundleSequence(ClefContext* ctx, ByteSource* source);
+  ~BundleSequence();
+
+  double sampleRate;
+
+  double duration() const;
+  SynthContext* initContext();
+  KeysoundMixer* initMixer();
+
+private:
+  class LazyTrack;
+  struct PendingSample {
+    uint64_t offset;
+    uint64_t numSamples;
+    double sampleRate;
+    uint32_t numChannels;
+    int32_t loopStart, loopEnd;
+  };
+
+  void loadSample(uint64_t sampleID);
+  void loadSamples();
+
+  std::unique_ptr<ByteSource> source;
+  std::unordered_map<uint64_t, PendingSample> pending;
+  double length;
+  std::unique_ptr<SynthContext> synth;
+  std::unique_ptr<KeysoundMixer> mixer;
+};
+
+#endif
@@ -0,0 +1,115 @@
+#include "bytesource.h"
+#include "clefcontext.h"
+#include <cstring>
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+ByteSource* ByteSource::open(ClefContext* ctx, const std::string& filename)
+{
+#ifndef _WIN32
+  int fd = ::open(filename.c_str(), O_RDONLY);
+  if (fd >= 0) {
+    struct stat info;
+    void* mapped = MAP_FAILED;
+    if (fstat(fd, &info) == 0 && S_ISREG(info.st_mode) && info.st_size > 0) {
+      mapped = mmap(nullptr, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    }
+    // The mapping keeps the file open
+    close(fd);
+    if (mapped != MAP_FAILED) {
+      ByteSource* source = new ByteSource();
+      source->mapping = mapped;
+      source->data = static_cast<const uint8_t*>(mapped);
+      source->length = info.st_size;
+      return source;
+    }
+  }
+#endif
+  std::unique_ptr<std::istream> file;
+  try {
+    file = ctx->openFile(filename);
+  } catch (...) {
+    // treated the same as a missing file
+  }
+  if (!file || !*file) {
+    return nullptr;
+  }
+  ByteSource* source = new ByteSource(*file);
+  source->ownedStream = std::move(file);
+  return source;
+}
+
+ByteSource::ByteSource()
+: data(nullptr), length(0), mapping(nullptr), stream(nullptr)
+{
+  // initializers only
+}
+
+ByteSource::ByteSource(std::istream& stream)
+: data(nullptr), length(0), mapping(nullptr), stream(&stream)
+{
+  stream.clear();
+  if (stream.seekg(0, std::ios::end)) {
+    std::streamoff end = stream.tellg();
+    length = end > 0 ? uint64_t(end) : 0;
+  }
+  stream.clear();
+  stream.seekg(0);
+}
+
+ByteSource::ByteSource(const uint8_t* data, size_t size)
+: data(data), length(size), mapping(nullptr), stream(nullptr)
+{
+  // initializers only
+}
+
+ByteSource::~ByteSource()
+{
+#ifndef _WIN32
+  if (mapping) {
+    munmap(mapping, length);
+  }
+#endif
+}
+
+uint64_t ByteSource::size() const
+{
+  return length;
+}
+
+bool ByteSource::isMapped() const
+{
+  return !stream;
+}
+
+const uint8_t* ByteSource::view(uint64_t offset, size_t count)
+{
+  if (offset > length || count > length - offset) {
+    return nullptr;
+  }
+  if (!stream) {
+    return data + offset;
+  }
+  buffer.resize(count);
+  if (!read(offset, buffer.data(), count)) {
+    return nullptr;
+  }
+  return buffer.data();
+}
+
+bool ByteSource::read(uint64_t offset, void* dest, size_t count)
+{
+  if (offset > length || count > length - offset) {
+    return false;
+  }
+  if (!stream) {
+    memcpy(dest, data + offset, count);
+    return true;
+  }
+  stream->clear();
+  return stream->seekg(offset) && stream->read(static_cast<char*>(dest), count);
+}
@@ -0,0 +1,61 @@
+#ifndef B2W_BYTESOURCE_H
+#define B2W_BYTESOURCE_H
+
+#include <cstddef>
+#include <cstdint>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <vector>
+class ClefContext;
+
+// Random access to the bytes of a file for the loaders. Files on disk are
+// memory-mapped and parsed in place. Anything else, such as a stream handed
+// over by the plugin host or a file that only ClefContext::openFile can
+// find, is read through its stream on demand.
+//
+// A source that reads through a stream moves the stream's position and is
+// not safe to use from more than one thread at a time.
+class ByteSource {
+public:
+  // Maps the file if possible, otherwise opens it with ctx->openFile.
+  // Returns null if the file can't be opened.
+  static ByteSource* open(ClefContext* ctx, const std::string& filename);
+
+  // Reads through a stream, which must outlive the source. Offsets are
+  // relative to the beginning of the stream.
+  explicit ByteSource(std::istream& stream);
+
+  // Borrows memory, which must outlive the source.
+  ByteSource(const uint8_t* data, size_t size);
+
+  ~ByteSource();
+
+  uint64_t size() const;
+
+  // Returns true if the bytes are in memory, whether mapped or borrowed,
+  // rather than read through a stream.
+  bool isMapped() const;
+
+  // Returns a pointer to length bytes at the given offset, or null if they
+  // aren't all in the source. Mapped and borrowed memory is returned
+  // directly and stays valid as long as the source does. Data read from a
+  // stream is only valid until the next call.
+  const uint8_t* view(uint64_t offset, size_t length);
+
+  // Copies length bytes at the given offset. Returns false if they aren't
+  // all in the source.
+  bool read(uint64_t offset, void* buffer, size_t length);
+
+private:
+  ByteSource();
+
+  const uint8_t* data;
+  uint64_t length;
+  void* mapping;
+  std::istream* stream;
+  std::unique_ptr<std::istream> ownedStream;
+  std::vector<uint8_t> buffer;
+};
+
+#endif
@@ -0,0 +1,30 @@
+#include "canceltoken.h"
+
+CancelledException::CancelledException()
+: std::runtime_error("cancelled")
+{
+  // initializers only
+}
+
+void CancelToken::check(const CancelToken* token)
+{
+  if (token && token->isCancelled()) {
+    throw CancelledException();
+  }
+}
+
+CancelToken::CancelToken(const CancelToken* parent)
+: parent(parent), cancelled(false)
+{
+  // initializers only
+}
+
+void CancelToken::cancel()
+{
+  cancelled = true;
+}
+
+bool CancelToken::isCancelled() const
+{
+  return cancelled.load(std::memory_order_relaxed) || (parent && parent->isCancelled());
+}
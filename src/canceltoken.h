@@ -0,0 +1,34 @@
+#ifndef B2W_CANCELTOKEN_H
+#define B2W_CANCELTOKEN_H
+
+#include <atomic>
+#include <stdexcept>
+
+class CancelledException : public std::runtime_error {
+public:
+  CancelledException();
+};
+
+// A flag that one thread sets to ask long-running work on another thread
+// to stop. Loaders and codecs poll it between units of work and throw
+// CancelledException, so anything they allocated is freed as the stack
+// unwinds.
+class CancelToken {
+public:
+  // Throws CancelledException if token is set and has been cancelled.
+  // A null token is never cancelled.
+  static void check(const CancelToken* token);
+
+  // A token with a parent is also cancelled when the parent is, so work
+  // can be stopped on its own or along with everything else.
+  CancelToken(const CancelToken* parent = nullptr);
+
+  void cancel();
+  bool isCancelled() const;
+
+private:
+  const CancelToken* parent;
+  std::atomic<bool> cancelled;
+};
+
+#endif
@@ -0,0 +1,140 @@
+#include "compressedsample.h"
+#include "canceltoken.h"
+#include <algorithm>
+
+static const int16_t stepTable[49] = {
+  16, 17, 19, 21, 23, 25, 28, 31, 34, 37, 41, 45, 50, 55, 60, 66,
+  73, 80, 88, 97, 107, 118, 130, 143, 157, 173, 190, 209, 230, 253, 279, 307,
+  337, 371, 408, 449, 494, 544, 598, 658, 724, 796, 876, 963, 1060, 1166, 1282, 1411,
+  1552,
+};
+
+static const int8_t indexTable[8] = { -1, -1, -1, -1, 2, 4, 6, 8 };
+
+static inline int16_t decodeNibble(int code, int32_t& last, int32_t& stepIndex)
+{
+  int step = stepTable[stepIndex] << 4;
+  int delta = step >> 3;
+  if (code & 1) {
+    delta += step >> 2;
+  }
+  if (code & 2) {
+    delta += step >> 1;
+  }
+  if (code & 4) {
+    delta += step;
+  }
+  if (code & 8) {
+    delta = -delta;
+  }
+  last = std::max(-32768, std::min(32767, last + delta));
+  stepIndex = std::max(0, std::min(48, stepIndex + indexTable[code & 7]));
+  return last;
+}
+
+bool CompressedSample::canCompress(int channels)
+{
+  return channels == 1 || channels == 2;
+}
+
+void CompressedSample::decodeAll(const uint8_t* data, size_t size, int channels, int16_t* left, int16_t* right, const CancelToken* cancel)
+{
+  // Large enough that the checks cost nothing, small enough to stop within a millisecond
+  static const size_t chunkFrames = 65536;
+  CompressedSample stream(data, size, channels, 1, false);
+  Cursor cursor = { 0, { 0, 0 }, { 0, 0 } };
+  size_t length = stream.numSamples();
+  while (cursor.frame < length) {
+    CancelToken::check(cancel);
+    size_t frames = std::min(chunkFrames, length - cursor.frame);
+    stream.decodeFrames(cursor, left, channels > 1 ? right : nullptr, frames);
+    left += frames;
+    if (channels > 1) {
+      right += frames;
+    }
+  }
+}
+
+CompressedSample::CompressedSample(const uint8_t* data, size_t size, int channels, double sampleRate)
+: CompressedSample(data, size, channels, sampleRate, true)
+{
+  // initializers only
+}
+
+CompressedSample::CompressedSample(const uint8_t* data, size_t size, int channels, double sampleRate, bool checkpoint)
+: channels(channels), sampleRate(sampleRate), data(data), size(size)
+{
+  if (!checkpoint) {
+    return;
+  }
+  // ADPCM decoding is cheap enough that recording every checkpoint up front
+  // costs far less than storing the decoded PCM.
+  Cursor cursor = { 0, { 0, 0 }, { 0, 0 } };
+  size_t length = numSamples();
+  while (cursor.frame < length) {
+    checkpoints.push_back(cursor);
+    decodeFrames(cursor, nullptr, nullptr, std::min(checkpointInterval, length - cursor.frame));
+  }
+}
+
+size_t CompressedSample::numSamples() const
+{
+  return channels > 1 ? size : size * 2;
+}
+
+double CompressedSample::duration() const
+{
+  return numSamples() / sampleRate;
+}
+
+size_t CompressedSample::compressedBytes() const
+{
+  return size + checkpoints.size() * sizeof(Cursor);
+}
+
+size_t CompressedSample::decodedBytes() const
+{
+  return numSamples() * channels * sizeof(int16_t);
+}
+
+CompressedSample::Cursor CompressedSample::seek(size_t frame) const
+{
+  if (checkpoints.empty()) {
+    return Cursor{ 0, { 0, 0 }, { 0, 0 } };
+  }
+  frame = std::min(frame, numSamples());
+  Cursor cursor = checkpoints[std::min(frame / checkpointInterval, checkpoints.size() - 1)];
+  decodeFrames(cursor, nullptr, nullptr, frame - cursor.frame);
+  return cursor;
+}
+
+void CompressedSample::decode(Cursor& cursor, int16_t* left, int16_t* right, size_t frames) const
+{
+  frames = std::min(frames, numSamples() - std::min(cursor.frame, numSamples()));
+  decodeFrames(cursor, left, right, frames);
+}
+
+void CompressedSample::decodeFrames(Cursor& cursor, int16_t* left, int16_t* right, size_t frames) const
+{
+  size_t end = cursor.frame + frames;
+  if (channels > 1) {
+    for (size_t i = cursor.frame; i < end; i++) {
+      uint8_t byte = data[i];
+      int16_t l = decodeNibble(byte >> 4, cursor.last[0], cursor.stepIndex[0]);
+      int16_t r = decodeNibble(byte & 0xF, cursor.last[1], cursor.stepIndex[1]);
+      if (left) {
+        *left++ = l;
+        *right++ = r;
+      }
+    }
+  } else {
+    for (size_t i = cursor.frame; i < end; i++) {
+      int shift = (i & 1) ? 0 : 4;
+      int16_t s = decodeNibble((data[i >> 1] >> shift) & 0xF, cursor.last[0], cursor.stepIndex[0]);
+      if (left) {
+        *left++ = s;
+      }
+    }
+  }
+  cursor.frame = end;
+}
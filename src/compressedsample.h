@@ -0,0 +1,65 @@
+#ifndef B2W_COMPRESSEDSAMPLE_H
+#define B2W_COMPRESSEDSAMPLE_H
+
+#include <cstdint>
+#include <cstddef>
+#include <vector>
+class CancelToken;
+
+// An OKI4s ADPCM sample kept compressed in memory and decoded on demand.
+// Mono data stores two frames per byte; stereo data stores one frame per
+// byte with one nibble per channel. The predictor state is recorded every
+// checkpointInterval frames so that decoding can start anywhere without
+// replaying the sample from the beginning.
+//
+// The decoder reproduces libclef's OKI4s AdpcmCodec exactly, high nibble
+// first; tests/compressedsampletest.cpp checks it against the codec.
+//
+// The compressed data is not copied and must outlive the sample.
+class CompressedSample {
+public:
+  static const size_t checkpointInterval = 4096;
+
+  // Returns true for the channel layouts the decoder supports.
+  static bool canCompress(int channels);
+
+  // Decodes a whole stream, checking the token between chunks. right is
+  // ignored for mono data.
+  static void decodeAll(const uint8_t* data, size_t size, int channels, int16_t* left, int16_t* right, const CancelToken* cancel);
+
+  CompressedSample(const uint8_t* data, size_t size, int channels, double sampleRate);
+
+  const int channels;
+  const double sampleRate;
+
+  size_t numSamples() const;
+  double duration() const;
+
+  // Memory used by the compressed data and checkpoints
+  size_t compressedBytes() const;
+  // Memory the sample would use if fully decoded
+  size_t decodedBytes() const;
+
+  struct Cursor {
+    size_t frame;
+    int32_t last[2];
+    int32_t stepIndex[2];
+  };
+
+  // Returns a cursor positioned at the given frame.
+  Cursor seek(size_t frame) const;
+
+  // Decodes frames at the cursor and advances it. right is ignored for mono
+  // samples. If left is null, the frames are skipped.
+  void decode(Cursor& cursor, int16_t* left, int16_t* right, size_t frames) const;
+
+private:
+  CompressedSample(const uint8_t* data, size_t size, int channels, double sampleRate, bool checkpoint);
+  void decodeFrames(Cursor& cursor, int16_t* left, int16_t* right, size_t frames) const;
+
+  const uint8_t* data;
+  size_t size;
+  std::vector<Cursor> checkpoints;
+};
+
+#endif
@@ -0,0 +1,409 @@
+#include "decodescheduler.h"
+#include "samplecache.h"
+#include "samplestore.h"
+#include "timeline.h"
+#include "bankloaders.h"
+#include "bytesource.h"
+#include "bmpcodec.h"
+#include "canceltoken.h"
+#include "clefcontext.h"
+#include "codec/adpcmcodec.h"
+#include "codec/riffcodec.h"
+#include "codec/sampledata.h"
+#include "wma/asfcodec.h"
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <iostream>
+#include <limits>
+#include <stdexcept>
+#include <unordered_set>
+
+static std::mutex registryMutex;
+static std::unordered_map<ClefContext*, DecodeScheduler*> registry;
+
+// A windowed decode keeps a little past the end of the window
+static const double prefixMargin = 0.1;
+
+// Returns the length of a queued sample from its headers without decoding
+// it, or infinity if it can't be determined.
+static double probeDuration(const std::string& params, const std::vector<uint8_t>& data, double sampleRate)
+{
+  double duration = 0;
+  if (params.compare(0, 3, "wma") == 0) {
+    duration = AsfCodec::duration(data.begin(), data.end());
+  } else if (params == "bmp") {
+    duration = BmpCodec::duration(data);
+  } else if (params == "riff") {
+    ByteSource source(data.data(), data.size());
+    duration = riffDuration(&source, 0, data.size());
+  } else if (params == "oki4s" && sampleRate > 0) {
+    duration = data.size() * 2 / sampleRate;
+  } else if (params == "oki4s-interleaved" && sampleRate > 0) {
+    duration = data.size() / sampleRate;
+  }
+  return duration > 0 ? duration : std::numeric_limits<double>::infinity();
+}
+
+// Returns how much of a queued sample decodes to the given number of
+// seconds, or 0 if it has to be decoded in full. ADPCM only depends on
+// earlier data, so a prefix decodes to exactly the same samples as the
+// start of a full decode.
+static size_t prefixBytes(const std::string& params, const std::vector<uint8_t>& data, double sampleRate, double seconds)
+{
+  seconds += prefixMargin;
+  if (params == "bmp") {
+    double duration = BmpCodec::duration(data);
+    if (duration <= seconds) {
+      return 0;
+    }
+    return 32 + size_t(std::ceil((data.size() - 32) * seconds / duration));
+  } else if (params == "oki4s" && sampleRate > 0) {
+    return std::ceil(seconds * sampleRate / 2);
+  } else if (params == "oki4s-interleaved" && sampleRate > 0) {
+    return std::ceil(seconds * sampleRate);
+  }
+  return 0;
+}
+
+class DecodeScheduler::GatedTrack : public ITrack {
+public:
+  GatedTrack(DecodeScheduler* scheduler, ITrack* track)
+  : scheduler(scheduler), track(track)
+  {
+    // initializers only
+  }
+
+  bool isFinished() const
+  {
+    return track->isFinished();
+  }
+
+  double length() const
+  {
+    return track->length();
+  }
+
+protected:
+  std::shared_ptr<SequenceEvent> readNextEvent()
+  {
+    scheduler->publish();
+    std::shared_ptr<SequenceEvent> event = track->nextEvent();
+    SampleEvent* sampleEvent = dynamic_cast<SampleEvent*>(event.get());
+    if (sampleEvent && !scheduler->waitForSample(sampleEvent->sampleID, 20)) {
+      std::cerr << "Sample " << std::hex << sampleEvent->sampleID << std::dec << " not decoded in time for "
+        << sampleEvent->timestamp << "s" << std::endl;
+    }
+    return event;
+  }
+
+  void internalReset()
+  {
+    track->reset();
+  }
+
+private:
+  DecodeScheduler* scheduler;
+  ITrack* track;
+};
+
+DecodeScheduler* DecodeScheduler::forContext(ClefContext* ctx)
+{
+  std::lock_guard<std::mutex> lock(registryMutex);
+  auto iter = registry.find(ctx);
+  return iter == registry.end() ? nullptr : iter->second;
+}
+
+ICodec* DecodeScheduler::createCodec(const std::string& params, ClefContext* ctx, const CancelToken* cancel)
+{
+  if (params == "wma" || params.compare(0, 4, "wma/") == 0) {
+    AsfCodec* codec = new AsfCodec(ctx);
+    codec->setCancelToken(cancel);
+    if (params.size() > 4) {
+      codec->setDownsample(std::stoi(params.substr(4)));
+    }
+    return codec;
+  } else if (params == "riff") {
+    return new RiffCodec(ctx);
+  } else if (params == "oki4s") {
+    return new AdpcmCodec(ctx, AdpcmCodec::OKI4s, 0);
+  } else if (params == "oki4s-interleaved") {
+    return new AdpcmCodec(ctx, AdpcmCodec::OKI4s, -1);
+  } else if (params == "bmp") {
+    BmpCodec* codec = new BmpCodec(ctx);
+    codec->setCancelToken(cancel);
+    return codec;
+  }
+  throw std::runtime_error("Unknown codec: " + params);
+}
+
+DecodeScheduler::DecodeScheduler(ClefContext* ctx, const CancelToken* cancel, int numWorkers)
+: ctx(ctx), cancel(cancel), numWorkers(numWorkers), windowStart(0), windowEnd(std::numeric_limits<double>::infinity()),
+  nextJob(0), unpublished(0), completed(0), pcmBytes(0), stopping(false)
+{
+  if (this->numWorkers <= 0) {
+    // Leave a core for the thread that's rendering
+    this->numWorkers = std::max(1, int(std::thread::hardware_concurrency()) - 1);
+  }
+  std::lock_guard<std::mutex> lock(registryMutex);
+  registry[ctx] = this;
+}
+
+DecodeScheduler::~DecodeScheduler()
+{
+  stopping = true;
+  jobDone.notify_all();
+  for (std::thread& thread : threads) {
+    thread.join();
+  }
+  std::lock_guard<std::mutex> lock(registryMutex);
+  auto iter = registry.find(ctx);
+  if (iter != registry.end() && iter->second == this) {
+    registry.erase(iter);
+  }
+}
+
+void DecodeScheduler::defer(const std::string& params, std::vector<uint8_t>::const_iterator start, std::vector<uint8_t>::const_iterator end, uint64_t sampleID)
+{
+  auto iter = jobIndex.find(sampleID);
+  if (iter == jobIndex.end()) {
+    iter = jobIndex.emplace(sampleID, jobs.size()).first;
+    jobs.emplace_back();
+  }
+  Job& job = jobs[iter->second];
+  job.params = params;
+  job.data.assign(start, end);
+  job.sampleID = sampleID;
+  job.sampleRate = 0;
+  job.firstUse = std::numeric_limits<double>::infinity();
+  job.done = false;
+  job.decoded = false;
+  job.truncated = false;
+}
+
+void DecodeScheduler::setSampleRate(uint64_t sampleID, double sampleRate)
+{
+  auto iter = jobIndex.find(sampleID);
+  if (iter != jobIndex.end()) {
+    jobs[iter->second].sampleRate = sampleRate;
+  }
+}
+
+void DecodeScheduler::clear()
+{
+  jobs.clear();
+  jobIndex.clear();
+}
+
+void DecodeScheduler::setWindow(double start, double end)
+{
+  windowStart = start;
+  windowEnd = end > 0 ? end : std::numeric_limits<double>::infinity();
+}
+
+void DecodeScheduler::applyWindow(const Timeline& timeline)
+{
+  std::unordered_set<uint64_t> heard;
+  for (const Timeline::Voice& voice : timeline.voices()) {
+    auto iter = jobIndex.find(voice.sampleID);
+    if (iter == jobIndex.end() || voice.start >= windowEnd || heard.count(voice.sampleID)) {
+      continue;
+    }
+    double end = voice.end;
+    if (end <= voice.start) {
+      // The timeline treats samples that aren't decoded yet as zero-length
+      const Job& job = jobs[iter->second];
+      end = voice.start + probeDuration(job.params, job.data, job.sampleRate);
+    }
+    if (voice.start >= windowStart || end > windowStart) {
+      heard.insert(voice.sampleID);
+    }
+  }
+
+  std::vector<Job> kept;
+  for (Job& job : jobs) {
+    if (!heard.count(job.sampleID)) {
+      continue;
+    }
+    // The earliest voice plays the furthest into the sample
+    size_t bytes = prefixBytes(job.params, job.data, job.sampleRate, windowEnd - job.firstUse);
+    if (bytes && bytes < job.data.size()) {
+      job.data.resize(bytes);
+      job.truncated = true;
+    }
+    kept.push_back(std::move(job));
+  }
+  jobs.swap(kept);
+}
+
+void DecodeScheduler::start(const std::vector<ITrack*>& tracks)
+{
+  {
+    std::lock_guard<std::mutex> lock(registryMutex);
+    registry.erase(ctx);
+  }
+
+  Timeline timeline(ctx, tracks);
+  std::unordered_map<uint64_t, double> firstUse;
+  for (const Timeline::Voice& voice : timeline.voices()) {
+    auto iter = firstUse.find(voice.sampleID);
+    if (iter == firstUse.end()) {
+      firstUse[voice.sampleID] = voice.start;
+    } else {
+      iter->second = std::min(iter->second, voice.start);
+    }
+  }
+  for (Job& job : jobs) {
+    auto iter = firstUse.find(job.sampleID);
+    if (iter != firstUse.end()) {
+      job.firstUse = iter->second;
+    }
+  }
+  if (windowStart > 0 || windowEnd < std::numeric_limits<double>::infinity()) {
+    applyWindow(timeline);
+  }
+  // Samples the chart never triggers still decode, but last
+  std::stable_sort(jobs.begin(), jobs.end(), [](const Job& lhs, const Job& rhs) {
+    return lhs.firstUse < rhs.firstUse;
+  });
+  jobIndex.clear();
+  for (size_t i = 0; i < jobs.size(); i++) {
+    jobIndex[jobs[i].sampleID] = i;
+  }
+
+  int count = std::min<int>(numWorkers, jobs.size());
+  for (int i = 0; i < count; i++) {
+    threads.emplace_back(&DecodeScheduler::worker, this);
+  }
+}
+
+void DecodeScheduler::worker()
+{
+  // Each worker decodes into its own context so that the shared one is
+  // only ever touched by publish().
+  ClefContext scratch;
+  while (!stopping && !(cancel && cancel->isCancelled())) {
+    size_t index = nextJob++;
+    if (index >= jobs.size()) {
+      break;
+    }
+    Job& job = jobs[index];
+    try {
+      std::unique_ptr<ICodec> codec(createCodec(job.params, &scratch, cancel));
+      SampleData* sample;
+      if (job.truncated) {
+        sample = codec->decodeRange(job.data.begin(), job.data.end(), job.sampleID);
+      } else {
+        sample = SampleCache::decode(codec.get(), job.params, job.data, job.sampleID);
+      }
+      if (sample) {
+        job.decodedRate = sample->sampleRate;
+        job.loopStart = sample->loopStart;
+        job.loopEnd = sample->loopEnd;
+        job.channels.swap(sample->channels);
+        job.decoded = true;
+        for (const auto& channel : job.channels) {
+          pcmBytes += channel.size() * sizeof(int16_t);
+        }
+      }
+    } catch (CancelledException&) {
+      // The song was abandoned; nothing will publish this sample
+    } catch (std::exception& e) {
+      std::cerr << "Error decoding sample " << std::hex << job.sampleID << std::dec << ": " << e.what() << std::endl;
+    }
+    if (SampleStore* store = SampleStore::get()) {
+      store->release(&scratch);
+    }
+    scratch.purgeSamples();
+    std::vector<uint8_t>().swap(job.data);
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      job.done = true;
+      finished.push_back(index);
+      unpublished++;
+    }
+    completed++;
+    jobDone.notify_all();
+  }
+}
+
+void DecodeScheduler::waitUntil(double time)
+{
+  auto ready = [this, time]() {
+    for (const Job& job : jobs) {
+      if (job.firstUse >= time) {
+        break;
+      } else if (!job.done) {
+        return false;
+      }
+    }
+    return true;
+  };
+  {
+    std::unique_lock<std::mutex> lock(mutex);
+    // Cancellation doesn't signal the condition, so poll for it
+    while (!jobDone.wait_for(lock, std::chrono::milliseconds(5), ready)) {
+      CancelToken::check(cancel);
+    }
+  }
+  CancelToken::check(cancel);
+  publish();
+}
+
+void DecodeScheduler::publish()
+{
+  if (!unpublished) {
+    return;
+  }
+  std::vector<size_t> ready;
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    ready.swap(finished);
+    unpublished -= ready.size();
+  }
+  for (size_t index : ready) {
+    Job& job = jobs[index];
+    if (!job.decoded) {
+      continue;
+    }
+    double rate = job.sampleRate > 0 ? job.sampleRate : job.decodedRate;
+    SampleData* sample = new SampleData(ctx, job.sampleID, rate, job.loopStart, job.loopEnd);
+    sample->channels.swap(job.channels);
+  }
+}
+
+bool DecodeScheduler::waitForSample(uint64_t sampleID, int timeoutMs)
+{
+  auto iter = jobIndex.find(sampleID);
+  if (iter == jobIndex.end()) {
+    return true;
+  }
+  const Job& job = jobs[iter->second];
+  bool done;
+  {
+    std::unique_lock<std::mutex> lock(mutex);
+    done = jobDone.wait_for(lock, std::chrono::milliseconds(timeoutMs), [&job]() { return job.done; });
+  }
+  publish();
+  return done;
+}
+
+ITrack* DecodeScheduler::gate(ITrack* track)
+{
+  return new GatedTrack(this, track);
+}
+
+size_t DecodeScheduler::numSamples() const
+{
+  return jobs.size();
+}
+
+size_t DecodeScheduler::numDecoded() const
+{
+  return completed;
+}
+
+uint64_t DecodeScheduler::decodedBytes() const
+{
+  return pcmBytes;
+}
@@ -0,0 +1,113 @@
+#ifndef B2W_DECODESCHEDULER_H
+#define B2W_DECODESCHEDULER_H
+
+#include "seq/itrack.h"
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+class ClefContext;
+class ICodec;
+class Timeline;
+class CancelToken;
+
+// Decodes a song's samples on background threads so that playback can
+// begin before the whole bank is ready.
+//
+// While a scheduler is attached to a context, SampleCache::decode queues
+// the compressed data instead of decoding it and returns null. start()
+// orders the queue by the time each sample is first triggered and hands it
+// to worker threads, each decoding into a private context. Finished
+// samples are registered with the attached context by publish(), which
+// must only be called from the thread that renders, so the context is
+// never touched concurrently.
+//
+// Cancelling the token stops the workers partway through their current
+// samples and makes waitUntil() throw CancelledException.
+class DecodeScheduler {
+public:
+  // Returns the scheduler attached to ctx, or null.
+  static DecodeScheduler* forContext(ClefContext* ctx);
+
+  // Returns a codec matching the parameter string passed to SampleCache::decode.
+  static ICodec* createCodec(const std::string& params, ClefContext* ctx, const CancelToken* cancel = nullptr);
+
+  DecodeScheduler(ClefContext* ctx, const CancelToken* cancel = nullptr, int numWorkers = 0);
+  ~DecodeScheduler();
+
+  void defer(const std::string& params, std::vector<uint8_t>::const_iterator start, std::vector<uint8_t>::const_iterator end, uint64_t sampleID);
+  // Overrides the sample rate reported by the codec once the sample is decoded.
+  void setSampleRate(uint64_t sampleID, double sampleRate);
+  // Drops every queued sample. Only valid before start().
+  void clear();
+  // Limits decoding to the samples heard between start and end, in song
+  // time. Samples that only play outside of it are dropped when start() is
+  // called, and ADPCM streams are only decoded up to the end. An end of
+  // zero or less decodes to the end of the song. Only valid before start().
+  void setWindow(double start, double end);
+
+  // Detaches from the context and begins decoding in first-use order.
+  void start(const std::vector<ITrack*>& tracks);
+
+  // Blocks until every sample first used before the given song time has
+  // been decoded, then publishes them.
+  void waitUntil(double time);
+
+  // Registers finished samples with the context.
+  void publish();
+
+  // Waits up to the given time for a sample to finish and publishes it.
+  // Samples that were never queued are always ready.
+  bool waitForSample(uint64_t sampleID, int timeoutMs);
+
+  // Returns a track that waits for each sample's decode before returning
+  // the event that triggers it. The caller owns the track.
+  ITrack* gate(ITrack* track);
+
+  size_t numSamples() const;
+  size_t numDecoded() const;
+  // PCM produced by the workers so far, published or not
+  uint64_t decodedBytes() const;
+
+private:
+  class GatedTrack;
+
+  struct Job {
+    std::string params;
+    std::vector<uint8_t> data;
+    uint64_t sampleID;
+    double sampleRate;
+    double firstUse;
+    bool done;
+    bool decoded;
+    // Only a prefix of the data is queued, so the result isn't cached
+    bool truncated;
+    double decodedRate;
+    int loopStart, loopEnd;
+    std::vector<std::vector<int16_t>> channels;
+  };
+
+  void worker();
+  void applyWindow(const Timeline& timeline);
+
+  ClefContext* ctx;
+  const CancelToken* cancel;
+  int numWorkers;
+  double windowStart, windowEnd;
+  std::vector<Job> jobs;
+  std::unordered_map<uint64_t, size_t> jobIndex;
+  std::vector<size_t> finished;
+  std::atomic<size_t> nextJob, unpublished, completed;
+  std::atomic<uint64_t> pcmBytes;
+  std::atomic<bool> stopping;
+  mutable std::mutex mutex;
+  std::condition_variable jobDone;
+  std::vector<std::thread> threads;
+};
+
+#endif
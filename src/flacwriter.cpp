@@ -0,0 +1,656 @@
+#include "flacwriter.h"
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <limits>
+#include <thread>
+
+// Every frame except the last holds this many samples per channel
+static const uint32_t blockSize = 4096;
+static const int maxLpcOrder = 8;
+static const int lpcPrecision = 14;
+static const int maxRiceParam = 14;
+static const int maxPartitionOrder = 8;
+// Frames per thread handed to each batch
+static const int framesPerThread = 4;
+
+// M_PI isn't standard, and MSVC only defines it with _USE_MATH_DEFINES
+static const double pi = 3.14159265358979323846;
+
+namespace {
+
+class BitWriter {
+public:
+  void put(uint32_t value, int bits)
+  {
+    if (!bits) {
+      return;
+    }
+    acc = (acc << bits) | (bits < 32 ? value & ((1u << bits) - 1) : value);
+    count += bits;
+    while (count >= 8) {
+      count -= 8;
+      bytes.push_back(acc >> count);
+    }
+  }
+
+  void putSigned(int32_t value, int bits)
+  {
+    put(uint32_t(value), bits);
+  }
+
+  void putUnary(uint32_t zeros)
+  {
+    while (zeros >= 32) {
+      put(0, 32);
+      zeros -= 32;
+    }
+    put(1, zeros + 1);
+  }
+
+  void putUTF8(uint32_t value)
+  {
+    if (value < 0x80) {
+      put(value, 8);
+      return;
+    }
+    int extra = value < 0x800 ? 1 : value < 0x10000 ? 2 : value < 0x200000 ? 3 : value < 0x4000000 ? 4 : 5;
+    put(((0xFF00 >> (extra + 1)) & 0xFF) | (value >> (extra * 6)), 8);
+    for (int i = extra - 1; i >= 0; i--) {
+      put(0x80 | ((value >> (i * 6)) & 0x3F), 8);
+    }
+  }
+
+  void align()
+  {
+    if (count) {
+      put(0, 8 - count);
+    }
+  }
+
+  std::vector<uint8_t> bytes;
+
+private:
+  uint64_t acc = 0;
+  int count = 0;
+};
+
+enum SubframeType {
+  Constant,
+  Verbatim,
+  Fixed,
+  Lpc,
+};
+
+struct Subframe {
+  SubframeType type;
+  int bps;
+  int order;
+  int shift;
+  std::vector<int32_t> coefs;
+  std::vector<int32_t> residual;
+  uint64_t bits;
+};
+
+uint8_t crc8(const uint8_t* data, size_t length)
+{
+  uint8_t crc = 0;
+  for (size_t i = 0; i < length; i++) {
+    crc ^= data[i];
+    for (int bit = 0; bit < 8; bit++) {
+      crc = (crc & 0x80) ? (crc << 1) ^ 0x07 : crc << 1;
+    }
+  }
+  return crc;
+}
+
+uint16_t crc16(const uint8_t* data, size_t length)
+{
+  uint16_t crc = 0;
+  for (size_t i = 0; i < length; i++) {
+    crc ^= data[i] << 8;
+    for (int bit = 0; bit < 8; bit++) {
+      crc = (crc & 0x8000) ? (crc << 1) ^ 0x8005 : crc << 1;
+    }
+  }
+  return crc;
+}
+
+inline uint32_t zigzag(int32_t value)
+{
+  return (uint32_t(value) << 1) ^ uint32_t(value >> 31);
+}
+
+// Rough size of a residual coded as a single Rice partition, used to
+// compare predictors before the exact partitioning is chosen.
+uint64_t estimateResidual(const std::vector<int32_t>& residual)
+{
+  uint64_t sum = 0;
+  for (int32_t value : residual) {
+    sum += zigzag(value);
+  }
+  uint64_t n = residual.size();
+  int k = 0;
+  while (k < maxRiceParam && (n << (k + 1)) < sum) {
+    k++;
+  }
+  return 6 + 4 + n * (k + 1) + (sum >> k);
+}
+
+void fixedResidual(const int32_t* x, uint32_t n, int order, std::vector<int32_t>& residual)
+{
+  residual.resize(n - order);
+  int32_t* r = residual.data();
+  for (uint32_t i = order; i < n; i++) {
+    switch (order) {
+      case 0: *r++ = x[i]; break;
+      case 1: *r++ = x[i] - x[i - 1]; break;
+      case 2: *r++ = x[i] - 2 * x[i - 1] + x[i - 2]; break;
+      case 3: *r++ = x[i] - 3 * x[i - 1] + 3 * x[i - 2] - x[i - 3]; break;
+      default: *r++ = x[i] - 4 * x[i - 1] + 6 * x[i - 2] - 4 * x[i - 3] + x[i - 4]; break;
+    }
+  }
+}
+
+// Returns false if the quantized predictor would overflow the residual
+bool lpcResidual(const int32_t* x, uint32_t n, const std::vector<int32_t>& coefs, int shift, std::vector<int32_t>& residual)
+{
+  int order = coefs.size();
+  residual.resize(n - order);
+  for (uint32_t i = order; i < n; i++) {
+    int64_t sum = 0;
+    for (int j = 0; j < order; j++) {
+      sum += int64_t(coefs[j]) * x[i - 1 - j];
+    }
+    int64_t value = x[i] - (sum >> shift);
+    if (value > (1 << 24) || value < -(1 << 24)) {
+      return false;
+    }
+    residual[i - order] = value;
+  }
+  return true;
+}
+
+// Levinson-Durbin recursion over the autocorrelation of a windowed block.
+// coefs[order - 1] receives the predictor of each order up to maxOrder.
+int computeLpc(const int32_t* x, uint32_t n, int maxOrder, std::vector<double> coefs[])
+{
+  std::vector<double> windowed(n);
+  // Tukey window with half of the block tapered
+  double taper = n * 0.25;
+  for (uint32_t i = 0; i < n; i++) {
+    double w = 1.0;
+    if (i < taper) {
+      w = 0.5 - 0.5 * std::cos(pi * i / taper);
+    } else if (i >= n - taper) {
+      w = 0.5 - 0.5 * std::cos(pi * (n - 1 - i) / taper);
+    }
+    windowed[i] = x[i] * w;
+  }
+  double autoc[maxLpcOrder + 1];
+  for (int lag = 0; lag <= maxOrder; lag++) {
+    double sum = 0;
+    for (uint32_t i = lag; i < n; i++) {
+      sum += windowed[i] * windowed[i - lag];
+    }
+    autoc[lag] = sum;
+  }
+  if (autoc[0] <= 0) {
+    return 0;
+  }
+  double lpc[maxLpcOrder];
+  double err = autoc[0];
+  for (int i = 0; i < maxOrder; i++) {
+    double r = -autoc[i + 1];
+    for (int j = 0; j < i; j++) {
+      r -= lpc[j] * autoc[i - j];
+    }
+    r /= err;
+    lpc[i] = r;
+    int j = 0;
+    for (; j < (i >> 1); j++) {
+      double tmp = lpc[j];
+      lpc[j] += r * lpc[i - 1 - j];
+      lpc[i - 1 - j] += r * tmp;
+    }
+    if (i & 1) {
+      lpc[j] += lpc[j] * r;
+    }
+    err *= (1.0 - r * r);
+    coefs[i].resize(i + 1);
+    for (j = 0; j <= i; j++) {
+      coefs[i][j] = -lpc[j];
+    }
+    if (err <= 0) {
+      return i + 1;
+    }
+  }
+  return maxOrder;
+}
+
+bool quantizeLpc(const std::vector<double>& lpc, std::vector<int32_t>& coefs, int& shift)
+{
+  int precision = lpcPrecision - 1;
+  int32_t qmax = (1 << precision) - 1, qmin = -(1 << precision);
+  double cmax = 0;
+  for (double c : lpc) {
+    cmax = std::max(cmax, std::fabs(c));
+  }
+  if (cmax <= 0) {
+    return false;
+  }
+  int log2cmax;
+  std::frexp(cmax, &log2cmax);
+  shift = precision - log2cmax;
+  if (shift > 15) {
+    shift = 15;
+  } else if (shift < 0) {
+    return false;
+  }
+  coefs.resize(lpc.size());
+  double error = 0;
+  for (size_t i = 0; i < lpc.size(); i++) {
+    error += lpc[i] * (1 << shift);
+    int32_t q = std::lround(error);
+    q = std::max(qmin, std::min(qmax, q));
+    error -= q;
+    coefs[i] = q;
+  }
+  return true;
+}
+
+Subframe planSubframe(const int32_t* x, uint32_t n, int bps)
+{
+  Subframe best;
+  best.bps = bps;
+  best.order = 0;
+  best.shift = 0;
+  best.type = Verbatim;
+  best.bits = 8 + uint64_t(n) * bps;
+  if (std::all_of(x, x + n, [x](int32_t value) { return value == x[0]; })) {
+    best.type = Constant;
+    best.bits = 8 + bps;
+    return best;
+  }
+
+  std::vector<int32_t> residual;
+  for (int order = 0; order <= 4 && uint32_t(order) < n; order++) {
+    fixedResidual(x, n, order, residual);
+    uint64_t bits = 8 + order * bps + estimateResidual(residual);
+    if (bits < best.bits) {
+      best.type = Fixed;
+      best.order = order;
+      best.bits = bits;
+      best.residual.swap(residual);
+    }
+  }
+
+  int maxOrder = std::min<int>(maxLpcOrder, n / 2);
+  std::vector<double> lpc[maxLpcOrder];
+  maxOrder = maxOrder > 0 ? computeLpc(x, n, maxOrder, lpc) : 0;
+  std::vector<int32_t> coefs;
+  for (int order = 1; order <= maxOrder; order++) {
+    int shift;
+    if (!quantizeLpc(lpc[order - 1], coefs, shift) || !lpcResidual(x, n, coefs, shift, residual)) {
+      continue;
+    }
+    uint64_t bits = 8 + order * bps + 4 + 5 + order * lpcPrecision + estimateResidual(residual);
+    if (bits < best.bits) {
+      best.type = Lpc;
+      best.order = order;
+      best.shift = shift;
+      best.coefs = coefs;
+      best.bits = bits;
+      best.residual.swap(residual);
+    }
+  }
+  return best;
+}
+
+void writeResidual(BitWriter& bits, const std::vector<int32_t>& residual, uint32_t n, int order)
+{
+  int maxOrder = 0;
+  while (maxOrder < maxPartitionOrder && !(n & (1u << maxOrder)) && (n >> (maxOrder + 1)) > uint32_t(order)) {
+    maxOrder++;
+  }
+  // Exact cost of each Rice parameter for every partition at the finest
+  // partitioning, merged pairwise for each coarser order.
+  std::vector<uint64_t> costs((size_t(1) << maxOrder) * (maxRiceParam + 1), 0);
+  uint32_t partSize = n >> maxOrder;
+  size_t pos = 0;
+  for (size_t part = 0; part < (size_t(1) << maxOrder); part++) {
+    size_t count = part ? partSize : partSize - order;
+    uint64_t* cost = &costs[part * (maxRiceParam + 1)];
+    for (size_t i = 0; i < count; i++) {
+      uint32_t u = zigzag(residual[pos + i]);
+      for (int k = 0; k <= maxRiceParam; k++) {
+        cost[k] += (u >> k) + 1 + k;
+      }
+    }
+    pos += count;
+  }
+  int bestOrder = maxOrder;
+  uint64_t bestBits = std::numeric_limits<uint64_t>::max();
+  std::vector<int> bestParams;
+  for (int partOrder = maxOrder; partOrder >= 0; partOrder--) {
+    size_t numParts = size_t(1) << partOrder;
+    if (partOrder < maxOrder) {
+      for (size_t part = 0; part < numParts; part++) {
+        for (int k = 0; k <= maxRiceParam; k++) {
+          costs[part * (maxRiceParam + 1) + k] =
+            costs[part * 2 * (maxRiceParam + 1) + k] + costs[(part * 2 + 1) * (maxRiceParam + 1) + k];
+        }
+      }
+    }
+    uint64_t total = 0;
+    std::vector<int> params(numParts);
+    for (size_t part = 0; part < numParts; part++) {
+      const uint64_t* cost = &costs[part * (maxRiceParam + 1)];
+      params[part] = std::min_element(cost, cost + maxRiceParam + 1) - cost;
+      total += 4 + cost[params[part]];
+    }
+    if (total < bestBits) {
+      bestBits = total;
+      bestOrder = partOrder;
+      bestParams = params;
+    }
+  }
+
+  bits.put(0, 2);
+  bits.put(bestOrder, 4);
+  partSize = n >> bestOrder;
+  pos = 0;
+  for (size_t part = 0; part < bestParams.size(); part++) {
+    int k = bestParams[part];
+    bits.put(k, 4);
+    size_t count = part ? partSize : partSize - order;
+    for (size_t i = 0; i < count; i++) {
+      uint32_t u = zigzag(residual[pos + i]);
+      bits.putUnary(u >> k);
+      bits.put(u, k);
+    }
+    pos += count;
+  }
+}
+
+void writeSubframe(BitWriter& bits, const Subframe& sub, const int32_t* x, uint32_t n)
+{
+  bits.put(0, 1);
+  switch (sub.type) {
+    case Constant:
+      bits.put(0, 6);
+      bits.put(0, 1);
+      bits.putSigned(x[0], sub.bps);
+      break;
+    case Verbatim:
+      bits.put(1, 6);
+      bits.put(0, 1);
+      for (uint32_t i = 0; i < n; i++) {
+        bits.putSigned(x[i], sub.bps);
+      }
+      break;
+    case Fixed:
+      bits.put(8 | sub.order, 6);
+      bits.put(0, 1);
+      for (int i = 0; i < sub.order; i++) {
+        bits.putSigned(x[i], sub.bps);
+      }
+      writeResidual(bits, sub.residual, n, sub.order);
+      break;
+    case Lpc:
+      bits.put(32 | (sub.order - 1), 6);
+      bits.put(0, 1);
+      for (int i = 0; i < sub.order; i++) {
+        bits.putSigned(x[i], sub.bps);
+      }
+      bits.put(lpcPrecision - 1, 4);
+      bits.putSigned(sub.shift, 5);
+      for (int32_t coef : sub.coefs) {
+        bits.putSigned(coef, lpcPrecision);
+      }
+      writeResidual(bits, sub.residual, n, sub.order);
+      break;
+  }
+}
+
+int sampleRateCode(uint32_t sampleRate)
+{
+  switch (sampleRate) {
+    case 88200: return 1;
+    case 176400: return 2;
+    case 192000: return 3;
+    case 8000: return 4;
+    case 16000: return 5;
+    case 22050: return 6;
+    case 24000: return 7;
+    case 32000: return 8;
+    case 44100: return 9;
+    case 48000: return 10;
+    case 96000: return 11;
+    default: return 0;
+  }
+}
+
+std::vector<uint8_t> encodeFrame(const int32_t* left, const int32_t* right, uint32_t n, uint32_t sampleRate, uint32_t frameNumber)
+{
+  // Pick the stereo decorrelation that gives the smallest pair of subframes
+  int channelMode = right ? 1 : 0;
+  std::vector<int32_t> mid, side;
+  Subframe first = planSubframe(left, n, 16), second;
+  const int32_t* firstData = left;
+  const int32_t* secondData = right;
+  if (right) {
+    mid.resize(n);
+    side.resize(n);
+    for (uint32_t i = 0; i < n; i++) {
+      mid[i] = (left[i] + right[i]) >> 1;
+      side[i] = left[i] - right[i];
+    }
+    Subframe rightSub = planSubframe(right, n, 16);
+    Subframe midSub = planSubframe(mid.data(), n, 16);
+    Subframe sideSub = planSubframe(side.data(), n, 17);
+    uint64_t sizes[] = {
+      first.bits + rightSub.bits,
+      first.bits + sideSub.bits,
+      sideSub.bits + rightSub.bits,
+      midSub.bits + sideSub.bits,
+    };
+    int mode = std::min_element(sizes, sizes + 4) - sizes;
+    switch (mode) {
+      case 0:
+        second = std::move(rightSub);
+        break;
+      case 1:
+        channelMode = 8;
+        second = std::move(sideSub);
+        secondData = side.data();
+        break;
+      case 2:
+        channelMode = 9;
+        first = std::move(sideSub);
+        firstData = side.data();
+        second = std::move(rightSub);
+        break;
+      default:
+        channelMode = 10;
+        first = std::move(midSub);
+        firstData = mid.data();
+        second = std::move(sideSub);
+        secondData = side.data();
+        break;
+    }
+  }
+
+  BitWriter bits;
+  bits.put(0x3FFE, 14);
+  bits.put(0, 1);
+  bits.put(0, 1);
+  int blockCode = n == blockSize ? 12 : n <= 256 ? 6 : 7;
+  bits.put(blockCode, 4);
+  bits.put(sampleRateCode(sampleRate), 4);
+  bits.put(channelMode, 4);
+  bits.put(4, 3);
+  bits.put(0, 1);
+  bits.putUTF8(frameNumber);
+  if (blockCode == 6) {
+    bits.put(n - 1, 8);
+  } else if (blockCode == 7) {
+    bits.put(n - 1, 16);
+  }
+  bits.put(crc8(bits.bytes.data(), bits.bytes.size()), 8);
+
+  writeSubframe(bits, first, firstData, n);
+  if (right) {
+    writeSubframe(bits, second, secondData, n);
+  }
+  bits.align();
+  bits.put(crc16(bits.bytes.data(), bits.bytes.size()), 16);
+  return std::move(bits.bytes);
+}
+
+}
+
+FlacWriter::FlacWriter(uint32_t sampleRate, bool stereo, uint64_t numFrames)
+: seekable(false), sampleRate(sampleRate), numChannels(stereo ? 2 : 1), numThreads(0), totalFrames(numFrames),
+  framesWritten(0), frameNumber(0), minFrameBytes(0), maxFrameBytes(0)
+{
+  // initializers only
+}
+
+FlacWriter::~FlacWriter()
+{
+  close();
+}
+
+bool FlacWriter::isFlacFilename(const std::string& filename)
+{
+  if (filename.size() < 5) {
+    return false;
+  }
+  std::string ext = filename.substr(filename.size() - 5);
+  std::transform(ext.begin(), ext.end(), ext.begin(), ::tolower);
+  return ext == ".flac";
+}
+
+void FlacWriter::setThreads(int threads)
+{
+  numThreads = threads;
+}
+
+bool FlacWriter::open(const std::string& filename)
+{
+  file.open(filename, std::ios::out | std::ios::binary | std::ios::trunc);
+  if (!file) {
+    return false;
+  }
+  // Pipes can't be rewound to fill in the final stream details
+  seekable = file.tellp() != std::streampos(-1);
+  file.clear();
+  file.write("fLaC", 4);
+  writeStreamInfo();
+  return bool(file);
+}
+
+void FlacWriter::writeStreamInfo()
+{
+  uint64_t frames = framesWritten ? framesWritten : totalFrames;
+  BitWriter bits;
+  // Last metadata block, type STREAMINFO, 34 bytes
+  bits.put(0x80, 8);
+  bits.put(34, 24);
+  bits.put(blockSize, 16);
+  bits.put(blockSize, 16);
+  bits.put(minFrameBytes, 24);
+  bits.put(maxFrameBytes, 24);
+  bits.put(sampleRate, 20);
+  bits.put(numChannels - 1, 3);
+  bits.put(15, 5);
+  bits.put(uint32_t(frames >> 32), 4);
+  bits.put(uint32_t(frames), 32);
+  // MD5 left unset
+  for (int i = 0; i < 4; i++) {
+    bits.put(0, 32);
+  }
+  file.write(reinterpret_cast<const char*>(bits.bytes.data()), bits.bytes.size());
+}
+
+void FlacWriter::write(const std::vector<int16_t>& mono)
+{
+  if (numChannels == 2) {
+    write(mono, mono);
+    return;
+  }
+  pending[0].insert(pending[0].end(), mono.begin(), mono.end());
+  encodeFrames(false);
+}
+
+void FlacWriter::write(const std::vector<int16_t>& left, const std::vector<int16_t>& right)
+{
+  if (numChannels == 1) {
+    std::vector<int16_t> mono(left.size());
+    for (size_t i = 0; i < left.size(); i++) {
+      mono[i] = (left[i] + right[i]) >> 1;
+    }
+    write(mono);
+    return;
+  }
+  pending[0].insert(pending[0].end(), left.begin(), left.end());
+  pending[1].insert(pending[1].end(), right.begin(), right.end());
+  encodeFrames(false);
+}
+
+void FlacWriter::encodeFrames(bool flushAll)
+{
+  int threads = numThreads > 0 ? numThreads : std::max(1u, std::thread::hardware_concurrency());
+  size_t available = pending[0].size();
+  size_t batchFrames = size_t(threads) * framesPerThread;
+  if (!flushAll && available < batchFrames * blockSize) {
+    return;
+  }
+  size_t numBlocks = flushAll ? (available + blockSize - 1) / blockSize : available / blockSize;
+  std::vector<std::vector<uint8_t>> encoded(numBlocks);
+  std::atomic<size_t> nextBlock(0);
+  auto worker = [&]{
+    for (size_t i = nextBlock++; i < numBlocks; i = nextBlock++) {
+      size_t start = i * blockSize;
+      uint32_t n = std::min<size_t>(blockSize, available - start);
+      encoded[i] = encodeFrame(pending[0].data() + start, numChannels > 1 ? pending[1].data() + start : nullptr,
+          n, sampleRate, frameNumber + i);
+    }
+  };
+  std::vector<std::thread> pool;
+  for (int i = 1; i < threads && size_t(i) < numBlocks; i++) {
+    pool.emplace_back(worker);
+  }
+  worker();
+  for (std::thread& thread : pool) {
+    thread.join();
+  }
+
+  for (const std::vector<uint8_t>& frame : encoded) {
+    file.write(reinterpret_cast<const char*>(frame.data()), frame.size());
+    if (!minFrameBytes || frame.size() < minFrameBytes) {
+      minFrameBytes = frame.size();
+    }
+    maxFrameBytes = std::max<uint32_t>(maxFrameBytes, frame.size());
+  }
+  size_t consumed = std::min(available, numBlocks * blockSize);
+  for (int ch = 0; ch < numChannels; ch++) {
+    pending[ch].erase(pending[ch].begin(), pending[ch].begin() + consumed);
+  }
+  framesWritten += consumed;
+  frameNumber += numBlocks;
+}
+
+void FlacWriter::close()
+{
+  if (!file.is_open()) {
+    return;
+  }
+  encodeFrames(true);
+  if (seekable) {
+    file.seekp(4);
+    writeStreamInfo();
+  }
+  file.close();
+}
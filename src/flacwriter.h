@@ -0,0 +1,43 @@
+#ifndef B2W_FLACWRITER_H
+#define B2W_FLACWRITER_H
+
+#include <cstdint>
+#include <fstream>
+#include <string>
+#include <vector>
+
+// Writes 16-bit PCM as a FLAC stream. The interface mirrors RiffWriter so
+// either can be used to save a render. Frames are encoded in batches, with
+// each frame of a batch encoded on its own thread.
+class FlacWriter {
+public:
+  FlacWriter(uint32_t sampleRate, bool stereo, uint64_t numFrames = 0);
+  ~FlacWriter();
+
+  bool open(const std::string& filename);
+  void write(const std::vector<int16_t>& mono);
+  void write(const std::vector<int16_t>& left, const std::vector<int16_t>& right);
+  void close();
+
+  // 0 uses one thread per hardware thread
+  void setThreads(int threads);
+
+  static bool isFlacFilename(const std::string& filename);
+
+private:
+  void encodeFrames(bool flushAll);
+  void writeStreamInfo();
+
+  std::ofstream file;
+  bool seekable;
+  uint32_t sampleRate;
+  int numChannels;
+  int numThreads;
+  uint64_t totalFrames;
+  uint64_t framesWritten;
+  uint32_t frameNumber;
+  uint32_t minFrameBytes, maxFrameBytes;
+  std::vector<int32_t> pending[2];
+};
+
+#endif
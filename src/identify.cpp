@@ -1,6 +1,6 @@
 #include "identify.h"
 
-static bool isIfsFile(char header[36])
+static bool isIfsFile(const uint8_t* header)
 {
   uint32_t magic = parseIntBE<uint32_t>(header, 0);
   if (magic == 0x6CAD8F89) {
@@ -14,20 +14,19 @@ static bool isIfsFile(char header[36])
   return false;
 }
 
-BemaniFileType identifyFileType(ClefContext* ctx, const std::string& inputFilename, std::istream* filePtr)
+BemaniFileType identifyFileType(ClefContext* ctx, const std::string& inputFilename, ByteSource* source)
 {
-  std::unique_ptr<std::istream> owned;
+  std::unique_ptr<ByteSource> owned;
   int qPos = inputFilename.find('?');
   std::string filename = qPos < 0 ? inputFilename : inputFilename.substr(0, qPos);
 
-  if ((!filePtr || !*filePtr) && qPos >= 0) {
-    owned = ctx->openFile(filename);
-    filePtr = owned.get();
+  if (!source) {
+    owned.reset(ByteSource::open(ctx, filename));
+    source = owned.get();
   }
-  if (!filePtr || !*filePtr) {
+  if (!source) {
     return FT_invalid;
   }
-  std::istream& file = *filePtr;
 
   int extPos = filename.rfind(".");
   if (extPos != std::string::npos) {
@@ -35,7 +34,7 @@ BemaniFileType identifyFileType(ClefContext* ctx, const std::string& inputFilena
     if (extension == "1") {
       std::string baseName = filename.substr(0, extPos);
       std::string pairName = baseName + ".s3p";
-      auto pair = ctx->openFile(pairName);
+      std::unique_ptr<ByteSource> pair(ByteSource::open(ctx, pairName));
       if (pair) {
         BemaniFileType pairFT = identifyFileType(ctx, pairName, pair.get());
         if (pairFT == FT_s3p) {
@@ -43,7 +42,7 @@ BemaniFileType identifyFileType(ClefContext* ctx, const std::string& inputFilena
         }
       }
       pairName = baseName + ".2dx";
-      pair = ctx->openFile(pairName);
+      pair.reset(ByteSource::open(ctx, pairName));
       if (pair) {
         BemaniFileType pairFT = identifyFileType(ctx, pairName, pair.get());
         if (pairFT == FT_2dx) {
@@ -53,45 +52,68 @@ BemaniFileType identifyFileType(ClefContext* ctx, const std::string& inputFilena
       return FT_invalid;
     }
   }
-  char header[36];
-  file.read(header, 36);
-  if (!file.good()) {
+  uint8_t header[36];
+  if (!source->read(0, header, 36)) {
     return FT_invalid;
   }
   if (isIfsFile(header)) {
-    file.seekg(0);
     return FT_ifs;
   }
   uint32_t offsetBase = header[0] == '%' ? 8 : 0;
   uint32_t magic = parseIntBE<uint32_t>(header, 0);
   if (magic == 'S3P0') {
-    file.seekg(0);
     return FT_s3p;
+  } else if (magic == 'B2WB') {
+    return FT_bundle;
   }
-  if (offsetBase == 8) {
-    file.ignore(8);
-  }
-  file.ignore(36);
-  if (!file.read(header, 4)) {
+  // The first entry of a 2DX offset table should point at a sample
+  if (!source->read(72 + offsetBase, header, 4)) {
     return FT_invalid;
   }
   uint32_t sampleOffset = parseInt<uint32_t>(header, 0) + offsetBase;
-  if (file.seekg(sampleOffset) && file.read(header, 12)) {
+  if (source->read(sampleOffset, header, 12)) {
     uint32_t magic = parseIntBE<uint32_t>(header, 0);
     if (magic == '2DX9' || magic == 'SD9\0') {
-      file.seekg(0);
       return FT_2dx;
     }
   }
   return FT_invalid;
 }
 
+BemaniFileType identifyFileType(ClefContext* ctx, const std::string& filename, std::istream* file)
+{
+  if (!file || !*file) {
+    return identifyFileType(ctx, filename);
+  }
+  BemaniFileType type;
+  {
+    ByteSource source(*file);
+    type = identifyFileType(ctx, filename, &source);
+  }
+  // Callers go on to read the file from the beginning
+  file->clear();
+  file->seekg(0);
+  return type;
+}
+
 bool isIfsFile(std::istream& file)
 {
-  char header[36];
-  file.read(header, 36);
-  bool ok = file.good();
+  ByteSource source(file);
+  uint8_t header[36];
+  bool ok = source.read(0, header, 36);
   file.clear();
   file.seekg(0);
   return ok && isIfsFile(header);
 }
+
+const char* fileTypeName(BemaniFileType type)
+{
+  switch (type) {
+    case FT_2dx: return "2dx";
+    case FT_s3p: return "s3p";
+    case FT_1: return "1";
+    case FT_ifs: return "ifs";
+    case FT_bundle: return "bundle";
+    default: return "invalid";
+  }
+}
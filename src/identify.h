@@ -4,6 +4,7 @@
 #include <iostream>
 #include <string>
 #include "clefcontext.h"
+#include "bytesource.h"
 
 enum BemaniFileType {
   FT_invalid,
@@ -11,9 +12,16 @@ enum BemaniFileType {
   FT_s3p,
   FT_1,
   FT_ifs,
+  FT_bundle,
 };
 
-BemaniFileType identifyFileType(ClefContext* ctx, const std::string& filename, std::istream* file = nullptr);
+// Opens the file by name if no source is given.
+BemaniFileType identifyFileType(ClefContext* ctx, const std::string& filename, ByteSource* source = nullptr);
+// Rewinds the stream afterward.
+BemaniFileType identifyFileType(ClefContext* ctx, const std::string& filename, std::istream* file);
 bool isIfsFile(std::istream& file);
 
+// Returns a short lowercase name for the type, e.g. "ifs".
+const char* fileTypeName(BemaniFileType type);
+
 #endif
@@ -3,9 +3,11 @@
 #include "manifest.h"
 #include "synth/synthcontext.h"
 #include "ifssequence.h"
+#include "../bytesource.h"
 #include <fstream>
 #include <sstream>
 #include <exception>
+#include <thread>
 
 struct FileNode {
   std::string name;
@@ -29,11 +31,10 @@ std::string IFS::pairedFile(const std::string& filename)
   return std::string();
 }
 
-IFS::IFS(std::istream& source)
+IFS::IFS(ByteSource& source)
 {
-  char header[36];
-  source.read(header, 36);
-  if (!source.good()) {
+  const uint8_t* header = source.view(0, 36);
+  if (!header) {
     throw std::runtime_error("Error reading IFS header");
   }
   uint32_t magic = parseIntBE<uint32_t>(header, 0);
@@ -44,15 +45,16 @@ IFS::IFS(std::istream& source)
   }
   uint32_t manifestEnd = parseIntBE<uint32_t>(header, 16);
 
+  if (manifestEnd < 36) {
+    throw std::runtime_error("Invalid IFS header");
+  }
   std::vector<char> manifestBuffer(manifestEnd - 36);
-  source.read(manifestBuffer.data(), manifestEnd - 36);
-  if (!source.good()) {
+  if (!source.read(36, manifestBuffer.data(), manifestBuffer.size())) {
     throw std::runtime_error("IFS file truncated");
   }
   manifest = Manifest(manifestBuffer);
 
   std::vector<FileNode> pendingFiles;
-  uint32_t maxOffset = 0;
 
   for (const ManifestNode& node : manifest.root.children[0].children) {
     if (node.tag == "_info_" || node.tag == "_super_") {
@@ -77,17 +79,44 @@ IFS::IFS(std::istream& source)
     uint32_t start = parseIntBE<uint32_t>(node.data, 0);
     uint32_t size = parseIntBE<uint32_t>(node.data, 4);
     pendingFiles.push_back(FileNode{ name, start, size });
-    if (start + size > maxOffset) {
-      maxOffset = start + size;
+  }
+
+  // Each file is copied straight out of the source rather than through a
+  // buffer holding the whole archive
+  for (const FileNode& file : pendingFiles) {
+    std::vector<uint8_t>& data = files[file.name];
+    data.resize(file.size);
+    if (!source.read(uint64_t(manifestEnd) + file.start, data.data(), file.size)) {
+      throw std::runtime_error("IFS file truncated");
     }
   }
+}
 
-  std::vector<char> buffer(maxOffset);
-  source.read(buffer.data(), maxOffset);
-  if (!source.good()) {
-    throw std::runtime_error("IFS file truncated");
+std::vector<std::unique_ptr<IFS>> IFS::parseAll(const std::vector<ByteSource*>& sources)
+{
+  std::vector<std::unique_ptr<IFS>> result(sources.size());
+  std::vector<std::exception_ptr> errors(sources.size());
+  auto parse = [&](size_t i) {
+    try {
+      result[i].reset(new IFS(*sources[i]));
+    } catch (...) {
+      errors[i] = std::current_exception();
+    }
+  };
+  std::vector<std::thread> threads;
+  for (size_t i = 1; i < sources.size(); i++) {
+    threads.emplace_back(parse, i);
+  }
+  if (!sources.empty()) {
+    parse(0);
   }
-  for (auto file : pendingFiles) {
-    files[file.name] = std::vector<uint8_t>(buffer.begin() + file.start, buffer.begin() + file.start + file.size);
+  for (std::thread& thread : threads) {
+    thread.join();
+  }
+  for (const std::exception_ptr& error : errors) {
+    if (error) {
+      std::rethrow_exception(error);
+    }
   }
+  return result;
 }
@@ -3,16 +3,23 @@
 
 #include "clefconfig.h"
 #include <iostream>
+#include <memory>
 #include <unordered_map>
 #include <vector>
 #include "manifest.h"
 #include <stdint.h>
+class ByteSource;
 
 class IFS {
 public:
   static std::string pairedFile(const std::string& filename);
 
-  IFS(std::istream& source);
+  IFS(ByteSource& source);
+
+  // Parses the archives at the same time, one thread each, and rethrows the
+  // first error. The sources must be safe to read concurrently with each
+  // other, which they are unless two share a stream.
+  static std::vector<std::unique_ptr<IFS>> parseAll(const std::vector<ByteSource*>& sources);
 
   void addData(const char* buffer, ssize_t length);
 
@@ -4,17 +4,187 @@
 #include "sq3track.h"
 #include "sq2track.h"
 #include "phasetrack.h"
+#include "phasesolver.h"
 #include "../onetrack.h"
 #include "codec/adpcmcodec.h"
 #include "codec/sampledata.h"
 #include "../bmpcodec.h"
 #include "../bankloaders.h"
+#include "../bytesource.h"
+#include "../samplecache.h"
+#include "../samplestore.h"
+#include "../decodescheduler.h"
+#include "../canceltoken.h"
+#include "clefcontext.h"
 #include "utility.h"
 #include "synth/synthcontext.h"
+#include "synth/channel.h"
 #include <numeric>
+#include <cstdlib>
+#include <algorithm>
 #include <iostream>
 #include <sstream>
 #include <fstream>
+#include <thread>
+
+// Decodes a backing stream on its own thread while load() works through
+// the keysounds, or while the caller prepares to play phased streams. The
+// stream decodes into a private context and finish() moves it into the
+// sequence's context, so the shared context is only ever touched by the
+// loading thread. Playback that can't wait for the decode takes the
+// stream in compressed form instead, which stops the decode.
+class IFSSequence::StreamDecode {
+public:
+  StreamDecode(const std::vector<uint8_t>& data, uint64_t streamID, bool compress, const CancelToken* cancel)
+  : streamID(streamID), data(data), compress(compress), stop(cancel), sample(nullptr)
+  {
+    thread = std::thread([this]() {
+      try {
+        if (this->compress) {
+          compressed.reset(BmpCodec::compress(this->data));
+        }
+        if (!compressed) {
+          BmpCodec codec(&scratch);
+          codec.setCancelToken(&stop);
+          sample = SampleCache::decode(&codec, "bmp", this->data, this->streamID);
+        }
+      } catch (...) {
+        error = std::current_exception();
+      }
+    });
+  }
+
+  ~StreamDecode()
+  {
+    if (thread.joinable()) {
+      // Nothing will use the result
+      stop.cancel();
+      thread.join();
+    }
+    if (SampleStore* store = SampleStore::get()) {
+      store->release(&scratch);
+    }
+  }
+
+  // Waits for the stream and rethrows any error. A compressed stream is
+  // returned for the caller to own; a decoded one is registered with ctx
+  // and returned in published.
+  CompressedSample* finish(ClefContext* ctx, SampleData*& published)
+  {
+    thread.join();
+    if (error) {
+      std::rethrow_exception(error);
+    }
+    published = nullptr;
+    if (sample) {
+      published = new SampleData(ctx, streamID, sample->sampleRate, sample->loopStart, sample->loopEnd);
+      published->channels.swap(sample->channels);
+    }
+    return compressed.release();
+  }
+
+  // Returns the stream for the keysound mixer to decode as it plays, or
+  // null if it can't be compressed. Any full decode is abandoned.
+  CompressedSample* stream()
+  {
+    // Compressing doesn't check the token, so only a decode stops
+    stop.cancel();
+    thread.join();
+    return compressed ? compressed.release() : BmpCodec::compress(data);
+  }
+
+  const uint64_t streamID;
+
+private:
+  const std::vector<uint8_t>& data;
+  bool compress;
+  CancelToken stop;
+  ClefContext scratch;
+  std::thread thread;
+  std::unique_ptr<CompressedSample> compressed;
+  SampleData* sample;
+  std::exception_ptr error;
+};
+
+// Applies live mute and gain changes on the rendering thread. A context
+// reads each event of a channel when the one before it plays, so this
+// track's events, which do nothing, give it a chance to apply the queued
+// changes every controlInterval seconds. It ends with the longest track,
+// so it doesn't change the song's length.
+class IFSSequence::ControlTrack : public ITrack {
+public:
+  // No voice is ever started with this ID
+  static const uint64_t controlID = ~0ULL;
+  static constexpr double controlInterval = 0.05;
+
+  ControlTrack(IFSSequence* seq, double length)
+  : seq(seq), trackLength(length), time(0)
+  {
+    // initializers only
+  }
+
+  virtual bool isFinished() const { return time > trackLength; }
+  virtual double length() const { return trackLength; }
+
+protected:
+  virtual std::shared_ptr<SequenceEvent> readNextEvent()
+  {
+    seq->applyQueuedChanges();
+    if (time > trackLength) {
+      return nullptr;
+    }
+    std::shared_ptr<SequenceEvent> event(new KillEvent(controlID, time));
+    time += controlInterval;
+    return event;
+  }
+
+  virtual void internalReset() { time = 0; }
+
+private:
+  IFSSequence* seq;
+  double trackLength;
+  double time;
+};
+
+// Returns the parts that pass 2 of load() will find sequences for.
+static uint32_t expectedSequences(const std::vector<std::string>& seqFiles, bool useSQ3)
+{
+  uint32_t sequences = 0;
+  for (const std::string& filename : seqFiles) {
+    char last = filename.back();
+    if ((last == '3' && useSQ3) || (last == '2' && !useSQ3)) {
+      sequences |= IFSSequence::stringToSpaces(filename.substr(0, 1));
+    } else if (filename.size() >= 4 && filename.substr(filename.size() - 4) == ".bin") {
+      // pop'n charts don't use a backing stream
+      return 0;
+    }
+  }
+  return sequences;
+}
+
+// Picks the backing stream that best complements the sequenced parts.
+// Returns its score, or 0 if there's no stream.
+static int chooseStream(const std::unordered_map<uint64_t, std::string>& streams, uint32_t sequences, uint64_t& streamID, std::string& streamFilename)
+{
+  int streamScore = 0;
+  for (const auto& iter : streams) {
+    uint64_t streamType = iter.first;
+    int score = 0;
+    if (((streamType | sequences) & 0xF0000) == 0xF0000) {
+      // all parts are covered, pick the combination that uses the most sequenced tracks
+      score = countBits(0xF0000 & ~streamType) + 100;
+    } else {
+      // not all parts are covered, pick the combination that covers the most parts, at a penalty
+      score = countBits(0xF0000 & (streamType | sequences));
+    }
+    if (score > streamScore) {
+      streamFilename = iter.second;
+      streamID = iter.first;
+      streamScore = score;
+    }
+  }
+  return streamScore;
+}
 
 uint64_t IFSSequence::stringToSpaces(const std::string& channels)
 {
@@ -47,26 +217,83 @@ uint64_t IFSSequence::stringToSpaces(const std::string& channels)
 }
 
 IFSSequence::IFSSequence(ClefContext* ctx, bool usePreview)
-: BaseSequence<ITrack>(ctx), sampleRate(48000), mute(0), usePreview(usePreview)
+: BaseSequence<ITrack>(ctx), sampleRate(48000), mute(0), usePreview(usePreview), splitParts(false), compressSamples(false), scheduler(nullptr), cancel(nullptr), streamBytes(0),
+  separatedPhases(false), liveChanges(false), muteQueued(false), queuedMute(0), changesQueued(false)
 {
   // initializers only
 }
 
+IFSSequence::~IFSSequence()
+{
+  // Stream decodes still running are joined by their destructors
+}
+
 void IFSSequence::addIFS(IFS* ifs)
 {
   files.emplace_back(ifs);
 }
 
+void IFSSequence::addPartTrack(ITrack* track, uint64_t part)
+{
+  addTrack(track);
+  trackParts.push_back(part);
+}
+
 void IFSSequence::load()
 {
   std::unordered_map<uint64_t, std::string> streams;
   std::vector<std::string> seqFiles;
   bool useSQ3 = false;
   uint32_t sequences = 0;
+  // Split parts are all loaded so that they can be muted after loading
+  uint64_t loadMute = splitParts ? 0 : mute;
+  phasedMixes.clear();
+
+  for (const auto& ifs : files) {
+    // Pass 0: names of the streams and sequences
+    for (const auto& iter : ifs->files) {
+      const auto& filename = iter.first;
+      int extPos = filename.rfind(".");
+      if (extPos == std::string::npos) {
+        continue;
+      }
+      std::string extension = filename.substr(extPos + 1);
+      if (extension == "bin" && filename.substr(0, 3) == "bgm") {
+        size_t pos = filename.rfind('.');
+        int streamType = stringToSpaces(filename.substr(pos - 4, 4)) | SampleSpaces::Backing;
+        streams[streamType] = filename;
+      } else if (extension == "bin") {
+        seqFiles.push_back(filename);
+      } else if (extension.find("sq") == 0) {
+        useSQ3 = useSQ3 || filename.back() == '3';
+        seqFiles.push_back(filename);
+      }
+    }
+  }
+
+  // The backing stream usually lives in the bgm archive and the keysounds in
+  // the seq archive. Which stream plays only depends on the file names, so
+  // it can decode while pass 1 decodes the keysounds. A scheduler already
+  // takes decoding off this thread, so it's left alone then.
+  std::unique_ptr<StreamDecode> prefetched;
+  if (!usePreview && !(loadMute & SampleSpaces::Backing) && !DecodeScheduler::forContext(context())) {
+    uint32_t expected = expectedSequences(seqFiles, useSQ3);
+    uint64_t streamID;
+    std::string streamFilename;
+    if (expected && chooseStream(streams, expected, streamID, streamFilename)) {
+      for (const auto& ifs : files) {
+        auto iter = ifs->files.find(streamFilename);
+        if (iter != ifs->files.end()) {
+          prefetched.reset(new StreamDecode(iter->second, streamID, compressSamples, cancel));
+          break;
+        }
+      }
+    }
+  }
 
   for (const auto& ifs : files) {
     // Pass 1: samples
-    for (auto iter : ifs->files) {
+    for (const auto& iter : ifs->files) {
       const auto& filename = iter.first;
       int extPos = filename.rfind(".");
       if (extPos == std::string::npos) {
@@ -79,10 +306,24 @@ void IFSSequence::load()
         int sampleSpace = stringToSpaces(filename.substr(extPos - 1, 1));
         VA3 va3(ifs.get(), filename);
         for (auto iter2 : va3.files) {
+          CancelToken::check(cancel);
           auto span = va3.get(iter2.first);
-          AdpcmCodec codec(context(), AdpcmCodec::OKI4s, iter2.second.channels > 1 ? -1 : 0);
-          SampleData* sample = codec.decodeRange(span.first, span.second, sampleSpace | iter2.second.sampleID);
-          sampleData[sampleSpace | iter2.second.sampleID] = iter2.second;
+          uint64_t sampleID = sampleSpace | iter2.second.sampleID;
+          int channels = iter2.second.channels > 1 ? 2 : 1;
+          const uint8_t* bytes = span.first == span.second ? nullptr : &*span.first;
+          size_t size = span.second - span.first;
+          if (!compressSample(sampleID, bytes, size, channels, iter2.second.sampleRate)) {
+            AdpcmCodec codec(context(), AdpcmCodec::OKI4s, channels > 1 ? -1 : 0);
+            const char* params = channels > 1 ? "oki4s-interleaved" : "oki4s";
+            SampleData* sample = SampleCache::decode(&codec, params, span.first, span.second, sampleID);
+            if (!sample) {
+              // Decoding was deferred
+              DecodeScheduler::forContext(context())->setSampleRate(sampleID, iter2.second.sampleRate);
+            } else {
+              sample->sampleRate = iter2.second.sampleRate;
+            }
+          }
+          sampleData[sampleID] = iter2.second;
           std::istringstream ss(iter2.first, std::ios::in);
           int fileNumber;
           ss >> std::hex >> fileNumber;
@@ -92,38 +333,27 @@ void IFSSequence::load()
               sampleData[fnID] = iter2.second;
             }
           }
-          sample->sampleRate = iter2.second.sampleRate;
         }
         for (auto iter2 : va3.defaultDrums) {
           sampleData[SampleSpaces::ByNote | sampleSpace | iter2.first] = sampleData[sampleSpace | iter2.second];
         }
       } else if (extension == "2dx") {
-        std::string str(reinterpret_cast<const char*>(iter.second.data()), iter.second.size());
-        std::istringstream ss(str);
+        ByteSource bank(iter.second.data(), iter.second.size());
         if (filename.find("_pre") != std::string::npos) {
           if (!usePreview) {
             continue;
           }
-          ::load2DX(context(), &ss);
+          ::load2DX(context(), &bank, 0, 0, cancel);
           BasicTrack* track = new BasicTrack;
           SampleEvent* event = new SampleEvent;
           event->timestamp = 0;
           event->sampleID = 0x10001ULL;
           track->addEvent(event);
-          addTrack(track);
+          addPartTrack(track, 0);
           return;
         } else if (!usePreview) {
-          ::load2DX(context(), &ss);
+          ::load2DX(context(), &bank, 0, 0, cancel);
         }
-      } else if (extension == "bin" && filename.substr(0, 3) == "bgm") {
-        size_t pos = filename.rfind('.');
-        int streamType = stringToSpaces(filename.substr(pos - 4, 4)) | SampleSpaces::Backing;
-        streams[streamType] = filename;
-      } else if (extension == "bin") {
-        seqFiles.push_back(filename);
-      } else if (extension.find("sq") == 0) {
-        useSQ3 = useSQ3 || filename.back() == '3';
-        seqFiles.push_back(filename);
       }
     }
   }
@@ -140,23 +370,22 @@ void IFSSequence::load()
       int sampleSpace = stringToSpaces(filename.substr(0, 1));
       if (filename[filename.size() - 1] == '3') {
         if (useSQ3) {
-          if (!(sampleSpace & mute)) {
-            addTrack(new Sq3Track(this, &data[0], data.size(), sampleSpace));
+          if (!(sampleSpace & loadMute)) {
+            addPartTrack(new Sq3Track(this, &data[0], data.size(), sampleSpace), sampleSpace);
           }
           sequences |= sampleSpace;
         }
       } else if (filename[filename.size() - 1] == '2') {
         if (!useSQ3) {
-          if (!(sampleSpace & mute)) {
-            addTrack(new Sq2Track(this, &data[0], data.size(), sampleSpace));
+          if (!(sampleSpace & loadMute)) {
+            addPartTrack(new Sq2Track(this, &data[0], data.size(), sampleSpace), sampleSpace);
           }
           sequences |= sampleSpace;
         }
       } else if (filename.substr(filename.size() - 4) == ".bin") {
         // pop'n
-        std::string str(reinterpret_cast<const char*>(data.data()), data.size());
-        std::istringstream ss(str);
-        addTrack(new OneTrack(ss, true));
+        ByteSource chart(data.data(), data.size());
+        addPartTrack(new OneTrack(chart, true), 0);
         return;
       } else {
         std::cerr << "Warning: unknown sequence type: " << filename << std::endl;
@@ -169,55 +398,59 @@ void IFSSequence::load()
     return;
   }
 
-  if (mute & SampleSpaces::Backing) {
+  if (loadMute & SampleSpaces::Backing) {
     // user doesn't want the backing track
     return;
   }
 
-  const IFS* streamSource = nullptr;
-  std::string streamFilename;
-  int streamScore = 0;
   // Pass 3: streams
-  for (const auto& iter : streams) {
-    uint64_t streamType = iter.first;
-    int score = 0;
-    if (((streamType | sequences) & 0xF0000) == 0xF0000) {
-      // all parts are covered, pick the combination that uses the most sequenced tracks
-      score = countBits(0xF0000 & ~streamType) + 100;
-    } else {
-      // not all parts are covered, pick the combination that covers the most parts, at a penalty
-      score = countBits(0xF0000 & (streamType | sequences));
-    }
-    if (score > streamScore) {
-      streamFilename = iter.second;
-      streamScore = score;
-    }
-  }
+  std::string streamFilename;
+  uint64_t streamID = 0;
+  int streamScore = chooseStream(streams, sequences, streamID, streamFilename);
 
   if (streamScore) {
     BmpCodec codec(context());
+    codec.setCancelToken(cancel);
     SampleData* sample = nullptr;
-    for (const auto& ifs : files) {
-      auto iter = ifs->files.find(streamFilename);
-      if (iter == ifs->files.end()) {
-        continue;
+    CompressedSample* compressed = nullptr;
+    double streamDuration = 0;
+    if (prefetched && prefetched->streamID == streamID) {
+      compressed = prefetched->finish(context(), sample);
+      if (compressed) {
+        compressedSamples[streamID].reset(compressed);
+      }
+    } else {
+      for (const auto& ifs : files) {
+        auto iter = ifs->files.find(streamFilename);
+        if (iter == ifs->files.end()) {
+          continue;
+        }
+        compressed = compressSamples ? BmpCodec::compress(iter->second) : nullptr;
+        if (compressed) {
+          compressedSamples[streamID].reset(compressed);
+          break;
+        }
+        sample = SampleCache::decode(&codec, "bmp", iter->second, streamID);
+        if (!sample && DecodeScheduler::forContext(context())) {
+          // Decoding was deferred, so the length comes from the header
+          streamDuration = BmpCodec::duration(iter->second);
+        }
+        break;
       }
-      sample = codec.decode(iter->second);
-      break;
     }
-    if (!sample) {
+    if (!sample && !compressed && streamDuration <= 0) {
       std::cerr << "Unable to find stream: " << streamFilename << std::endl;
       return;
     }
     BasicTrack* track = new BasicTrack;
     SampleEvent* event = new SampleEvent;
-    event->sampleID = sample->sampleID;
+    event->sampleID = streamID;
     event->timestamp = 0;
-    event->duration = sample->duration();
+    event->duration = compressed ? compressed->duration() : sample ? sample->duration() : streamDuration;
     // TODO: is the volume stored somewhere?
     event->volume = 2.0;
     track->addEvent(event);
-    addTrack(track);
+    addPartTrack(track, SampleSpaces::Backing);
   }
 }
 
@@ -225,83 +458,165 @@ void IFSSequence::setMutes(const std::string& channels)
 {
   uint64_t spaces = stringToSpaces(channels);
   mute = 0x1F0000 & spaces;
+  applyMutes();
 }
 
 void IFSSequence::setSolo(const std::string& channels)
 {
   uint64_t spaces = stringToSpaces(channels);
   mute = 0x1F0000 & ~spaces;
+  applyMutes();
 }
 
-struct ScoreResult {
-  uint32_t score;
-  std::vector<uint64_t> streams;
-};
+void IFSSequence::setPartGain(uint64_t parts, double gain)
+{
+  for (uint64_t part : { SampleSpaces::Drums, SampleSpaces::Guitar, SampleSpaces::Bass, SampleSpaces::Keyboard, SampleSpaces::Backing }) {
+    if (parts & part) {
+      partGains[part] = gain;
+    }
+  }
+  applyMutes();
+}
 
-static ScoreResult scoreCombination(uint64_t mute, uint32_t base, std::vector<uint64_t> add, ScoreResult before = { 0, {} })
-{
-  ScoreResult result{ 0, {} };
-  bool isLast = add.size() == 1;
-  int neededChannels = 4 - countBits(mute);
-  for (uint64_t streamID : add) {
-    if (streamID & mute) {
-      continue;
-    }
-    bool invert = streamID & SampleSpaces::Invert;
-    uint32_t v = (streamID >> 16) & 0xF;
-    uint32_t score = 0;
-    uint32_t chanSum = 0;
-    int goodChannels = 0;
-    bool reject = false;
-    for (int i = 0; i < 4; i++) {
-      uint8_t chanScore = (v >> i) & 0x01;
-      uint8_t baseScore = (base >> (i * 8)) & 0xFF;
-      if (chanScore && invert == !(baseScore & 1)) {
-        // Don't subtract a channel that isn't already there
-        reject = true;
-        break;
-      }
-      chanScore += baseScore;
-      chanSum |= chanScore << (i * 8);
-      if (isLast && chanScore & 1 == 0) {
-        // If any channels would be left out, this combination is bad
-        break;
-      } else if (chanScore == 1) {
-        // If a channel gets represented once, that's best
-        score += 10;
-        goodChannels++;
-      } else if (chanScore & 1 == 1) {
-        // If a channel gets represented an odd number of times, that's acceptable,
-        // but 3 is better than 5 or higher
-        score += (chanScore == 3 ? 7 : 6);
-        goodChannels++;
-      }
+void IFSSequence::setLiveChanges(bool live)
+{
+  liveChanges = live;
+}
+
+bool IFSSequence::queueMutes(const std::string& channels)
+{
+  std::lock_guard<std::mutex> lock(queueMutex);
+  if (!controlTrack) {
+    return false;
+  }
+  muteQueued = true;
+  queuedMute = 0x1F0000 & stringToSpaces(channels);
+  changesQueued = true;
+  return true;
+}
+
+bool IFSSequence::queueSolo(const std::string& channels)
+{
+  std::lock_guard<std::mutex> lock(queueMutex);
+  if (!controlTrack) {
+    return false;
+  }
+  muteQueued = true;
+  queuedMute = 0x1F0000 & ~stringToSpaces(channels);
+  changesQueued = true;
+  return true;
+}
+
+bool IFSSequence::queuePartGain(uint64_t parts, double gain)
+{
+  std::lock_guard<std::mutex> lock(queueMutex);
+  if (!controlTrack) {
+    return false;
+  }
+  for (uint64_t part : { SampleSpaces::Drums, SampleSpaces::Guitar, SampleSpaces::Bass, SampleSpaces::Keyboard, SampleSpaces::Backing }) {
+    if (parts & part) {
+      queuedGains[part] = gain;
     }
-    if (reject) {
-      continue;
+  }
+  changesQueued = true;
+  return true;
+}
+
+void IFSSequence::applyQueuedChanges()
+{
+  // Only called from the rendering thread, which owns mute and partGains
+  if (!changesQueued) {
+    return;
+  }
+  {
+    std::lock_guard<std::mutex> lock(queueMutex);
+    if (muteQueued) {
+      mute = queuedMute;
     }
-    if (goodChannels < neededChannels) {
-      // Some channels are missing, recurse
-      std::vector<uint64_t> rest;
-      for (uint64_t v : add) {
-        if ((v & ~SampleSpaces::Invert) != (streamID & ~SampleSpaces::Invert)) {
-          rest.push_back(v);
-        }
-      }
-      ScoreResult recScore = scoreCombination(mute, chanSum, rest, result);
-      if (recScore.score > result.score) {
-        result = recScore;
-        result.streams.push_back(streamID);
-      }
-    } else if (score > result.score) {
-      result.score = score;
-      result.streams = before.streams;
-      result.streams.push_back(streamID);
+    for (const auto& iter : queuedGains) {
+      partGains[iter.first] = iter.second;
+    }
+    muteQueued = false;
+    queuedGains.clear();
+    changesQueued = false;
+  }
+  applyMutes();
+}
+
+bool IFSSequence::isTrackActive(int index) const
+{
+  if (!phasedMixes.empty()) {
+    // Phased streams: a mix plays when exactly the parts it was solved for
+    // are muted. The backing can only be muted if the parts were separated,
+    // and the separated parts play whenever the mixdown doesn't, which
+    // includes when a part's gain has been changed.
+    uint64_t muted = mute & (separatedPhases ? 0x1F0000 : 0xF0000);
+    bool useParts = muted;
+    for (const auto& iter : partGains) {
+      useParts = useParts || (separatedPhases && iter.second != 1.0);
+    }
+    auto mix = phasedMixes.find(index);
+    if (mix != phasedMixes.end()) {
+      return useParts ? (!separatedPhases && mix->second == muted) : mix->second == 0;
+    } else if (!useParts) {
+      return false;
+    }
+  }
+  return !(trackParts[index] & mute);
+}
+
+void IFSSequence::applyMutes()
+{
+  // Before initContext(), mutes are applied by load().
+  // Afterward, changing a mute is just a channel update, except that a
+  // context playing through the mixer has only the mixer's channel.
+  if (!ctx || mixerTrack) {
+    return;
+  }
+  for (int i = 0; i < numTracks() && i < ctx->numChannels(); i++) {
+    Channel* channel = ctx->channel(i);
+    channel->mute = !isTrackActive(i);
+    auto gainIter = partGains.find(trackParts[i]);
+    channel->gain = gainIter == partGains.end() ? 1.0 : gainIter->second;
+  }
+}
+
+void IFSSequence::setSplitParts(bool split)
+{
+  // When splitting, every part is loaded regardless of mutes and phased
+  // backing streams are also resolved once per part, with the backing
+  // cancelled out of each and given a track of its own, so that each part
+  // can be rendered on its own or muted without reloading.
+  splitParts = split;
+}
+
+std::vector<uint64_t> IFSSequence::parts() const
+{
+  std::vector<uint64_t> result;
+  for (uint64_t part : { SampleSpaces::Drums, SampleSpaces::Guitar, SampleSpaces::Bass, SampleSpaces::Keyboard, SampleSpaces::Backing }) {
+    if (!(part & mute) && std::find(trackParts.begin(), trackParts.end(), part) != trackParts.end()) {
+      result.push_back(part);
     }
   }
   return result;
 }
 
+// Every bgm stream contains the backing, so a combination of them carries
+// the backing once for each stream added and once less for each inverted
+// one. Adding the backing-only stream with the opposite sign that many
+// times leaves just the parts.
+static void cancelBacking(std::vector<uint64_t>& streams)
+{
+  int copies = 0;
+  for (uint64_t streamID : streams) {
+    copies += (streamID & SampleSpaces::Invert) ? -1 : 1;
+  }
+  uint64_t canceller = copies > 0 ? (SampleSpaces::Invert | SampleSpaces::Backing) : SampleSpaces::Backing;
+  for (int i = 0; i < std::abs(copies); i++) {
+    streams.push_back(canceller);
+  }
+}
+
 void IFSSequence::usePhasedStreams(const std::unordered_map<uint64_t, std::string>& streams)
 {
   std::vector<uint64_t> allStreams;
@@ -309,33 +624,274 @@ void IFSSequence::usePhasedStreams(const std::unordered_map<uint64_t, std::strin
     allStreams.push_back(iter.first);
     allStreams.push_back(SampleSpaces::Invert | iter.first);
   }
-  ScoreResult result = scoreCombination(mute & 0xF0000, 0, allStreams);
-  if (result.streams.empty()) {
-    return;
+  // A part track is isolated from the backing, while a mix track has the
+  // backing and every part that wasn't muted when it was solved.
+  struct Combination {
+    uint64_t part;
+    bool isMix;
+    uint64_t mutedParts;
+    std::vector<uint64_t> streams;
+  };
+  std::vector<Combination> combinations;
+  bool hasBacking = streams.count(SampleSpaces::Backing);
+  separatedPhases = splitParts && hasBacking;
+  if (separatedPhases) {
+    // The full mix is cleaner than the sum of the separated parts, so the
+    // parts are only used when something is muted.
+    ScoreResult mixdown = scoreCombination(0, allStreams);
+    if (!mixdown.streams.empty()) {
+      combinations.push_back({ 0xF0000, true, 0, mixdown.streams });
+    }
+    for (uint64_t part : { SampleSpaces::Drums, SampleSpaces::Guitar, SampleSpaces::Bass, SampleSpaces::Keyboard }) {
+      ScoreResult result = scoreCombination(0xF0000 & ~part, allStreams);
+      if (!result.streams.empty()) {
+        cancelBacking(result.streams);
+        combinations.push_back({ part, false, 0, result.streams });
+      }
+    }
+    combinations.push_back({ SampleSpaces::Backing, false, 0, { SampleSpaces::Backing } });
+  } else if (splitParts) {
+    // Without a backing-only stream the parts can't be isolated, so a mix
+    // is solved for each combination of muted parts instead. Muting
+    // everything would leave only the backing, which there's no stream for.
+    for (uint64_t mutedParts = 0; mutedParts < 0xF0000; mutedParts += 0x10000) {
+      ScoreResult result = scoreCombination(mutedParts, allStreams);
+      if (!result.streams.empty()) {
+        combinations.push_back({ 0, true, mutedParts, result.streams });
+      }
+    }
+  } else {
+    ScoreResult result = scoreCombination(mute & 0xF0000, allStreams);
+    if (!result.streams.empty()) {
+      if ((mute & SampleSpaces::Backing) && hasBacking) {
+        cancelBacking(result.streams);
+      }
+      combinations.push_back({ 0xF0000 & ~mute, false, 0, result.streams });
+    }
   }
-  for (uint64_t sampleID : result.streams) {
-    sampleID &= ~SampleSpaces::Invert;
-    BmpCodec codec(context());
-    for (const auto& ifs : files) {
-      auto iter = ifs->files.find(streams.at(sampleID));
-      if (iter != ifs->files.end()) {
-        codec.decode(iter->second, sampleID);
-        break;
+
+  // Parts may share streams, so only scan and decode each one once
+  std::unordered_map<uint64_t, const std::vector<uint8_t>*> streamData;
+  for (const auto& combination : combinations) {
+    for (uint64_t sampleID : combination.streams) {
+      sampleID &= ~SampleSpaces::Invert;
+      if (streamData.count(sampleID)) {
+        continue;
+      }
+      for (const auto& ifs : files) {
+        auto iter = ifs->files.find(streams.at(sampleID));
+        if (iter != ifs->files.end()) {
+          streamData[sampleID] = &iter->second;
+          break;
+        }
       }
     }
   }
-  addTrack(new PhaseTrack(context(), result.streams));
+
+  // The tracks only need the phase offsets, so the full decodes run in the
+  // background and aren't waited for until the samples are needed. They
+  // aren't deferred to a decode scheduler, since playback would then wait
+  // for the whole stream before it could start.
+  for (const auto& iter : streamData) {
+    pendingStreams.emplace_back(new StreamDecode(*iter.second, iter.first, compressSamples, cancel));
+  }
+
+  std::unordered_map<uint64_t, PhaseTrack::StreamInfo> streamInfo;
+  for (const auto& iter : streamData) {
+    CancelToken::check(cancel);
+    streamInfo[iter.first] = PhaseTrack::scanStream(*iter.second);
+  }
+  for (const auto& combination : combinations) {
+    if (combination.isMix) {
+      phasedMixes[numTracks()] = combination.mutedParts;
+    }
+    addPartTrack(new PhaseTrack(combination.streams, streamInfo), combination.part);
+  }
+}
+
+void IFSSequence::waitForStreams()
+{
+  for (const auto& pending : pendingStreams) {
+    SampleData* sample;
+    CompressedSample* compressed = pending->finish(context(), sample);
+    if (compressed) {
+      compressedSamples[pending->streamID].reset(compressed);
+    }
+    if (sample) {
+      streamBytes += sample->numSamples() * sample->channels.size() * sizeof(int16_t);
+    }
+  }
+  pendingStreams.clear();
+}
+
+void IFSSequence::takeStreams()
+{
+  for (const auto& pending : pendingStreams) {
+    CompressedSample* stream = pending->stream();
+    if (stream) {
+      streamSamples[pending->streamID].reset(stream);
+    }
+  }
+  pendingStreams.clear();
+}
+
+void IFSSequence::setCompressedSamples(bool compress)
+{
+  compressSamples = compress;
+}
+
+bool IFSSequence::compressSample(uint64_t sampleID, const uint8_t* data, size_t size, int channels, double rate)
+{
+  if (!compressSamples || !size || !CompressedSample::canCompress(channels)) {
+    return false;
+  }
+  compressedSamples[sampleID].reset(new CompressedSample(data, size, channels, rate));
+  return true;
+}
+
+void IFSSequence::setDecodeScheduler(DecodeScheduler* scheduler)
+{
+  this->scheduler = scheduler;
+}
+
+void IFSSequence::setCancelToken(const CancelToken* cancel)
+{
+  this->cancel = cancel;
+}
+
+void IFSSequence::compressedMemory(uint64_t& compressedBytes, uint64_t& decodedBytes) const
+{
+  compressedBytes = 0;
+  decodedBytes = 0;
+  for (const auto* samples : { &compressedSamples, &streamSamples }) {
+    for (const auto& iter : *samples) {
+      compressedBytes += iter.second->compressedBytes();
+      decodedBytes += iter.second->decodedBytes();
+    }
+  }
+}
+
+uint64_t IFSSequence::decodedStreamBytes() const
+{
+  return streamBytes;
+}
+
+void IFSSequence::decompressSamples()
+{
+  waitForStreams();
+  // The synthesizer can only play decoded samples. Streams taken by an
+  // earlier context also stay compressed, since its mixers play them.
+  for (const auto* samples : { &compressedSamples, &streamSamples }) {
+    for (const auto& iter : *samples) {
+      if (samples == &streamSamples && context()->getSample(iter.first)) {
+        continue;
+      }
+      const CompressedSample* compressed = iter.second.get();
+      SampleData* sample = new SampleData(context(), iter.first, compressed->sampleRate);
+      sample->channels.resize(compressed->channels);
+      for (auto& channel : sample->channels) {
+        channel.resize(compressed->numSamples());
+      }
+      CompressedSample::Cursor cursor = compressed->seek(0);
+      compressed->decode(cursor, sample->channels[0].data(), compressed->channels > 1 ? sample->channels[1].data() : nullptr, compressed->numSamples());
+    }
+  }
+  compressedSamples.clear();
 }
 
 SynthContext* IFSSequence::initContext()
 {
+  if (compressSamples) {
+    // Compressing a stream doesn't take long
+    waitForStreams();
+  }
+  if (!compressedSamples.empty()) {
+    // The mixer decodes compressed samples as it plays, and the context
+    // plays what it mixes a chunk at a time
+    ctx.reset(new SynthContext(context(), sampleRate));
+    {
+      // The mixer reads the mutes up front, so they can't change live
+      std::lock_guard<std::mutex> lock(queueMutex);
+      controlTrack.reset();
+    }
+    mixerTrack.reset(new MixerTrack(context(), initMixer()));
+    ctx->addChannel(mixerTrack.get());
+    return ctx.get();
+  }
+  takeStreams();
+  mixerTrack.reset();
   ctx.reset(new SynthContext(context(), sampleRate));
+  gatedTracks.clear();
+  streamMixers.clear();
+  streamTracks.clear();
+  double length = 0;
   for (int i = 0; i < numTracks(); i++) {
-    ctx->addChannel(getTrack(i));
+    length = std::max(length, getTrack(i)->length());
+    if (!streamSamples.empty() && dynamic_cast<PhaseTrack*>(getTrack(i))) {
+      // Streams that weren't decoded yet play from their compressed data
+      // through a mixer of their own, which decodes them a chunk at a time
+      KeysoundMixer* streamMixer = new KeysoundMixer(context(), sampleRate);
+      streamMixers.emplace_back(streamMixer);
+      for (const auto& iter : streamSamples) {
+        streamMixer->addCompressedSample(iter.first, iter.second.get());
+      }
+      streamMixer->addTrack(getTrack(i));
+      streamTracks.emplace_back(new MixerTrack(context(), streamMixer));
+      ctx->addChannel(streamTracks.back().get());
+    } else if (scheduler) {
+      gatedTracks.emplace_back(scheduler->gate(getTrack(i)));
+      ctx->addChannel(gatedTracks.back().get());
+    } else {
+      ctx->addChannel(getTrack(i));
+    }
   }
+  {
+    // The control channel comes after the tracks, so applyMutes() skips it
+    std::lock_guard<std::mutex> lock(queueMutex);
+    controlTrack.reset(liveChanges ? new ControlTrack(this, length) : nullptr);
+  }
+  if (controlTrack) {
+    ctx->addChannel(controlTrack.get());
+  }
+  applyMutes();
   return ctx.get();
 }
 
+KeysoundMixer* IFSSequence::initMixer()
+{
+  // The mixer reads the tracks up front, so mutes must be set before calling this.
+  // It decodes the streams as it plays them, with the same result as a full decode.
+  takeStreams();
+  mixer.reset(new KeysoundMixer(context(), sampleRate));
+  for (const auto* samples : { &compressedSamples, &streamSamples }) {
+    for (const auto& iter : *samples) {
+      mixer->addCompressedSample(iter.first, iter.second.get());
+    }
+  }
+  for (int i = 0; i < numTracks(); i++) {
+    if (isTrackActive(i)) {
+      auto gainIter = partGains.find(trackParts[i]);
+      mixer->addTrack(getTrack(i), gainIter == partGains.end() ? 1.0 : gainIter->second);
+    }
+  }
+  return mixer.get();
+}
+
+SynthContext* IFSSequence::initContext(uint64_t parts)
+{
+  // Each part gets its own context so that parts can be rendered
+  // independently. Tracks are not shared between parts.
+  decompressSamples();
+  SynthContext* partCtx = new SynthContext(context(), sampleRate);
+  partContexts[parts].reset(partCtx);
+  for (int i = 0; i < numTracks(); i++) {
+    if (trackParts[i] && !(trackParts[i] & ~parts)) {
+      partCtx->addChannel(getTrack(i));
+    }
+  }
+  return partCtx;
+}
+
 double IFSSequence::duration() const
 {
   double maxLength = 0;
@@ -360,10 +916,7 @@ double IFSSequence::duration() const
           }
         }
       } else if (extension == "bin" && filename.substr(0, 3) == "bgm") {
-        auto& data = iter.second;
-        int channels = data[16];
-        double sampleRate = parseIntBE<int32_t>(data.begin(), 20);
-        double len = (data.size() - 32) * (channels > 1 ? 1.0 : 2.0) / sampleRate;
+        double len = BmpCodec::duration(iter.second);
         if (len > maxLength) {
           maxLength = len;
         }
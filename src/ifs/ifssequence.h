@@ -4,10 +4,16 @@
 #include "seq/isequence.h"
 #include "codec/sampledata.h"
 #include "va3.h"
+#include "../keysoundmixer.h"
+#include "../compressedsample.h"
+#include <atomic>
+#include <mutex>
 #include <unordered_map>
 class IFS;
 class SampleData;
 class SynthContext;
+class DecodeScheduler;
+class CancelToken;
 
 namespace SampleSpaces {
   enum : uint64_t {
@@ -26,6 +32,7 @@ class IFSSequence : public BaseSequence<ITrack> {
 public:
   static uint64_t stringToSpaces(const std::string& channels);
   IFSSequence(ClefContext* ctx, bool usePreview = false);
+  ~IFSSequence();
 
   double sampleRate;
   std::unordered_map<uint64_t, VA3::Metadata> sampleData;
@@ -33,18 +40,105 @@ public:
   void addIFS(IFS* ifs);
   void load();
   double duration() const;
+  // After initContext(), mute and gain changes update the context's
+  // channels, so they must be made from the thread that renders it,
+  // between calls to fillBuffer().
   void setMutes(const std::string& channels);
   void setSolo(const std::string& channels);
+  void setSplitParts(bool split);
+  void setPartGain(uint64_t parts, double gain);
+
+  // Lets another thread change mutes and gains during playback.
+  // initContext() then adds a channel that applies queued changes on the
+  // rendering thread between buffers, within about 50 ms of playback.
+  // Split parts should also be on, so that every part is loaded.
+  void setLiveChanges(bool live);
+  // May be called from any thread. Return false if the context doesn't
+  // apply live changes.
+  bool queueMutes(const std::string& channels);
+  bool queueSolo(const std::string& channels);
+  bool queuePartGain(uint64_t parts, double gain);
+
+  // Keeps ADPCM samples compressed in memory when loading. initContext()
+  // then plays every active track through the keysound mixer, so mutes and
+  // part gains must be set before calling it. The mixer can't wait for
+  // deferred samples, so don't attach a decode scheduler as well.
+  // initContext(parts) decodes the compressed samples first.
+  void setCompressedSamples(bool compress);
+  void compressedMemory(uint64_t& compressedBytes, uint64_t& decodedBytes) const;
+  // The PCM of the phased streams that waitForStreams() has decoded
+  uint64_t decodedStreamBytes() const;
+
+  // Defers sample decoding to the scheduler. initContext() then plays the
+  // tracks through it so that playback waits for samples that aren't ready.
+  void setDecodeScheduler(DecodeScheduler* scheduler);
+
+  // load() throws CancelledException soon after the token is cancelled.
+  void setCancelToken(const CancelToken* cancel);
+
+  // Phased backing streams are still decoding in the background when
+  // load() returns. initContext() and initMixer() don't wait for them:
+  // they stop the decodes and play the streams from their compressed data
+  // through the keysound mixer instead. Call this first for a context
+  // that plays decoded streams, and before anything else that reads the
+  // context's samples.
+  void waitForStreams();
+
+  // Returns the unmuted parts that have at least one track, in SampleSpaces order.
+  std::vector<uint64_t> parts() const;
 
   SynthContext* initContext();
+  SynthContext* initContext(uint64_t parts);
+  KeysoundMixer* initMixer();
+  bool isTrackActive(int index) const;
 
 private:
+  class StreamDecode;
+  class ControlTrack;
+
   void usePhasedStreams(const std::unordered_map<uint64_t, std::string>& streams);
+  void addPartTrack(ITrack* track, uint64_t part);
+  void applyMutes();
+  void applyQueuedChanges();
+  bool compressSample(uint64_t sampleID, const uint8_t* data, size_t size, int channels, double rate);
+  void decompressSamples();
+  void takeStreams();
 
   uint64_t mute;
   bool usePreview;
+  bool splitParts;
+  bool compressSamples;
+  DecodeScheduler* scheduler;
+  const CancelToken* cancel;
+  std::vector<std::unique_ptr<ITrack>> gatedTracks;
+  std::unordered_map<uint64_t, std::unique_ptr<CompressedSample>> compressedSamples;
+  // Phased streams taken before they finished decoding
+  std::unordered_map<uint64_t, std::unique_ptr<CompressedSample>> streamSamples;
   std::vector<std::unique_ptr<IFS>> files;
+  // Destroyed first, since the decodes read from the files
+  std::vector<std::unique_ptr<StreamDecode>> pendingStreams;
+  uint64_t streamBytes;
+  std::vector<uint64_t> trackParts;
+  std::unordered_map<uint64_t, double> partGains;
+  // Phased tracks that mix several parts, and the parts muted when each
+  // was solved
+  std::unordered_map<int, uint64_t> phasedMixes;
+  // Whether the phased parts and backing have tracks of their own
+  bool separatedPhases;
+  std::unique_ptr<KeysoundMixer> mixer;
+  std::unique_ptr<MixerTrack> mixerTrack;
+  std::vector<std::unique_ptr<KeysoundMixer>> streamMixers;
+  std::vector<std::unique_ptr<MixerTrack>> streamTracks;
+  bool liveChanges;
+  std::unique_ptr<ControlTrack> controlTrack;
+  // Guards the queued changes, which changesQueued announces
+  std::mutex queueMutex;
+  bool muteQueued;
+  uint64_t queuedMute;
+  std::unordered_map<uint64_t, double> queuedGains;
+  std::atomic<bool> changesQueued;
   std::unique_ptr<SynthContext> ctx;
+  std::unordered_map<uint64_t, std::unique_ptr<SynthContext>> partContexts;
 };
 
 #endif
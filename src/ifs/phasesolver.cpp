@@ -0,0 +1,152 @@
+#include "phasesolver.h"
+#include "ifssequence.h"
+#include "utility.h"
+#include <algorithm>
+
+namespace {
+// Finds the combination of streams (and their inverted variants) that best
+// isolates the unmuted channels.
+//
+// A stream adds one to the count of each channel it contains whether it is
+// inverted or not, so the channel counts at any point in the search depend
+// only on which streams have been used so far. That makes the set of used
+// streams a complete description of a subproblem, and each subproblem only
+// needs to be solved once.
+class PhaseSolver {
+public:
+  PhaseSolver(uint64_t mute, const std::vector<uint64_t>& candidates);
+
+  ScoreResult solve();
+
+private:
+  struct Memo {
+    bool solved;
+    bool terminal;
+    int choice;
+    uint32_t score;
+  };
+
+  const Memo& search(uint32_t used);
+
+  uint64_t mute;
+  int neededChannels;
+  std::vector<uint64_t> candidates;
+  std::vector<uint32_t> candidateBits;
+  std::vector<uint32_t> streamChannels;
+  std::vector<Memo> memo;
+};
+
+PhaseSolver::PhaseSolver(uint64_t mute, const std::vector<uint64_t>& candidates)
+: mute(mute), neededChannels(4 - countBits(mute)), candidates(candidates)
+{
+  // Both variants of a stream share a bit in the used set.
+  // There are at most 16 distinct streams (one per combination of channels).
+  std::vector<uint64_t> streamIDs;
+  for (uint64_t streamID : candidates) {
+    streamID &= ~SampleSpaces::Invert;
+    auto iter = std::find(streamIDs.begin(), streamIDs.end(), streamID);
+    if (iter == streamIDs.end()) {
+      candidateBits.push_back(1 << streamIDs.size());
+      streamIDs.push_back(streamID);
+      // Spread the channel bits out to one byte per channel
+      uint32_t v = (streamID >> 16) & 0xF;
+      uint32_t channels = 0;
+      for (int i = 0; i < 4; i++) {
+        channels |= ((v >> i) & 0x01) << (i * 8);
+      }
+      streamChannels.push_back(channels);
+    } else {
+      candidateBits.push_back(1 << (iter - streamIDs.begin()));
+    }
+  }
+  memo.resize(1 << streamIDs.size(), Memo{ false, false, -1, 0 });
+}
+
+const PhaseSolver::Memo& PhaseSolver::search(uint32_t used)
+{
+  if (memo[used].solved) {
+    return memo[used];
+  }
+  uint32_t base = 0;
+  for (int i = 0; i < streamChannels.size(); i++) {
+    if (used & (1 << i)) {
+      base += streamChannels[i];
+    }
+  }
+  Memo best{ true, false, -1, 0 };
+  for (int c = 0; c < candidates.size(); c++) {
+    uint64_t streamID = candidates[c];
+    if ((used & candidateBits[c]) || (streamID & mute)) {
+      continue;
+    }
+    bool invert = streamID & SampleSpaces::Invert;
+    uint32_t v = (streamID >> 16) & 0xF;
+    uint32_t score = 0;
+    int goodChannels = 0;
+    bool reject = false;
+    for (int i = 0; i < 4; i++) {
+      uint8_t chanScore = (v >> i) & 0x01;
+      uint8_t baseScore = (base >> (i * 8)) & 0xFF;
+      if (chanScore && invert == !(baseScore & 1)) {
+        // Don't subtract a channel that isn't already there
+        reject = true;
+        break;
+      }
+      chanScore += baseScore;
+      if (chanScore == 1) {
+        // If a channel gets represented once, that's best
+        score += 10;
+        goodChannels++;
+      } else if (chanScore & 1) {
+        // If a channel gets represented an odd number of times, that's acceptable,
+        // but 3 is better than 5 or higher
+        score += (chanScore == 3 ? 7 : 6);
+        goodChannels++;
+      }
+    }
+    if (reject) {
+      continue;
+    }
+    if (goodChannels < neededChannels) {
+      // Some channels are missing, add another stream
+      uint32_t subScore = search(used | candidateBits[c]).score;
+      if (subScore > best.score) {
+        best.score = subScore;
+        best.choice = c;
+        best.terminal = false;
+      }
+    } else if (score > best.score) {
+      best.score = score;
+      best.choice = c;
+      best.terminal = true;
+    }
+  }
+  memo[used] = best;
+  return memo[used];
+}
+
+ScoreResult PhaseSolver::solve()
+{
+  ScoreResult result{ search(0).score, {} };
+  if (!result.score) {
+    return result;
+  }
+  uint32_t used = 0;
+  while (true) {
+    const Memo& step = memo[used];
+    result.streams.push_back(candidates[step.choice]);
+    if (step.terminal) {
+      break;
+    }
+    used |= candidateBits[step.choice];
+  }
+  // Report the streams in the order the recursive search produced them
+  std::reverse(result.streams.begin(), result.streams.end());
+  return result;
+}
+}
+
+ScoreResult scoreCombination(uint64_t mute, const std::vector<uint64_t>& candidates)
+{
+  return PhaseSolver(mute, candidates).solve();
+}
@@ -0,0 +1,18 @@
+#ifndef GD2W_PHASESOLVER_H
+#define GD2W_PHASESOLVER_H
+
+#include <cstdint>
+#include <vector>
+
+struct ScoreResult {
+  uint32_t score;
+  std::vector<uint64_t> streams;
+};
+
+// Picks the phased bgm streams to play so that each part that isn't muted
+// is heard an odd number of times, ideally once. The candidates are stream
+// IDs in SampleSpaces, each also given with the Invert flag to allow
+// subtracting it. Returns a score of 0 and no streams if nothing works.
+ScoreResult scoreCombination(uint64_t mute, const std::vector<uint64_t>& candidates);
+
+#endif
@@ -1,36 +1,62 @@
 #include "phasetrack.h"
 #include "ifssequence.h"
+#include "../bmpcodec.h"
 #include "clefcontext.h"
+#include "utility.h"
 
-PhaseTrack::PhaseTrack(ClefContext* ctx, const std::vector<uint64_t>& streamIDs)
+// The phase marker is the first falling edge after a sample above 128.
+static int findPhaseEdge(SampleData* sample)
+{
+  int prevSample = 0;
+  for (int i = 0; i < sample->numSamples(); i++) {
+    int s = sample->channels[0][i];
+    if (s < prevSample && prevSample > 128) {
+      return i;
+    }
+    prevSample = s;
+  }
+  return -1;
+}
+
+PhaseTrack::StreamInfo PhaseTrack::scanStream(const std::vector<uint8_t>& data)
+{
+  StreamInfo info{ 0, BmpCodec::duration(data), double(parseIntBE<int32_t>(data, 20)) };
+  // The marker is normally within the first few hundred milliseconds.
+  // Widen the window if it isn't found, up to the whole stream.
+  ClefContext scratch;
+  BmpCodec codec(&scratch);
+  for (double window = 0.5; ; window *= 4) {
+    SampleData* sample = codec.decodePrefix(data, window);
+    if (!sample) {
+      break;
+    }
+    int edge = findPhaseEdge(sample);
+    if (edge >= 0) {
+      info.offset = edge / sample->sampleRate;
+      break;
+    } else if (window >= info.duration) {
+      break;
+    }
+  }
+  return info;
+}
+
+PhaseTrack::PhaseTrack(const std::vector<uint64_t>& streamIDs, const std::unordered_map<uint64_t, StreamInfo>& streams)
 {
-  std::vector<SampleEvent*> events;
   double maxOffset = 0;
-  for (uint64_t streamID : streamIDs) {
-    SampleData* sample = ctx->getSample(streamID & ~SampleSpaces::Invert);
-    sampleRate = sample->sampleRate;
-    int offset = 0, prevSample = 0;
-    for (int i = 0; i < sample->numSamples(); i++) {
-      int s = sample->channels[0][i];
-      if (s < prevSample && prevSample > 128) {
-        offset = i;
-        break;
-      }
-      prevSample = s;
+  for (const auto& iter : streams) {
+    if (iter.second.offset > maxOffset) {
+      maxOffset = iter.second.offset;
     }
+  }
+  for (uint64_t streamID : streamIDs) {
+    const StreamInfo& info = streams.at(streamID & ~SampleSpaces::Invert);
+    sampleRate = info.sampleRate;
     SampleEvent* event = new SampleEvent;
-    event->sampleID = sample->sampleID;
-    event->timestamp = -offset / sample->sampleRate;
-    event->duration = sample->duration();
+    event->sampleID = streamID & ~SampleSpaces::Invert;
+    event->timestamp = maxOffset - info.offset;
+    event->duration = info.duration;
     event->volume = (streamID & SampleSpaces::Invert) ? -1 : 1;
-    if (event->timestamp < maxOffset) {
-      maxOffset = event->timestamp;
-    }
-    events.push_back(event);
-  }
-  for (SampleEvent* event : events) {
-    event->timestamp += -maxOffset;
     addEvent(event);
   }
 }
-
@@ -3,11 +3,21 @@
 
 #include "seq/itrack.h"
 #include <vector>
-class ClefContext;
+#include <unordered_map>
 
 class PhaseTrack : public BasicTrack {
 public:
-  PhaseTrack(ClefContext* ctx, const std::vector<uint64_t>& streamIDs);
+  struct StreamInfo {
+    double offset;
+    double duration;
+    double sampleRate;
+  };
+
+  // Finds the phase offset of a bgm stream by decoding as little of it as possible
+  static StreamInfo scanStream(const std::vector<uint8_t>& data);
+
+  // Offsets are aligned across every stream in the map, not just the ones used by this track
+  PhaseTrack(const std::vector<uint64_t>& streamIDs, const std::unordered_map<uint64_t, StreamInfo>& streams);
 
   double sampleRate;
 };
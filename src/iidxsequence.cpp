@@ -1,16 +1,20 @@
 #include "iidxsequence.h"
 #include "clefcontext.h"
+#include "samplestore.h"
 #include "codec/sampledata.h"
 #include "codec/riffcodec.h"
 #include "utility.h"
 #include "bankloaders.h"
+#include "bytesource.h"
+#include "decodescheduler.h"
+#include "canceltoken.h"
 #include <stdexcept>
 #include <sstream>
 #include <fstream>
 #include <iostream>
 
 IIDXSequence::IIDXSequence(ClefContext* ctx, const std::string& path)
-: BaseSequence(ctx)
+: BaseSequence(ctx), samplesLoaded(false), wmaDownsample(1), scheduler(nullptr), cancel(nullptr)
 {
   int dotPos = path.rfind('.');
   if (dotPos == std::string::npos) {
@@ -18,8 +22,11 @@ IIDXSequence::IIDXSequence(ClefContext* ctx, const std::string& path)
   }
   basePath = path.substr(0, dotPos + 1);
 
-  auto seqFile = ctx->openFile(basePath + "1");
-  addTrack(new OneTrack(*seqFile.get()));
+  std::unique_ptr<ByteSource> seqFile(ByteSource::open(ctx, basePath + "1"));
+  if (!seqFile) {
+    throw std::runtime_error("Unable to open " + basePath + "1");
+  }
+  addTrack(new OneTrack(*seqFile));
 }
 
 double IIDXSequence::duration() const
@@ -27,16 +34,46 @@ double IIDXSequence::duration() const
   return tracks.at(0)->length();
 }
 
+void IIDXSequence::loadSamples()
+{
+  // Samples stay loaded so a later initContext() or initMixer() can reuse them
+  if (samplesLoaded) {
+    return;
+  }
+  bool hasSamples = loadS3P() || load2DX();
+  if (!hasSamples) {
+    throw std::runtime_error("No sample data found");
+  }
+  samplesLoaded = true;
+}
+
+void IIDXSequence::setDecodeScheduler(DecodeScheduler* scheduler)
+{
+  this->scheduler = scheduler;
+}
+
+void IIDXSequence::setCancelToken(const CancelToken* cancel)
+{
+  this->cancel = cancel;
+}
+
+void IIDXSequence::setWmaDownsample(int factor)
+{
+  wmaDownsample = factor;
+}
+
 SynthContext* IIDXSequence::initContext()
 {
   int sampleRate = 44100;
   try {
     synth.reset(new SynthContext(context(), sampleRate));
-    bool hasSamples = loadS3P() || load2DX();
-    if (!hasSamples) {
-      throw std::runtime_error("No sample data found");
+    loadSamples();
+    if (scheduler) {
+      gatedTrack.reset(scheduler->gate(getTrack(0)));
+      synth->addChannel(gatedTrack.get());
+    } else {
+      synth->addChannel(getTrack(0));
     }
-    synth->addChannel(getTrack(0));
     return synth.get();
   } catch (...) {
     synth.reset(nullptr);
@@ -44,13 +81,29 @@ SynthContext* IIDXSequence::initContext()
   }
 }
 
+KeysoundMixer* IIDXSequence::initMixer()
+{
+  loadSamples();
+  mixer.reset(new KeysoundMixer(context(), 44100));
+  mixer->addTrack(getTrack(0));
+  return mixer.get();
+}
+
 bool IIDXSequence::loadS3P()
 {
+  if (SampleStore* store = SampleStore::get()) {
+    store->release(context());
+  }
   context()->purgeSamples();
+  if (scheduler) {
+    scheduler->clear();
+  }
   try {
     std::cerr << "Reading " << basePath << "s3p..." << std::endl;
-    auto file = context()->openFile(basePath + "s3p");
-    return ::loadS3P(context(), file.get());
+    std::unique_ptr<ByteSource> file(ByteSource::open(context(), basePath + "s3p"));
+    return file && ::loadS3P(context(), file.get(), 0, cancel, wmaDownsample);
+  } catch (CancelledException&) {
+    throw;
   } catch (...) {
     // In case of any errors (including file not found) return failure
     return false;
@@ -59,11 +112,19 @@ bool IIDXSequence::loadS3P()
 
 bool IIDXSequence::load2DX()
 {
+  if (SampleStore* store = SampleStore::get()) {
+    store->release(context());
+  }
   context()->purgeSamples();
+  if (scheduler) {
+    scheduler->clear();
+  }
   try {
     std::cerr << "Reading " << basePath << "2dx..." << std::endl;
-    auto file = context()->openFile(basePath + "2dx");
-    return ::load2DX(context(), file.get());
+    std::unique_ptr<ByteSource> file(ByteSource::open(context(), basePath + "2dx"));
+    return file && ::load2DX(context(), file.get(), 0, 0, cancel);
+  } catch (CancelledException&) {
+    throw;
   } catch (std::exception& e) {
     // In case of any errors (including file not found) return failure
     std::cerr << e.what() << std::endl;
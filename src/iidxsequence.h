@@ -5,7 +5,10 @@
 #include "synth/synthcontext.h"
 #include "plugin/baseplugin.h"
 #include "onetrack.h"
+#include "keysoundmixer.h"
 class ClefContext;
+class DecodeScheduler;
+class CancelToken;
 
 class IIDXSequence : public BaseSequence<OneTrack> {
 public:
@@ -15,13 +18,31 @@ public:
 
   double duration() const;
 
+  // Defers sample decoding to the scheduler, which must be attached to the
+  // context. initContext() then plays the chart through it.
+  void setDecodeScheduler(DecodeScheduler* scheduler);
+  // Loading samples throws CancelledException soon after the token is cancelled.
+  void setCancelToken(const CancelToken* cancel);
+  // Decodes WMA keysounds at 1/2 or 1/4 of their sample rate, which is
+  // faster but drops the upper part of the spectrum. Only valid before the
+  // samples are loaded.
+  void setWmaDownsample(int factor);
+
   SynthContext* initContext();
+  KeysoundMixer* initMixer();
 
 private:
+  void loadSamples();
   bool loadS3P();
   bool load2DX();
 
+  bool samplesLoaded;
+  int wmaDownsample;
+  DecodeScheduler* scheduler;
+  const CancelToken* cancel;
+  std::unique_ptr<ITrack> gatedTrack;
   std::unique_ptr<SynthContext> synth;
+  std::unique_ptr<KeysoundMixer> mixer;
 };
 
 #endif
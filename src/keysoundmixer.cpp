@@ -0,0 +1,416 @@
+#include "keysoundmixer.h"
+#include "clefcontext.h"
+#include "codec/sampledata.h"
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <limits>
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define KSM_SSE2
+#include <emmintrin.h>
+#endif
+
+// Killed voices fade out over this many seconds to avoid clicks.
+static const double releaseTime = 0.005;
+
+static const int64_t noStop = std::numeric_limits<int64_t>::max();
+
+// Mixed chunks get IDs far above any that the loaders assign, with room for
+// every chunk of each track.
+static const uint64_t mixedSpace = 1ULL << 61;
+static std::atomic<uint64_t> nextMixerTrack(0);
+
+// A MixerTrack renders a second at a time and keeps a few chunks
+// registered, so a chunk is never replaced while it's still playing.
+static const double chunkSeconds = 1.0;
+static const uint64_t chunksKept = 4;
+
+static void mixDirect(const int16_t* src, float gain, float* out, size_t n)
+{
+  size_t i = 0;
+#ifdef KSM_SSE2
+  __m128 vGain = _mm_set1_ps(gain);
+  for (; i + 8 <= n; i += 8) {
+    __m128i s = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + i));
+    // Sign-extend the int16 samples to int32 and convert to float
+    __m128 lo = _mm_cvtepi32_ps(_mm_srai_epi32(_mm_unpacklo_epi16(s, s), 16));
+    __m128 hi = _mm_cvtepi32_ps(_mm_srai_epi32(_mm_unpackhi_epi16(s, s), 16));
+    _mm_storeu_ps(out + i, _mm_add_ps(_mm_loadu_ps(out + i), _mm_mul_ps(lo, vGain)));
+    _mm_storeu_ps(out + i + 4, _mm_add_ps(_mm_loadu_ps(out + i + 4), _mm_mul_ps(hi, vGain)));
+  }
+#endif
+  for (; i < n; i++) {
+    out[i] += src[i] * gain;
+  }
+}
+
+// src holds frames [base, length) of the sample
+static void mixResampled(const int16_t* src, size_t base, size_t length, double pos, double step, float gain, float* out, size_t n)
+{
+  size_t i = 0;
+#ifdef KSM_SSE2
+  __m128 vGain = _mm_set1_ps(gain);
+  alignas(16) float a[4], b[4], f[4];
+  for (; i + 4 <= n; i += 4) {
+    for (int k = 0; k < 4; k++) {
+      double p = pos + (i + k) * step;
+      size_t index = size_t(p);
+      f[k] = float(p - index);
+      a[k] = src[index - base];
+      b[k] = index + 1 < length ? src[index + 1 - base] : src[index - base];
+    }
+    __m128 va = _mm_load_ps(a);
+    __m128 v = _mm_add_ps(va, _mm_mul_ps(_mm_sub_ps(_mm_load_ps(b), va), _mm_load_ps(f)));
+    _mm_storeu_ps(out + i, _mm_add_ps(_mm_loadu_ps(out + i), _mm_mul_ps(v, vGain)));
+  }
+#endif
+  for (; i < n; i++) {
+    double p = pos + i * step;
+    size_t index = size_t(p);
+    float frac = float(p - index);
+    float s0 = src[index - base];
+    float s1 = index + 1 < length ? src[index + 1 - base] : s0;
+    out[i] += (s0 + (s1 - s0) * frac) * gain;
+  }
+}
+
+KeysoundMixer::KeysoundMixer(ClefContext* ctx, double sampleRate)
+: sampleRate(sampleRate), ctx(ctx), nextTrigger(0), sorted(true), frame(0), endTime(0)
+{
+  // initializers only
+}
+
+void KeysoundMixer::addCompressedSample(uint64_t sampleID, const CompressedSample* sample)
+{
+  compressedSamples[sampleID] = sample;
+}
+
+void KeysoundMixer::addTrack(ITrack* track, double gain)
+{
+  track->reset();
+  while (!track->isFinished()) {
+    std::shared_ptr<SequenceEvent> event = track->nextEvent();
+    if (!event) {
+      break;
+    }
+    int64_t eventFrame = std::llround(event->timestamp * sampleRate);
+    if (SampleEvent* sampleEvent = dynamic_cast<SampleEvent*>(event.get())) {
+      // pan: 0.0 = left, 0.5 = center, 1.0 = right
+      double pan = std::max(0.0, std::min(1.0, sampleEvent->pan));
+      Trigger trigger;
+      trigger.frame = eventFrame;
+      trigger.kill = false;
+      trigger.sampleID = sampleEvent->sampleID;
+      trigger.playbackID = sampleEvent->playbackID;
+      trigger.gainL = gain * sampleEvent->volume * std::min(1.0, 2.0 * (1.0 - pan));
+      trigger.gainR = gain * sampleEvent->volume * std::min(1.0, 2.0 * pan);
+      trigger.stopFrame = sampleEvent->duration > 0 ? eventFrame + std::llround(sampleEvent->duration * sampleRate) : noStop;
+      triggers.push_back(trigger);
+
+      double end = sampleEvent->timestamp + sampleEvent->duration;
+      if (sampleEvent->duration <= 0) {
+        auto compressed = compressedSamples.find(sampleEvent->sampleID);
+        if (compressed != compressedSamples.end()) {
+          end = sampleEvent->timestamp + compressed->second->duration();
+        } else {
+          SampleData* sample = ctx->getSample(sampleEvent->sampleID);
+          end = sampleEvent->timestamp + (sample ? sample->duration() : 0);
+        }
+      }
+      endTime = std::max(endTime, end);
+    } else if (KillEvent* kill = dynamic_cast<KillEvent*>(event.get())) {
+      triggers.push_back(Trigger{ eventFrame, true, 0, kill->playbackID, 0, 0, noStop });
+    }
+  }
+  track->reset();
+  sorted = false;
+}
+
+void KeysoundMixer::rewind()
+{
+  voices.clear();
+  nextTrigger = 0;
+  sorted = false;
+  frame = 0;
+}
+
+double KeysoundMixer::currentTime() const
+{
+  return frame / sampleRate;
+}
+
+double KeysoundMixer::maximumTime() const
+{
+  return endTime;
+}
+
+void KeysoundMixer::startVoice(const Trigger& trigger)
+{
+  Voice voice;
+  voice.gainL = trigger.gainL;
+  voice.gainR = trigger.gainR;
+  voice.playbackID = trigger.playbackID;
+  voice.stopFrame = trigger.stopFrame;
+  voice.releaseFrame = noStop;
+  voice.pos = 0;
+  voice.compressed = nullptr;
+
+  auto compressed = compressedSamples.find(trigger.sampleID);
+  if (compressed != compressedSamples.end()) {
+    const CompressedSample* sample = compressed->second;
+    if (!sample || !sample->numSamples()) {
+      return;
+    }
+    voice.left = voice.right = nullptr;
+    voice.length = sample->numSamples();
+    voice.step = sample->sampleRate / sampleRate;
+    voice.compressed = sample;
+    voice.cursor = sample->seek(0);
+    voice.windowStart = 0;
+    voices.push_back(std::move(voice));
+    return;
+  }
+
+  auto iter = samples.find(trigger.sampleID);
+  SampleData* sample;
+  if (iter == samples.end()) {
+    sample = ctx->getSample(trigger.sampleID);
+    samples[trigger.sampleID] = sample;
+  } else {
+    sample = iter->second;
+  }
+  if (!sample || sample->channels.empty() || !sample->numSamples()) {
+    return;
+  }
+  voice.left = sample->channels[0].data();
+  voice.right = sample->channels.size() > 1 ? sample->channels[1].data() : voice.left;
+  voice.length = sample->numSamples();
+  voice.step = sample->sampleRate / sampleRate;
+  voices.push_back(std::move(voice));
+}
+
+void KeysoundMixer::fillWindow(Voice& voice, size_t frames)
+{
+  // The window must cover every frame read while mixing, including the
+  // neighbor used for interpolation.
+  size_t first = size_t(voice.pos);
+  size_t last = std::min(voice.length - 1, size_t(voice.pos + (frames - 1) * voice.step) + 1);
+  size_t windowEnd = voice.windowStart + voice.windowL.size();
+  if (first >= windowEnd) {
+    voice.windowL.clear();
+    voice.windowR.clear();
+    voice.compressed->decode(voice.cursor, nullptr, nullptr, first - windowEnd);
+    voice.windowStart = first;
+  } else if (first > voice.windowStart) {
+    size_t drop = first - voice.windowStart;
+    voice.windowL.erase(voice.windowL.begin(), voice.windowL.begin() + drop);
+    if (!voice.windowR.empty()) {
+      voice.windowR.erase(voice.windowR.begin(), voice.windowR.begin() + drop);
+    }
+    voice.windowStart = first;
+  }
+  size_t have = voice.windowL.size();
+  size_t need = last + 1 - voice.windowStart;
+  if (need > have) {
+    voice.windowL.resize(need);
+    if (voice.compressed->channels > 1) {
+      voice.windowR.resize(need);
+    }
+    voice.compressed->decode(voice.cursor, voice.windowL.data() + have,
+        voice.windowR.empty() ? nullptr : voice.windowR.data() + have, need - have);
+  }
+}
+
+bool KeysoundMixer::mixVoice(Voice& voice, size_t offset, size_t frames)
+{
+  int64_t stop = std::min(voice.stopFrame, voice.releaseFrame);
+  if (stop <= frame) {
+    return false;
+  }
+  size_t n = std::min<int64_t>(frames, stop - frame);
+  size_t remaining = std::ceil((voice.length - voice.pos) / voice.step);
+  if (remaining < n) {
+    n = remaining;
+  }
+  // Sample data starts at frame base, which is nonzero for compressed voices
+  const int16_t* left = voice.left;
+  const int16_t* right = voice.right;
+  size_t base = 0;
+  size_t length = voice.length;
+  if (voice.compressed && n > 0) {
+    fillWindow(voice, n);
+    left = voice.windowL.data();
+    right = voice.windowR.empty() ? left : voice.windowR.data();
+    base = voice.windowStart;
+    length = base + voice.windowL.size();
+  }
+  if (voice.releaseFrame != noStop) {
+    // Fading out after a kill: ramp the gain down one frame at a time
+    int64_t releaseFrames = std::max<int64_t>(1, std::llround(releaseTime * sampleRate));
+    for (size_t i = 0; i < n; i++) {
+      double p = voice.pos + i * voice.step;
+      size_t index = size_t(p) - base;
+      float fade = float(voice.releaseFrame - (frame + int64_t(i))) / releaseFrames;
+      mixL[offset + i] += left[index] * voice.gainL * fade;
+      mixR[offset + i] += right[index] * voice.gainR * fade;
+    }
+  } else if (voice.step == 1.0 && voice.pos == std::floor(voice.pos)) {
+    size_t index = size_t(voice.pos) - base;
+    mixDirect(left + index, voice.gainL, mixL.data() + offset, n);
+    mixDirect(right + index, voice.gainR, mixR.data() + offset, n);
+  } else {
+    mixResampled(left, base, length, voice.pos, voice.step, voice.gainL, mixL.data() + offset, n);
+    mixResampled(right, base, length, voice.pos, voice.step, voice.gainR, mixR.data() + offset, n);
+  }
+  voice.pos += n * voice.step;
+  return n == frames && voice.pos < voice.length;
+}
+
+size_t KeysoundMixer::mix(size_t frames)
+{
+  if (!sorted) {
+    std::stable_sort(triggers.begin() + nextTrigger, triggers.end(), [](const Trigger& a, const Trigger& b) { return a.frame < b.frame; });
+    sorted = true;
+  }
+  if (nextTrigger >= triggers.size() && voices.empty()) {
+    return 0;
+  }
+  mixL.assign(frames, 0);
+  mixR.assign(frames, 0);
+  size_t done = 0;
+  while (done < frames) {
+    // Start and stop voices at the current frame, then mix up to the next trigger
+    while (nextTrigger < triggers.size() && triggers[nextTrigger].frame <= frame) {
+      const Trigger& trigger = triggers[nextTrigger++];
+      if (!trigger.kill) {
+        startVoice(trigger);
+        continue;
+      }
+      int64_t releaseFrames = std::max<int64_t>(1, std::llround(releaseTime * sampleRate));
+      for (Voice& voice : voices) {
+        if (voice.playbackID == trigger.playbackID && voice.releaseFrame == noStop) {
+          voice.releaseFrame = frame + releaseFrames;
+        }
+      }
+    }
+    size_t chunk = frames - done;
+    if (nextTrigger < triggers.size()) {
+      chunk = std::min<int64_t>(chunk, triggers[nextTrigger].frame - frame);
+    }
+    for (int i = voices.size() - 1; i >= 0; --i) {
+      if (!mixVoice(voices[i], done, chunk)) {
+        // Swap-remove keeps the voice table flat
+        voices[i] = std::move(voices.back());
+        voices.pop_back();
+      }
+    }
+    done += chunk;
+    frame += chunk;
+    if (voices.empty() && nextTrigger >= triggers.size()) {
+      break;
+    }
+  }
+  return done;
+}
+
+size_t KeysoundMixer::fillBuffer(int16_t* buffer, size_t frames)
+{
+  size_t n = mix(frames);
+  size_t i = 0;
+#ifdef KSM_SSE2
+  __m128 maxSample = _mm_set1_ps(32767.0f);
+  __m128 minSample = _mm_set1_ps(-32768.0f);
+  for (; i + 4 <= n; i += 4) {
+    // Clamp, round, and interleave
+    __m128i l = _mm_cvtps_epi32(_mm_max_ps(minSample, _mm_min_ps(maxSample, _mm_loadu_ps(mixL.data() + i))));
+    __m128i r = _mm_cvtps_epi32(_mm_max_ps(minSample, _mm_min_ps(maxSample, _mm_loadu_ps(mixR.data() + i))));
+    __m128i l16 = _mm_packs_epi32(l, l);
+    __m128i r16 = _mm_packs_epi32(r, r);
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(buffer + i * 2), _mm_unpacklo_epi16(l16, r16));
+  }
+#endif
+  for (; i < n; i++) {
+    buffer[i * 2] = std::max(-32768.0f, std::min(32767.0f, std::nearbyint(mixL[i])));
+    buffer[i * 2 + 1] = std::max(-32768.0f, std::min(32767.0f, std::nearbyint(mixR[i])));
+  }
+  return n;
+}
+
+size_t KeysoundMixer::fillBuffer(float* buffer, size_t frames)
+{
+  size_t n = mix(frames);
+  for (size_t i = 0; i < n; i++) {
+    buffer[i * 2] = mixL[i] / 32768.0f;
+    buffer[i * 2 + 1] = mixR[i] / 32768.0f;
+  }
+  return n;
+}
+
+MixerTrack::MixerTrack(ClefContext* ctx, KeysoundMixer* mixer)
+: ctx(ctx), mixer(mixer), firstSampleID(mixedSpace | (nextMixerTrack++ * chunksKept)), chunk(0), finished(false)
+{
+  buffer.resize(size_t(chunkSeconds * mixer->sampleRate) * 2);
+}
+
+MixerTrack::~MixerTrack()
+{
+  // The chunks stay registered with the context, but with no PCM
+  for (uint64_t i = 0; i < chunksKept; i++) {
+    SampleData* sample = ctx->getSample(firstSampleID + i);
+    if (sample) {
+      std::vector<std::vector<int16_t>>().swap(sample->channels);
+    }
+  }
+}
+
+bool MixerTrack::isFinished() const
+{
+  return finished;
+}
+
+double MixerTrack::length() const
+{
+  return mixer->maximumTime();
+}
+
+std::shared_ptr<SequenceEvent> MixerTrack::readNextEvent()
+{
+  size_t chunkFrames = buffer.size() / 2;
+  size_t frames = finished ? 0 : mixer->fillBuffer(buffer.data(), chunkFrames);
+  if (frames < chunkFrames) {
+    finished = true;
+  }
+  if (!frames) {
+    return nullptr;
+  }
+
+  uint64_t sampleID = firstSampleID + chunk % chunksKept;
+  SampleData* sample = ctx->getSample(sampleID);
+  if (!sample) {
+    sample = new SampleData(ctx, sampleID, mixer->sampleRate);
+  }
+  sample->channels.resize(2);
+  for (int i = 0; i < 2; i++) {
+    std::vector<int16_t>& channel = sample->channels[i];
+    channel.resize(frames);
+    for (size_t j = 0; j < frames; j++) {
+      channel[j] = buffer[j * 2 + i];
+    }
+  }
+
+  SampleEvent* event = new SampleEvent;
+  event->sampleID = sampleID;
+  event->timestamp = chunk * chunkFrames / mixer->sampleRate;
+  event->duration = frames / mixer->sampleRate;
+  event->volume = 1.0;
+  event->pan = 0.5;
+  chunk++;
+  return std::shared_ptr<SequenceEvent>(event);
+}
+
+void MixerTrack::internalReset()
+{
+  mixer->rewind();
+  chunk = 0;
+  finished = false;
+}
@@ -0,0 +1,115 @@
+#ifndef B2W_KEYSOUNDMIXER_H
+#define B2W_KEYSOUNDMIXER_H
+
+#include "seq/itrack.h"
+#include "compressedsample.h"
+#include <cstdint>
+#include <memory>
+#include <vector>
+#include <unordered_map>
+class ClefContext;
+class SampleData;
+
+// A lightweight alternative to SynthContext for charts that consist only of
+// one-shot sample triggers with a volume, a pan, and an optional kill.
+// Voices are kept in a flat table with precomputed stereo gains, and
+// mixing uses SSE2 where available. Samples may also be supplied in
+// compressed form, in which case each voice decodes only the frames it is
+// about to mix.
+class KeysoundMixer {
+public:
+  KeysoundMixer(ClefContext* ctx, double sampleRate);
+
+  const double sampleRate;
+
+  // Plays the sample from compressed data instead of looking it up in the
+  // context. The sample must outlive the mixer. Add compressed samples
+  // before adding the tracks that use them.
+  void addCompressedSample(uint64_t sampleID, const CompressedSample* sample);
+
+  // Reads every event from the track and rewinds it afterward. The gain
+  // scales every voice the track starts.
+  void addTrack(ITrack* track, double gain = 1.0);
+
+  // Returns to the start of the song.
+  void rewind();
+
+  double currentTime() const;
+  double maximumTime() const;
+
+  // Fills an interleaved stereo buffer. Returns the number of frames written, or 0 at the end of the song.
+  size_t fillBuffer(int16_t* buffer, size_t frames);
+  size_t fillBuffer(float* buffer, size_t frames);
+
+private:
+  struct Trigger {
+    int64_t frame;
+    bool kill;
+    uint64_t sampleID;
+    uint64_t playbackID;
+    float gainL, gainR;
+    int64_t stopFrame;
+  };
+
+  struct Voice {
+    const int16_t* left;
+    const int16_t* right;
+    size_t length;
+    double pos;
+    double step;
+    float gainL, gainR;
+    uint64_t playbackID;
+    int64_t stopFrame;
+    int64_t releaseFrame;
+
+    // Compressed voices decode into a window that starts at windowStart
+    const CompressedSample* compressed;
+    CompressedSample::Cursor cursor;
+    std::vector<int16_t> windowL, windowR;
+    size_t windowStart;
+  };
+
+  size_t mix(size_t frames);
+  void startVoice(const Trigger& trigger);
+  void fillWindow(Voice& voice, size_t frames);
+  bool mixVoice(Voice& voice, size_t offset, size_t frames);
+
+  ClefContext* ctx;
+  std::vector<Trigger> triggers;
+  size_t nextTrigger;
+  bool sorted;
+  std::vector<Voice> voices;
+  std::unordered_map<uint64_t, SampleData*> samples;
+  std::unordered_map<uint64_t, const CompressedSample*> compressedSamples;
+  std::vector<float> mixL, mixR;
+  int64_t frame;
+  double endTime;
+};
+
+// Plays a mixer through a SynthContext, so that compressed samples can be
+// played by anything that expects one. Each event plays a short chunk that
+// the mixer renders when the context reads the event, and the chunks are
+// registered with the context under IDs of their own that are reused as
+// playback moves on, so only a few chunks of PCM exist at a time.
+class MixerTrack : public ITrack {
+public:
+  MixerTrack(ClefContext* ctx, KeysoundMixer* mixer);
+  ~MixerTrack();
+
+  virtual bool isFinished() const;
+  virtual double length() const;
+
+protected:
+  virtual std::shared_ptr<SequenceEvent> readNextEvent();
+  virtual void internalReset();
+
+private:
+  ClefContext* ctx;
+  KeysoundMixer* mixer;
+  uint64_t firstSampleID;
+  uint64_t chunk;
+  bool finished;
+  std::vector<int16_t> buffer;
+};
+
+#endif
@@ -0,0 +1,326 @@
+#include "libraryscanner.h"
+#include "batchrunner.h"
+#include "bankloaders.h"
+#include "bundle.h"
+#include "bytesource.h"
+#include "identify.h"
+#include "iidxsequence.h"
+#include "metadatacache.h"
+#include "clefcontext.h"
+#include "ifs/ifs.h"
+#include "ifs/ifssequence.h"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <iomanip>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <sstream>
+#include <stdexcept>
+#include <thread>
+
+static std::string csvField(const std::string& value)
+{
+  if (value.find_first_of(",\"\r\n") == std::string::npos) {
+    return value;
+  }
+  std::string quoted = "\"";
+  for (char ch : value) {
+    if (ch == '"') {
+      quoted += '"';
+    }
+    quoted += ch;
+  }
+  return quoted + "\"";
+}
+
+static std::string jsonString(const std::string& value)
+{
+  std::ostringstream quoted;
+  quoted << '"';
+  for (char ch : value) {
+    if (ch == '"' || ch == '\\') {
+      quoted << '\\' << ch;
+    } else if (ch == '\n') {
+      quoted << "\\n";
+    } else if (ch == '\r') {
+      quoted << "\\r";
+    } else if (ch == '\t') {
+      quoted << "\\t";
+    } else if (uint8_t(ch) < 0x20) {
+      quoted << "\\u" << std::hex << std::setw(4) << std::setfill('0') << int(ch) << std::dec;
+    } else {
+      quoted << ch;
+    }
+  }
+  quoted << '"';
+  return quoted.str();
+}
+
+static std::string formatDuration(double seconds)
+{
+  std::ostringstream text;
+  text << std::fixed << std::setprecision(3) << seconds;
+  return text.str();
+}
+
+LibraryScanner::LibraryScanner(MetadataCache* cache)
+: cache(cache)
+{
+  // initializers only
+}
+
+const std::vector<LibraryScanner::Entry>& LibraryScanner::entries() const
+{
+  return catalog;
+}
+
+int LibraryScanner::scan(const std::string& directory, int numWorkers)
+{
+  std::vector<std::string> inputs = BatchRunner::findInputs(directory);
+  std::sort(inputs.begin(), inputs.end());
+  if (numWorkers < 1) {
+    numWorkers = std::max(1u, std::thread::hardware_concurrency());
+  }
+  if (numWorkers > inputs.size()) {
+    numWorkers = std::max<int>(1, inputs.size());
+  }
+
+  catalog.clear();
+  catalog.resize(inputs.size());
+  std::atomic<size_t> nextInput(0);
+  std::atomic<int> unchanged(0), failed(0);
+  std::mutex mutex;
+  auto startTime = std::chrono::steady_clock::now();
+
+  auto worker = [&]{
+    ClefContext clef;
+    for (size_t i = nextInput++; i < inputs.size(); i = nextInput++) {
+      bool reused = false;
+      Entry& entry = catalog[i];
+      try {
+        entry = examine(&clef, inputs[i], reused);
+      } catch (std::exception& e) {
+        entry.path = inputs[i];
+        entry.error = e.what();
+      }
+      clef.purgeSamples();
+      if (reused) {
+        unchanged++;
+      }
+      if (!entry.error.empty()) {
+        failed++;
+        std::lock_guard<std::mutex> lock(mutex);
+        std::cerr << entry.path << ": " << entry.error << std::endl;
+      }
+    }
+  };
+
+  std::vector<std::thread> pool;
+  for (int i = 1; i < numWorkers; i++) {
+    pool.emplace_back(worker);
+  }
+  worker();
+  for (std::thread& thread : pool) {
+    thread.join();
+  }
+
+  double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - startTime).count();
+  std::cerr << "Scanned " << inputs.size() << " files (" << unchanged << " unchanged) in " << (int(seconds * 10) * .1)
+    << " seconds using " << numWorkers << " workers" << std::endl;
+  return failed;
+}
+
+double LibraryScanner::cachedDuration(ClefContext* clef, const std::string& key, const std::function<double()>& compute)
+{
+  MetadataCache::Entry entry;
+  bool cacheable = cache && cache->get(key, entry);
+  if (entry.duration >= 0) {
+    return entry.duration;
+  }
+  double duration = compute();
+  if (cacheable) {
+    entry = MetadataCache::Entry();
+    entry.duration = duration;
+    cache->put(key, entry);
+  }
+  return duration;
+}
+
+LibraryScanner::Entry LibraryScanner::examine(ClefContext* clef, const std::string& path, bool& reused)
+{
+  Entry entry;
+  entry.path = path;
+  entry.modified = MetadataCache::modifiedTime(path);
+  reused = true;
+
+  // Only opened once something has to be read from the file
+  std::unique_ptr<ByteSource> owned;
+  auto file = [&]() -> ByteSource& {
+    reused = false;
+    if (!owned) {
+      owned.reset(ByteSource::open(clef, path));
+      if (!owned) {
+        throw std::runtime_error("unable to open file");
+      }
+    }
+    return *owned;
+  };
+
+  MetadataCache::Entry cached;
+  bool cacheable = cache && cache->get(path, cached);
+  MetadataCache::Entry update;
+
+  BemaniFileType type = BemaniFileType(cached.fileType);
+  if (cached.fileType < 0) {
+    type = identifyFileType(clef, path, &file());
+    update.fileType = type;
+  }
+  entry.type = fileTypeName(type);
+  if (type == FT_invalid) {
+    if (cacheable && !reused) {
+      cache->put(path, update);
+    }
+    entry.error = "not a recognized file";
+    return entry;
+  }
+
+  if (type == FT_ifs) {
+    std::string paired = IFS::pairedFile(path);
+    if (!paired.empty() && MetadataCache::modifiedTime(paired)) {
+      entry.paired = paired;
+    }
+  }
+
+  if (type == FT_2dx) {
+    std::vector<std::string> names = cached.subsongs;
+    if (!cached.hasSubsongs) {
+      for (uint64_t id : get2DXSampleIDs(clef, &file())) {
+        names.push_back(path + "?" + std::to_string(id - 1));
+      }
+      update.hasSubsongs = true;
+      update.subsongs = names;
+    }
+    // Read on the first subsong that isn't cached
+    std::vector<double> lengths;
+    for (const std::string& name : names) {
+      uint64_t sampleID = std::stoull(name.substr(name.rfind('?') + 1)) + 1;
+      double duration = cachedDuration(clef, name, [&]() {
+        if (lengths.empty()) {
+          lengths = get2DXSampleLengths(&file());
+        }
+        return sampleID <= lengths.size() ? lengths[sampleID - 1] : 0.0;
+      });
+      entry.subsongs.push_back(Subsong{ name, duration });
+      entry.duration = std::max(entry.duration, duration);
+    }
+  } else {
+    entry.duration = cached.duration;
+    if (cached.duration < 0) {
+      if (type == FT_ifs) {
+        IFSSequence seq(clef);
+        seq.addIFS(new IFS(file()));
+        if (!entry.paired.empty()) {
+          std::unique_ptr<ByteSource> pairedFile(ByteSource::open(clef, entry.paired));
+          if (pairedFile) {
+            seq.addIFS(new IFS(*pairedFile));
+          }
+        }
+        entry.duration = seq.duration();
+      } else if (type == FT_bundle) {
+        reused = false;
+        auto stream = clef->openFile(path);
+        entry.duration = 0;
+        if (!stream || !BundleSequence::probe(*stream, nullptr, &entry.duration)) {
+          throw std::runtime_error("unable to read bundle");
+        }
+      } else {
+        reused = false;
+        IIDXSequence seq(clef, path);
+        entry.duration = seq.duration();
+      }
+      update.duration = entry.duration;
+    }
+  }
+
+  size_t slashPos = path.find_last_of("/\\");
+  std::string tagsFile = (slashPos == std::string::npos ? std::string() : path.substr(0, slashPos + 1)) + "!tags.m3u";
+  int64_t tagsModified = MetadataCache::modifiedTime(tagsFile);
+  if (cached.hasTags && cached.tagsModified == tagsModified) {
+    entry.tags = cached.tags;
+  } else {
+    reused = false;
+    entry.tags = TagsM3UMixin::readTags(clef, path);
+    if (!entry.tags.count("title") && !entry.paired.empty()) {
+      entry.tags = TagsM3UMixin::readTags(clef, entry.paired);
+    }
+    update.hasTags = true;
+    update.tags = entry.tags;
+    update.tagsModified = tagsModified;
+  }
+
+  if (cacheable && !reused) {
+    cache->put(path, update);
+  }
+  return entry;
+}
+
+void LibraryScanner::writeCSV(std::ostream& stream) const
+{
+  std::set<std::string> tagKeys;
+  for (const Entry& entry : catalog) {
+    for (const auto& tag : entry.tags) {
+      tagKeys.insert(tag.first);
+    }
+  }
+
+  stream << "path,type,paired,modified,subsongs,duration";
+  for (const std::string& key : tagKeys) {
+    stream << "," << csvField(key);
+  }
+  stream << ",error\n";
+  for (const Entry& entry : catalog) {
+    stream << csvField(entry.path) << "," << entry.type << "," << csvField(entry.paired) << "," << entry.modified << ","
+      << entry.subsongs.size() << "," << formatDuration(entry.duration);
+    for (const std::string& key : tagKeys) {
+      auto iter = entry.tags.find(key);
+      stream << "," << (iter == entry.tags.end() ? std::string() : csvField(iter->second));
+    }
+    stream << "," << csvField(entry.error) << "\n";
+  }
+}
+
+void LibraryScanner::writeJSON(std::ostream& stream) const
+{
+  stream << "[";
+  bool first = true;
+  for (const Entry& entry : catalog) {
+    stream << (first ? "\n" : ",\n") << "  {\"path\": " << jsonString(entry.path) << ", \"type\": " << jsonString(entry.type);
+    first = false;
+    if (!entry.paired.empty()) {
+      stream << ", \"paired\": " << jsonString(entry.paired);
+    }
+    stream << ", \"modified\": " << entry.modified << ", \"duration\": " << formatDuration(entry.duration);
+    if (!entry.subsongs.empty()) {
+      stream << ", \"subsongs\": [";
+      for (size_t i = 0; i < entry.subsongs.size(); i++) {
+        stream << (i ? ", " : "") << "{\"name\": " << jsonString(entry.subsongs[i].name)
+          << ", \"duration\": " << formatDuration(entry.subsongs[i].duration) << "}";
+      }
+      stream << "]";
+    }
+    stream << ", \"tags\": {";
+    bool firstTag = true;
+    for (const auto& tag : entry.tags) {
+      stream << (firstTag ? "" : ", ") << jsonString(tag.first) << ": " << jsonString(tag.second);
+      firstTag = false;
+    }
+    stream << "}";
+    if (!entry.error.empty()) {
+      stream << ", \"error\": " << jsonString(entry.error);
+    }
+    stream << "}";
+  }
+  stream << "\n]\n";
+}
@@ -0,0 +1,61 @@
+#ifndef B2W_LIBRARYSCANNER_H
+#define B2W_LIBRARYSCANNER_H
+
+#include "tagmap.h"
+#include <cstdint>
+#include <functional>
+#include <iostream>
+#include <string>
+#include <vector>
+class ClefContext;
+class MetadataCache;
+
+// Builds a catalog of every playable file under a directory: its type, the
+// IFS file it's paired with, its subsongs, duration, and tags. Files are
+// examined in parallel, one ClefContext per worker.
+//
+// If a metadata cache is given, files whose modification time and size
+// haven't changed since they were last examined are not reopened, and new
+// results are stored in it, so a rescan only parses what changed. The
+// cache is the one the plugin uses, so a scan also warms it for playback.
+class LibraryScanner {
+public:
+  struct Subsong {
+    std::string name;
+    double duration = 0;
+  };
+
+  struct Entry {
+    std::string path;
+    // The other half of a gitadora IFS pair, if it exists
+    std::string paired;
+    std::string type;
+    int64_t modified = 0;
+    // For banks, the longest subsong
+    double duration = 0;
+    std::vector<Subsong> subsongs;
+    TagMap tags;
+    std::string error;
+  };
+
+  LibraryScanner(MetadataCache* cache = nullptr);
+
+  // Returns the number of files that couldn't be read.
+  int scan(const std::string& directory, int numWorkers);
+
+  const std::vector<Entry>& entries() const;
+
+  // One row per file. Each tag found in the library gets its own column.
+  void writeCSV(std::ostream& stream) const;
+  // An array with one object per file
+  void writeJSON(std::ostream& stream) const;
+
+private:
+  Entry examine(ClefContext* clef, const std::string& path, bool& reused);
+  double cachedDuration(ClefContext* clef, const std::string& key, const std::function<double()>& compute);
+
+  MetadataCache* cache;
+  std::vector<Entry> catalog;
+};
+
+#endif
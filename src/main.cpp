@@ -1,12 +1,27 @@
 #include "ifs/ifs.h"
 #include "ifs/ifssequence.h"
 #include "bankloaders.h"
+#include "bytesource.h"
 #include "identify.h"
 #include "iidxsequence.h"
+#include "segmentrenderer.h"
+#include "batchrunner.h"
+#include "libraryscanner.h"
+#include "metadatacache.h"
+#include "renderdaemon.h"
+#include "renderwindow.h"
+#include "decodescheduler.h"
+#include "samplecache.h"
+#include "samplestore.h"
+#include "renderpipeline.h"
+#include "samplereleaser.h"
+#include "bundle.h"
 #include "riffwriter.h"
+#include "flacwriter.h"
 #include "clefcontext.h"
 #include "synth/synthcontext.h"
 #include "synth/channel.h"
+#include "plugin/baseplugin.h"
 #include "commandargs.h"
 #include "tagmap.h"
 #include "wma/asfcodec.h"
@@ -14,33 +29,102 @@
 #include <fstream>
 #include <iostream>
 #include <iomanip>
+#include <thread>
+#include <chrono>
+#include <cstdlib>
+#include <limits>
 
-int writeSample(ClefContext* ctx, SampleData* sample, const std::string& filename)
+// Set by --flac to write FLAC regardless of the output filename
+static bool flacOutput = false;
+// Set by --compile-bundle to write a song bundle instead of audio
+static bool bundleOutput = false;
+// Set by --start and --end to render only part of the song
+static double windowStart = 0, windowEnd = 0;
+// Set by --wma-downsample to decode WMA at a reduced sample rate
+static int wmaDownsample = 1;
+
+static bool useWindow()
+{
+  return windowStart > 0 || windowEnd > 0;
+}
+
+static bool useFlac(const std::string& filename)
+{
+  return flacOutput || FlacWriter::isFlacFilename(filename);
+}
+
+static std::string outputExtension()
+{
+  return bundleOutput ? "bclef" : flacOutput ? "flac" : "wav";
+}
+
+template <typename Writer>
+static void writeChannels(Writer& writer, const std::string& filename, const std::vector<int16_t>& left, const std::vector<int16_t>* right)
+{
+  writer.open(filename);
+  if (right) {
+    writer.write(left, *right);
+  } else {
+    writer.write(left);
+  }
+  writer.close();
+}
+
+template <typename Writer>
+static void writePipeline(Writer& writer, const std::string& filename, const RenderPipeline::Producer& producer)
+{
+  writer.open(filename);
+  RenderPipeline pipeline(producer);
+  pipeline.run([&writer](const std::vector<int16_t>& left, const std::vector<int16_t>& right) {
+    writer.write(left, right);
+  });
+  writer.close();
+}
+
+static void renderPipeline(const RenderPipeline::Producer& producer, double sampleRate, const std::string& filename)
+{
+  if (useFlac(filename)) {
+    FlacWriter flac(sampleRate, true);
+    writePipeline(flac, filename, producer);
+  } else {
+    RiffWriter riff(sampleRate, true);
+    writePipeline(riff, filename, producer);
+  }
+}
+
+int writeSample(ClefContext* ctx, SampleData* sample, std::string filename)
 {
   std::cerr << "Writing " << (int(sample->duration() * 10) * .1) << " seconds to \"" << filename << "\"..." << std::endl;
-  int channels = sample->channels.size();
-  RiffWriter riff(sample->sampleRate, channels > 1, sample->numSamples() * channels * 2);
 #ifndef _WIN32
-  riff.open(filename == "-" ? "/dev/stdout" : filename);
-#else
-  riff.open(filename);
+  if (filename == "-") {
+    filename = "/dev/stdout";
+  }
 #endif
-  if (sample->channels.size() > 1) {
-    riff.write(sample->channels[0], sample->channels[1]);
+  int channels = sample->channels.size();
+  const std::vector<int16_t>* right = channels > 1 ? &sample->channels[1] : nullptr;
+  if (useFlac(filename)) {
+    FlacWriter flac(sample->sampleRate, channels > 1, sample->numSamples());
+    writeChannels(flac, filename, sample->channels[0], right);
   } else {
-    riff.write(sample->channels[0]);
+    RiffWriter riff(sample->sampleRate, channels > 1, sample->numSamples() * channels * 2);
+    writeChannels(riff, filename, sample->channels[0], right);
   }
-  riff.close();
   return 0;
 }
 
 int decodeWma(ClefContext* ctx, const std::string& infile, const std::string& filename)
 {
   AsfCodec wma(ctx);
+  wma.setDownsample(wmaDownsample);
   return writeSample(ctx, wma.decodeFile(infile), filename);
 }
 
-void saveOutput(SynthContext* ctx, std::string filename)
+static void renderOutput(SynthContext* ctx, const std::string& filename)
+{
+  renderPipeline(RenderPipeline::fromSynth(ctx), ctx->sampleRate, filename);
+}
+
+void saveOutput(SynthContext* ctx, std::string filename, SampleReleaser* releaser = nullptr, bool verbose = false)
 {
 #ifndef _WIN32
   if (filename == "-") {
@@ -48,35 +132,212 @@ void saveOutput(SynthContext* ctx, std::string filename)
   }
 #endif
   std::cerr << "Writing " << (int(ctx->maximumTime() * 10) * .1) << " seconds to \"" << filename << "\"..." << std::endl;
-  RiffWriter riff(ctx->sampleRate, true);
-  riff.open(filename);
-  ctx->save(&riff);
-  riff.close();
+  if (!releaser) {
+    renderOutput(ctx, filename);
+    return;
+  }
+  renderPipeline(releaser->wrap(RenderPipeline::fromSynth(ctx), ctx->sampleRate), ctx->sampleRate, filename);
+  if (verbose) {
+    releaser->printTimeline(std::cerr);
+  }
+}
+
+int saveSegmented(ClefContext* clef, double sampleRate, const std::vector<ITrack*>& tracks, std::string filename, int jobs, bool verify)
+{
+#ifndef _WIN32
+  if (filename == "-") {
+    filename = "/dev/stdout";
+  }
+#endif
+  SegmentRenderer renderer(clef, sampleRate, tracks);
+  renderer.render(jobs);
+  std::cerr << "Writing " << (int(renderer.left.size() / sampleRate * 10) * .1) << " seconds to \"" << filename << "\"..." << std::endl;
+  if (useFlac(filename)) {
+    FlacWriter flac(sampleRate, true, renderer.left.size());
+    writeChannels(flac, filename, renderer.left, &renderer.right);
+  } else {
+    RiffWriter riff(sampleRate, true, renderer.left.size() * 4);
+    writeChannels(riff, filename, renderer.left, &renderer.right);
+  }
+  if (verify) {
+    int maxDifference;
+    size_t mismatched = renderer.compareSerial(maxDifference);
+    std::cerr << "Compared with a serial render: " << mismatched << " of " << renderer.left.size()
+      << " frames differ (largest difference " << maxDifference << ")" << std::endl;
+    return mismatched ? 1 : 0;
+  }
+  return 0;
 }
 
-int processIFS(CommandArgs& args, ClefContext& clef, const char* programName)
+// Renders only the window given by --start and --end. With a scheduler,
+// which must have deferred the song's samples, only the samples heard in
+// the window are decoded.
+int saveWindow(ClefContext* clef, SynthContext* ctx, DecodeScheduler* scheduler, const std::vector<ITrack*>& tracks, std::string filename)
+{
+#ifndef _WIN32
+  if (filename == "-") {
+    filename = "/dev/stdout";
+  }
+#endif
+  if (scheduler) {
+    scheduler->setWindow(windowStart, windowEnd);
+    scheduler->start(tracks);
+    scheduler->waitUntil(windowEnd > 0 ? windowEnd : std::numeric_limits<double>::infinity());
+  }
+  RenderWindow window(clef, ctx, windowStart, windowEnd);
+  std::cerr << "Writing " << (int(window.duration() * 10) * .1) << " seconds to \"" << filename << "\"..." << std::endl;
+  renderPipeline([&window](int16_t* buffer, size_t frames) -> size_t {
+    return window.fillBuffer(buffer, frames);
+  }, ctx->sampleRate, filename);
+  return 0;
+}
+
+void saveMixer(KeysoundMixer* mixer, std::string filename, bool verbose, SampleReleaser* releaser = nullptr)
+{
+#ifndef _WIN32
+  if (filename == "-") {
+    filename = "/dev/stdout";
+  }
+#endif
+  std::cerr << "Writing " << (int(mixer->maximumTime() * 10) * .1) << " seconds to \"" << filename << "\"..." << std::endl;
+  auto startTime = std::chrono::steady_clock::now();
+  double mixSeconds = 0;
+  RenderPipeline::Producer producer = [mixer, &mixSeconds](int16_t* buffer, size_t frames) -> size_t {
+    auto blockStart = std::chrono::steady_clock::now();
+    size_t written = mixer->fillBuffer(buffer, frames);
+    mixSeconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - blockStart).count();
+    return written;
+  };
+  renderPipeline(releaser ? releaser->wrap(producer, mixer->sampleRate) : producer, mixer->sampleRate, filename);
+  if (verbose && releaser) {
+    releaser->printTimeline(std::cerr);
+  }
+  if (verbose) {
+    double totalSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - startTime).count();
+    std::cerr << "Mixed " << mixer->currentTime() << " seconds in " << int(mixSeconds * 1000) << " ms ("
+      << int(mixer->currentTime() / mixSeconds) << "x realtime), " << int(totalSeconds * 1000) << " ms including output" << std::endl;
+  }
+}
+
+static std::string stemFilename(const std::string& filename, uint64_t part)
+{
+  const char* suffix;
+  switch (part) {
+    case SampleSpaces::Drums: suffix = "-drums"; break;
+    case SampleSpaces::Guitar: suffix = "-guitar"; break;
+    case SampleSpaces::Bass: suffix = "-bass"; break;
+    case SampleSpaces::Keyboard: suffix = "-keyboard"; break;
+    default: suffix = "-backing"; break;
+  }
+  int extPos = filename.rfind('.');
+  int slashPos = filename.find_last_of("/\\");
+  if (extPos == std::string::npos || (slashPos != std::string::npos && extPos < slashPos)) {
+    return filename + suffix;
+  }
+  return filename.substr(0, extPos) + suffix + filename.substr(extPos);
+}
+
+int saveStems(IFSSequence& seq, const std::string& filename, const char* programName)
+{
+  if (filename == "-") {
+    std::cerr << programName << ": --stems cannot write to standard output" << std::endl;
+    return 1;
+  }
+  std::vector<uint64_t> parts = seq.parts();
+  if (parts.empty()) {
+    // pop'n charts and previews are a single part, and phased streams
+    // without a backing-only stream can't be separated
+    std::cerr << programName << ": no separable parts found for --stems" << std::endl;
+    return 1;
+  }
+  // Samples are decoded once up front and only read while rendering,
+  // so every part can render on its own thread.
+  std::vector<std::thread> threads;
+  for (uint64_t part : parts) {
+    SynthContext* ctx = seq.initContext(part);
+    std::string stemName = stemFilename(filename, part);
+    std::cerr << "Writing " << (int(ctx->maximumTime() * 10) * .1) << " seconds to \"" << stemName << "\"..." << std::endl;
+    threads.emplace_back(renderOutput, ctx, stemName);
+  }
+  for (std::thread& thread : threads) {
+    thread.join();
+  }
+  return 0;
+}
+
+static int saveBundle(ClefContext* clef, double sampleRate, const std::vector<ITrack*>& tracks, const std::string& filename, const char* programName)
+{
+  if (filename == "-") {
+    std::cerr << programName << ": --compile-bundle cannot write to standard output" << std::endl;
+    return 1;
+  }
+  BundleSequence::write(filename, clef, sampleRate, tracks);
+  return 0;
+}
+
+static std::vector<ITrack*> allTracks(const ISequence& seq)
+{
+  std::vector<ITrack*> tracks;
+  for (int i = 0; i < seq.numTracks(); i++) {
+    tracks.push_back(seq.getTrack(i));
+  }
+  return tracks;
+}
+
+static std::vector<ITrack*> activeTracks(IFSSequence& seq)
+{
+  std::vector<ITrack*> tracks;
+  for (int i = 0; i < seq.numTracks(); i++) {
+    if (seq.isTrackActive(i)) {
+      tracks.push_back(seq.getTrack(i));
+    }
+  }
+  return tracks;
+}
+
+int processIFS(CommandArgs& args, ClefContext& clef, const std::vector<std::string>& inputs, std::string filename, const char* programName)
 {
   IFSSequence seq(&clef, args.hasKey("preview"));
+  bool stems = args.hasKey("stems");
+  bool compressed = args.hasKey("compressed");
+  seq.setSplitParts(stems);
+  seq.setCompressedSamples(compressed);
   if (args.hasKey("mute")) {
     seq.setMutes(args.getString("mute"));
   }
   if (args.hasKey("solo")) {
     seq.setSolo(args.getString("solo"));
   }
-  std::vector<std::string> positional = args.positional();
-  for (const std::string& fn : args.positional()) {
+  std::vector<std::string> positional = inputs;
+  for (const std::string& fn : inputs) {
     std::string paired = IFS::pairedFile(fn);
     if (!paired.empty() && std::find(positional.begin(), positional.end(), paired) == positional.end()) {
       positional.push_back(paired);
     }
   }
+  std::vector<std::unique_ptr<ByteSource>> sources;
+  std::vector<ByteSource*> sourcePtrs;
   for (const std::string& fn : positional) {
-    std::ifstream file(fn, std::ios::in | std::ios::binary);
-    IFS* ifs = new IFS(file);
+    sources.emplace_back(ByteSource::open(&clef, fn));
+    if (!sources.back()) {
+      throw std::runtime_error("unable to open " + fn);
+    }
+    sourcePtrs.push_back(sources.back().get());
+  }
+  // The seq and bgm archives are parsed side by side
+  for (std::unique_ptr<IFS>& ifs : IFS::parseAll(sourcePtrs)) {
     if (args.hasKey("verbose")) {
       ifs->manifest.dump();
     }
-    seq.addIFS(ifs);
+    seq.addIFS(ifs.release());
+  }
+  // Only a window defers decoding, since bundles, stems, and compressed
+  // samples can't be combined with one. It's attached before loading so
+  // that decoding waits until the window is known.
+  std::unique_ptr<DecodeScheduler> scheduler;
+  if (useWindow()) {
+    scheduler.reset(new DecodeScheduler(&clef));
+    seq.setDecodeScheduler(scheduler.get());
   }
   seq.load();
   if (!seq.numTracks()) {
@@ -101,15 +362,51 @@ int processIFS(CommandArgs& args, ClefContext& clef, const char* programName)
     }
   }
 
+  if (filename.empty()) {
+    filename = inputs[0] + "." + outputExtension();
+  }
+  if (bundleOutput) {
+    seq.waitForStreams();
+    return saveBundle(&clef, seq.sampleRate, activeTracks(seq), filename, programName);
+  }
+  if (stems) {
+    return saveStems(seq, filename, programName);
+  }
+  if (useWindow()) {
+    // The window is cut from decoded samples
+    seq.waitForStreams();
+    SynthContext* ctx = seq.initContext();
+    return saveWindow(&clef, ctx, scheduler.get(), allTracks(seq), filename);
+  }
+  if (args.hasKey("fast-mix") || compressed) {
+    // Phased streams finish loading here, so they're counted below
+    KeysoundMixer* mixer = seq.initMixer();
+    if (compressed) {
+      uint64_t compressedBytes, decodedBytes;
+      seq.compressedMemory(compressedBytes, decodedBytes);
+      std::cerr << std::fixed << std::setprecision(1) << "Samples kept compressed: " << (compressedBytes / 1048576.0)
+        << " MB instead of " << (decodedBytes / 1048576.0) << " MB decoded (" << ((decodedBytes - compressedBytes) / 1048576.0)
+        << " MB saved)" << std::defaultfloat << std::setprecision(6) << std::endl;
+    }
+    SampleReleaser releaser(&clef, activeTracks(seq));
+    saveMixer(mixer, filename, args.hasKey("verbose"), &releaser);
+    return 0;
+  }
+  // A file render has nothing to start early, so the streams play decoded
+  // through the synthesizer, and segments and the releaser can read them
+  seq.waitForStreams();
   SynthContext* ctx(seq.initContext());
-  std::string filename = args.getString("output", args.positional()[0] + ".wav");
-  saveOutput(ctx, filename);
+  if (args.hasKey("jobs")) {
+    return saveSegmented(&clef, seq.sampleRate, activeTracks(seq), filename, args.getInt("jobs"), args.hasKey("verify-jobs"));
+  }
+  // Muted channels still start voices, so every track counts toward a sample's last use
+  SampleReleaser releaser(&clef, allTracks(seq));
+  saveOutput(ctx, filename, &releaser, args.hasKey("verbose"));
   return 0;
 }
 
-int process2dxStream(CommandArgs& args, ClefContext& clef, const char* programName)
+int process2dxStream(CommandArgs& args, ClefContext& clef, std::string infile, std::string outfile, const char* programName)
 {
-  std::string infile = args.positional().at(0);
   bool verbose = args.hasKey("verbose");
   int subsong = 0;
   if (args.hasKey("subsong")) {
@@ -122,8 +419,8 @@ int process2dxStream(CommandArgs& args, ClefContext& clef, const char* programNa
     }
   }
 
-  std::ifstream file(infile, std::ios::in | std::ios::binary);
-  int numSamples = ::load2DX(&clef, &file, 0, verbose ? 0 : subsong + 1);
+  std::unique_ptr<ByteSource> file(ByteSource::open(&clef, infile));
+  int numSamples = file ? ::load2DX(&clef, file.get(), 0, verbose ? 0 : subsong + 1) : 0;
   if (!numSamples) {
     std::cerr << programName << ": unable to load bank" << std::endl;
     return 1;
@@ -143,26 +440,286 @@ int process2dxStream(CommandArgs& args, ClefContext& clef, const char* programNa
     std::cerr << programName << ": index " << subsong << " not in bank" << std::endl;
     return 1;
   }
-  std::string outfile = args.getString("output");
   if (outfile.empty()) {
-    outfile = infile + "-" + std::to_string(subsong) + ".wav";
+    outfile = infile + "-" + std::to_string(subsong) + "." + outputExtension();
+  }
+  if (bundleOutput) {
+    StreamSequence seq(&clef, subsong + 1);
+    return saveBundle(&clef, 44100, { seq.getTrack(0) }, outfile, programName);
+  }
+  if (useWindow()) {
+    // A lone sample seeks by slicing it
+    size_t numSamples = sample->numSamples();
+    size_t first = std::min<size_t>(windowStart * sample->sampleRate, numSamples);
+    size_t last = windowEnd > 0 ? std::min<size_t>(windowEnd * sample->sampleRate, numSamples) : numSamples;
+    last = std::max(first, last);
+    for (auto& channel : sample->channels) {
+      channel.erase(channel.begin() + std::min(last, channel.size()), channel.end());
+      channel.erase(channel.begin(), channel.begin() + std::min(first, channel.size()));
+    }
   }
   return writeSample(&clef, sample, outfile);
 }
 
+int processIIDX(CommandArgs& args, ClefContext& clef, const std::string& infile, std::string filename, const char* programName)
+{
+  IIDXSequence seq(&clef, infile);
+  seq.setWmaDownsample(wmaDownsample);
+  if (filename.empty()) {
+    filename = seq.basePath + outputExtension();
+  }
+  if (bundleOutput) {
+    SynthContext* ctx = seq.initContext();
+    return saveBundle(&clef, ctx->sampleRate, { seq.getTrack(0) }, filename, programName);
+  }
+  if (useWindow()) {
+    DecodeScheduler scheduler(&clef);
+    seq.setDecodeScheduler(&scheduler);
+    SynthContext* ctx = seq.initContext();
+    return saveWindow(&clef, ctx, &scheduler, { seq.getTrack(0) }, filename);
+  }
+  if (args.hasKey("fast-mix")) {
+    KeysoundMixer* mixer = seq.initMixer();
+    SampleReleaser releaser(&clef, { seq.getTrack(0) });
+    saveMixer(mixer, filename, args.hasKey("verbose"), &releaser);
+    return 0;
+  }
+  SynthContext* ctx = seq.initContext();
+  if (args.hasKey("jobs")) {
+    return saveSegmented(&clef, ctx->sampleRate, { seq.getTrack(0) }, filename, args.getInt("jobs"), args.hasKey("verify-jobs"));
+  }
+  SampleReleaser releaser(&clef, { seq.getTrack(0) });
+  saveOutput(ctx, filename, &releaser, args.hasKey("verbose"));
+  return 0;
+}
+
+int processBundle(CommandArgs& args, ClefContext& clef, const std::string& infile, std::string filename, const char* programName)
+{
+  if (bundleOutput) {
+    std::cerr << programName << ": " << infile << " is already a bundle" << std::endl;
+    return 1;
+  }
+  ByteSource* source = ByteSource::open(&clef, infile);
+  if (!source) {
+    throw std::runtime_error("unable to open " + infile);
+  }
+  BundleSequence seq(&clef, source);
+  if (filename.empty()) {
+    filename = infile + "." + outputExtension();
+  }
+  if (useWindow()) {
+    // Bundles are stored decoded, so only the rendering is skipped
+    return saveWindow(&clef, seq.initContext(), nullptr, allTracks(seq), filename);
+  }
+  if (args.hasKey("fast-mix")) {
+    KeysoundMixer* mixer = seq.initMixer();
+    SampleReleaser releaser(&clef, allTracks(seq));
+    saveMixer(mixer, filename, args.hasKey("verbose"), &releaser);
+    return 0;
+  }
+  SynthContext* ctx = seq.initContext();
+  if (args.hasKey("jobs")) {
+    return saveSegmented(&clef, seq.sampleRate, allTracks(seq), filename, args.getInt("jobs"), args.hasKey("verify-jobs"));
+  }
+  SampleReleaser releaser(&clef, allTracks(seq));
+  saveOutput(ctx, filename, &releaser, args.hasKey("verbose"));
+  return 0;
+}
+
+int processInput(CommandArgs& args, ClefContext& clef, const std::vector<std::string>& inputs, const std::string& filename, const char* programName)
+{
+  const std::string& infile = inputs.at(0);
+  BemaniFileType fileType = identifyFileType(&clef, infile);
+  if (fileType == FT_invalid) {
+    std::cerr << programName << ": " << infile << " - unknown file type" << std::endl;
+    return 1;
+  }
+
+  if (args.hasKey("verbose")) {
+    // TODO: native tag format
+    std::string m3uPath = TagsM3U::relativeTo(infile);
+    std::ifstream tags(m3uPath);
+    if (tags) {
+      TagsM3U m3u(tags);
+      int subsong = args.getInt("subsong");
+      std::string trackName = infile;
+      if (subsong) {
+        trackName = infile + "?" + std::to_string(subsong);
+      }
+      int trackIndex = m3u.findTrack(trackName);
+      if (trackIndex < 0 && !subsong) {
+        trackName = infile + "?0";
+      }
+      if (trackIndex >= 0) {
+        std::cerr << "Tags found in " << m3uPath << ":" << std::endl;
+        for (const auto& iter : m3u.allTags(trackIndex)) {
+          std::cerr << iter.first << " = " << iter.second << std::endl;
+        }
+      }
+    }
+  }
+
+  if (fileType == FT_ifs) {
+    return processIFS(args, clef, inputs, filename, programName);
+  } else if (fileType == FT_2dx) {
+    return process2dxStream(args, clef, infile, filename, programName);
+  } else if (fileType == FT_bundle) {
+    return processBundle(args, clef, infile, filename, programName);
+  }
+  return processIIDX(args, clef, infile, filename, programName);
+}
+
+int processBatch(CommandArgs& args, const char* programName)
+{
+  std::vector<std::string> inputs;
+  try {
+    inputs = BatchRunner::findInputs(args.getString("batch"));
+  } catch (std::exception& e) {
+    std::cerr << programName << ": " << e.what() << std::endl;
+    return 1;
+  }
+  if (inputs.empty()) {
+    std::cerr << programName << ": no inputs found in " << args.getString("batch") << std::endl;
+    return 1;
+  }
+  // Songs in the batch share the keysounds they have in common, and those
+  // not in use are kept for later songs up to --store-limit
+  SampleStore::enable(uint64_t(args.getInt("store-limit", 1024)) << 20);
+  BatchRunner batch(args.getString("output"), outputExtension());
+  int failed = batch.run(inputs, args.getInt("workers"), [&args, programName](ClefContext* clef, const std::string& input, const std::string& output) {
+    return processInput(args, *clef, { input }, output, programName);
+  });
+  return failed ? 1 : 0;
+}
+
+int processScan(CommandArgs& args, const char* programName)
+{
+  std::string filename = args.getString("output", "catalog.csv");
+  if (filename == "-") {
+    filename = "/dev/stdout";
+  }
+  std::ofstream output(filename);
+  if (!output) {
+    std::cerr << programName << ": unable to open " << filename << std::endl;
+    return 1;
+  }
+
+  // Unchanged files are answered from the same cache the plugin uses
+  std::unique_ptr<MetadataCache> cache;
+  if (!args.hasKey("no-cache")) {
+    cache.reset(new MetadataCache(MetadataCache::defaultPath()));
+  }
+  LibraryScanner scanner(cache.get());
+  int failed;
+  try {
+    failed = scanner.scan(args.getString("scan"), args.getInt("workers"));
+  } catch (std::exception& e) {
+    std::cerr << programName << ": " << e.what() << std::endl;
+    return 1;
+  }
+
+  int extPos = filename.rfind('.');
+  std::string extension = extPos == std::string::npos ? std::string() : filename.substr(extPos + 1);
+  std::transform(extension.begin(), extension.end(), extension.begin(), ::tolower);
+  if (extension == "json") {
+    scanner.writeJSON(output);
+  } else {
+    scanner.writeCSV(output);
+  }
+  std::cerr << "Wrote " << scanner.entries().size() << " entries to \"" << filename << "\"";
+  if (failed) {
+    std::cerr << " (" << failed << " unreadable)";
+  }
+  std::cerr << std::endl;
+  return 0;
+}
+
+#ifndef _WIN32
+int processDaemon(CommandArgs& args, const char* programName)
+{
+  try {
+    SampleStore::enable();
+    RenderDaemon daemon(args.getString("daemon"), size_t(args.getInt("cache-size", 1024)) << 20);
+    daemon.run();
+  } catch (std::exception& e) {
+    std::cerr << programName << ": " << e.what() << std::endl;
+    return 1;
+  }
+  return 0;
+}
+
+int processClient(CommandArgs& args, const char* programName)
+{
+  RenderRequest request;
+  std::string infile = args.positional().at(0);
+  request.subsong = args.getInt("subsong");
+  int qPos = infile.find('?');
+  if (qPos >= 0) {
+    if (!args.hasKey("subsong")) {
+      request.subsong = std::stoi(infile.substr(qPos + 1));
+    }
+    infile = infile.substr(0, qPos);
+  }
+  // The daemon may be running in a different directory
+  char* resolved = realpath(infile.c_str(), nullptr);
+  request.file = resolved ? resolved : infile;
+  free(resolved);
+  request.mute = args.getString("mute");
+  request.solo = args.getString("solo");
+  request.start = args.getFloat("start");
+  request.end = args.getFloat("end");
+
+  std::string filename = args.getString("output", args.positional()[0] + "." + outputExtension());
+  if (filename == "-") {
+    filename = "/dev/stdout";
+  }
+  try {
+    RenderClient client(args.getString("connect"), request);
+    std::cerr << "Writing " << (int(client.frames / client.sampleRate * 10) * .1) << " seconds to \"" << filename << "\"..." << std::endl;
+    renderPipeline([&client](int16_t* buffer, size_t frames) -> size_t {
+      return client.read(buffer, frames);
+    }, client.sampleRate, filename);
+  } catch (std::exception& e) {
+    std::cerr << programName << ": " << e.what() << std::endl;
+    return 1;
+  }
+  return 0;
+}
+#endif
+
 int main(int argc, char** argv)
 {
   CommandArgs args({
     { "help", "h", "", "Show this help text" },
     { "verbose", "v", "", "Output additional information about input files" },
     { "output", "o", "filename", "Set the output filename (default: input filename with .wav extension)" },
+    { "batch", "b", "list", "Process every input named in a list file or found in a directory" },
+    { "workers", "", "count", "Number of inputs to process at once in batch or scan mode (default: one per CPU)" },
+    { "store-limit", "", "MB", "Memory for shared keysounds kept between songs by --batch (default: 1024)" },
+    { "scan", "", "dir", "Write a catalog of the songs found in a directory (CSV, or JSON with a .json output filename)" },
+    { "flac", "", "", "Write FLAC instead of WAV (also chosen by a .flac output filename)" },
+    { "compile-bundle", "", "", "Write a song bundle that plays back without decoding instead of audio" },
     { "wma", "", "filename", "Decode a WMA file instead of playing a sequence" },
     { "mute", "m", "parts", "Silence the selected channels (gitadora only)" },
     { "solo", "s", "parts", "Only play the selected channels (gitadora only)" },
+    { "stems", "", "", "Write each channel to a separate file (gitadora only)" },
     { "preview", "p", "", "Play the preview clip instead of the sequence (pop'n only)" },
     { "subsong", "n", "index", "Play a subsong other than the first (.2dx/.ssp banks only)" },
+    { "jobs", "j", "threads", "Render the song in parallel using the given number of threads" },
+    { "verify-jobs", "", "", "With --jobs, also render on one thread and report any difference" },
+    { "fast-mix", "", "", "Use the simplified keysound mixer instead of the full synthesizer" },
+    { "compressed", "", "", "Keep samples ADPCM-compressed in memory and decode while mixing (gitadora only, implies --fast-mix)" },
+    { "daemon", "", "socket", "Serve render requests on a Unix socket, keeping recently used songs loaded" },
+    { "cache-size", "", "MB", "Memory limit for songs kept loaded by --daemon (default: 1024)" },
+    { "connect", "", "socket", "Render the input using a daemon listening on the given socket" },
+    { "no-cache", "", "", "Don't read or write the decoded sample cache or, with --scan, the metadata cache" },
+    { "cache-dir", "", "path", "Set the location of the decoded sample cache" },
+    { "cache-limit", "", "MB", "Set the size limit of the decoded sample cache (default: 2048)" },
+    { "start", "", "seconds", "Start rendering at the given time, decoding only the samples heard after it" },
+    { "end", "", "seconds", "Stop rendering at the given time" },
+    { "wma-downsample", "", "factor", "Decode WMA samples at 1/2 or 1/4 of their sample rate for faster previews (.s3p banks and --wma)" },
     // TODO: save-tags
-    { "", "", "input", "Path to a .1 sequence, .ssp bank, .2dx bank, or one or more .ifs files" },
+    { "", "", "input", "Path to a .1 sequence, .ssp bank, .2dx bank, .bclef bundle, or one or more .ifs files" },
   });
   std::string argError = args.parse(argc, argv);
   if (!argError.empty()) {
@@ -177,61 +734,67 @@ int main(int argc, char** argv)
     std::cout << "\tb  Bass" << std::endl;
     std::cout << "\tk  Keyboard" << std::endl;
     std::cout << "\ts  Streamed backing track" << std::endl;
+    std::cout << std::endl;
+    std::cout << "In batch mode, the output filename is a template that may contain:" << std::endl;
+    std::cout << "\t{path}  Path to the input file" << std::endl;
+    std::cout << "\t{dir}   Directory containing the input file" << std::endl;
+    std::cout << "\t{name}  Input filename without its extension" << std::endl;
+    std::cout << "\t{ext}   Output file extension (default template: \"{path}.{ext}\")" << std::endl;
+    std::cout << std::endl;
+    std::cout << "In scan mode, the output filename names the catalog (default: catalog.csv, or - for" << std::endl;
+    std::cout << "standard output). Files that haven't changed since the last scan aren't reread." << std::endl;
     return 0;
-  } else if (!args.positional().size() && !args.hasKey("wma")) {
+  } else if (!args.positional().size() && !args.hasKey("wma") && !args.hasKey("batch") && !args.hasKey("scan") && !args.hasKey("daemon")) {
     std::cerr << argv[0] << ": at least one input filename required" << std::endl;
     return 1;
   }
 
   ClefContext clef;
+  flacOutput = args.hasKey("flac");
+  bundleOutput = args.hasKey("compile-bundle");
+  windowStart = args.getFloat("start");
+  windowEnd = args.getFloat("end");
+  wmaDownsample = args.getInt("wma-downsample", 1);
+  if (wmaDownsample != 1 && wmaDownsample != 2 && wmaDownsample != 4) {
+    std::cerr << argv[0] << ": --wma-downsample must be 1, 2, or 4" << std::endl;
+    return 1;
+  }
+  if (useWindow() && (bundleOutput || args.hasKey("stems") || args.hasKey("compressed"))) {
+    std::cerr << argv[0] << ": --start and --end can't be used with --compile-bundle, --stems, or --compressed" << std::endl;
+    return 1;
+  }
+  if (bundleOutput && args.hasKey("compressed")) {
+    // Bundles store decoded PCM, which compressed samples never have
+    std::cerr << argv[0] << ": --compile-bundle can't be used with --compressed" << std::endl;
+    return 1;
+  }
+  if (!args.hasKey("no-cache")) {
+    SampleCache::configure(args.getString("cache-dir", SampleCache::defaultPath()), uint64_t(args.getInt("cache-limit", 2048)) << 20);
+  }
 
   if (args.hasKey("wma")) {
-    return decodeWma(&clef, args.getString("wma"), args.getString("output", args.getString("wma") + ".wav"));
+    return decodeWma(&clef, args.getString("wma"), args.getString("output", args.getString("wma") + "." + outputExtension()));
   }
 
-  std::string infile = args.positional().at(0);
-  BemaniFileType fileType = identifyFileType(&clef, infile);
-  if (fileType == FT_invalid) {
-    std::cerr << argv[0] << ": " << infile << " - unknown file type" << std::endl;
-    return 1;
+  if (args.hasKey("batch")) {
+    return processBatch(args, argv[0]);
   }
 
-  try {
-    if (args.hasKey("verbose")) {
-      // TODO: native tag format
-      std::string m3uPath = TagsM3U::relativeTo(infile);
-      std::ifstream tags(m3uPath);
-      if (tags) {
-        TagsM3U m3u(tags);
-        int subsong = args.getInt("subsong");
-        std::string trackName = infile;
-        if (subsong) {
-          trackName = infile + "?" + std::to_string(subsong);
-        }
-        int trackIndex = m3u.findTrack(trackName);
-        if (trackIndex < 0 && !subsong) {
-          trackName = infile + "?0";
-        }
-        if (trackIndex >= 0) {
-          std::cerr << "Tags found in " << m3uPath << ":" << std::endl;
-          for (const auto& iter : m3u.allTags(trackIndex)) {
-            std::cerr << iter.first << " = " << iter.second << std::endl;
-          }
-        }
-      }
-    }
+  if (args.hasKey("scan")) {
+    return processScan(args, argv[0]);
+  }
 
-    if (fileType == FT_ifs) {
-      return processIFS(args, clef, argv[0]);
-    } else if (fileType == FT_2dx) {
-      return process2dxStream(args, clef, argv[0]);
-    }
-    IIDXSequence seq(&clef, infile);
+  if (args.hasKey("daemon") || args.hasKey("connect")) {
+#ifndef _WIN32
+    return args.hasKey("daemon") ? processDaemon(args, argv[0]) : processClient(args, argv[0]);
+#else
+    std::cerr << argv[0] << ": --daemon and --connect are not supported on Windows" << std::endl;
+    return 1;
+#endif
+  }
 
-    SynthContext* ctx = seq.initContext();
-    std::string filename = args.getString("output", seq.basePath + "wav");
-    saveOutput(ctx, filename);
-    return 0;
+  try {
+    return processInput(args, clef, args.positional(), args.getString("output"), argv[0]);
   } catch (std::exception& e) {
     std::cerr << argv[0] << ": " << e.what() << std::endl;
     return 1;
@@ -0,0 +1,256 @@
+#include "metadatacache.h"
+#include "pathutils.h"
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <functional>
+#include <thread>
+#include <sys/stat.h>
+
+// Bump when the meaning of a stored field changes
+static const uint32_t cacheVersion = 2;
+// Unsaved changes that trigger a save, so a crash doesn't lose a whole scan
+static const int saveInterval = 256;
+
+template <typename T>
+static void writeValue(std::ostream& file, T value)
+{
+  file.write(reinterpret_cast<const char*>(&value), sizeof(T));
+}
+
+static void writeString(std::ostream& file, const std::string& str)
+{
+  writeValue<uint32_t>(file, str.size());
+  file.write(str.data(), str.size());
+}
+
+template <typename T>
+static bool readValue(std::istream& file, T& value)
+{
+  return bool(file.read(reinterpret_cast<char*>(&value), sizeof(T)));
+}
+
+static bool readString(std::istream& file, std::string& str)
+{
+  uint32_t size;
+  if (!readValue(file, size) || size > (1 << 20)) {
+    return false;
+  }
+  str.resize(size);
+  return size == 0 || bool(file.read(&str[0], size));
+}
+
+std::string MetadataCache::defaultPath()
+{
+  std::string base = userCacheDirectory();
+#ifdef _WIN32
+  return base.empty() ? base : base + "\\metadata.bin";
+#else
+  return base.empty() ? base : base + "/metadata.bin";
+#endif
+}
+
+MetadataCache::MetadataCache(const std::string& path)
+: path(path), unsaved(0)
+{
+  if (!path.empty()) {
+    load();
+  }
+}
+
+MetadataCache::~MetadataCache()
+{
+  if (unsaved) {
+    save();
+  }
+}
+
+int64_t MetadataCache::modifiedTime(const std::string& filename)
+{
+  struct stat info;
+  return ::stat(filename.c_str(), &info) == 0 ? int64_t(info.st_mtime) : 0;
+}
+
+uint64_t MetadataCache::pairedStamp(const std::vector<std::string>& filenames)
+{
+  uint64_t stamp = 0;
+  for (const std::string& filename : filenames) {
+    int64_t mtime;
+    uint64_t size;
+    if (!filename.empty() && stat(filename, mtime, size)) {
+      stamp = (stamp ^ std::hash<std::string>()(filename)) * 1099511628211ULL;
+      stamp = (stamp ^ uint64_t(mtime)) * 1099511628211ULL;
+      stamp = (stamp ^ size) * 1099511628211ULL;
+    }
+  }
+  return stamp;
+}
+
+bool MetadataCache::stat(const std::string& key, int64_t& mtime, uint64_t& size)
+{
+  size_t qPos = key.find('?');
+  std::string filename = qPos == std::string::npos ? key : key.substr(0, qPos);
+  struct stat info;
+  if (::stat(filename.c_str(), &info) != 0) {
+    return false;
+  }
+  mtime = info.st_mtime;
+  size = info.st_size;
+  return true;
+}
+
+bool MetadataCache::get(const std::string& key, Entry& entry)
+{
+  int64_t mtime;
+  uint64_t size;
+  entry = Entry();
+  if (!stat(key, mtime, size)) {
+    return false;
+  }
+  std::lock_guard<std::mutex> lock(mutex);
+  auto iter = entries.find(key);
+  if (iter != entries.end() && iter->second.mtime == mtime && iter->second.size == size) {
+    entry = iter->second.entry;
+  }
+  return true;
+}
+
+void MetadataCache::put(const std::string& key, const Entry& entry)
+{
+  int64_t mtime;
+  uint64_t size;
+  if (!stat(key, mtime, size)) {
+    return;
+  }
+  bool saveNow = false;
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    auto iter = entries.find(key);
+    if (iter == entries.end() || iter->second.mtime != mtime || iter->second.size != size) {
+      iter = entries.insert_or_assign(key, Stored{ mtime, size, Entry() }).first;
+    }
+    Entry& stored = iter->second.entry;
+    if ((entry.fileType >= 0 || entry.duration >= 0) && entry.pairedStamp != stored.pairedStamp) {
+      // Worked out from different versions of the other files
+      stored.fileType = -1;
+      stored.duration = -1;
+      stored.pairedStamp = entry.pairedStamp;
+    }
+    if (entry.fileType >= 0) {
+      stored.fileType = entry.fileType;
+    }
+    if (entry.duration >= 0) {
+      stored.duration = entry.duration;
+    }
+    if (entry.sampleRate >= 0) {
+      stored.sampleRate = entry.sampleRate;
+    }
+    if (entry.hasSubsongs) {
+      stored.hasSubsongs = true;
+      stored.subsongs = entry.subsongs;
+    }
+    if (entry.hasTags) {
+      stored.hasTags = true;
+      stored.tags = entry.tags;
+      stored.tagsModified = entry.tagsModified;
+    }
+    saveNow = !path.empty() && ++unsaved >= saveInterval;
+  }
+  if (saveNow) {
+    save();
+  }
+}
+
+void MetadataCache::load()
+{
+  std::ifstream file(path, std::ios::in | std::ios::binary);
+  char magic[4];
+  uint32_t version, count;
+  if (!file.read(magic, 4) || std::memcmp(magic, "B2WM", 4) != 0 || !readValue(file, version) || version != cacheVersion ||
+      !readValue(file, count)) {
+    return;
+  }
+  for (uint32_t i = 0; i < count; i++) {
+    std::string key;
+    Stored stored;
+    Entry& entry = stored.entry;
+    int32_t fileType;
+    uint8_t flags;
+    uint32_t numSubsongs, numTags;
+    if (!readString(file, key) || !readValue(file, stored.mtime) || !readValue(file, stored.size) ||
+        !readValue(file, fileType) || !readValue(file, entry.duration) || !readValue(file, entry.sampleRate) ||
+        !readValue(file, entry.tagsModified) || !readValue(file, entry.pairedStamp) || !readValue(file, flags) || !readValue(file, numSubsongs)) {
+      return;
+    }
+    entry.fileType = fileType;
+    entry.hasSubsongs = flags & 1;
+    entry.hasTags = flags & 2;
+    entry.subsongs.resize(numSubsongs);
+    for (std::string& subsong : entry.subsongs) {
+      if (!readString(file, subsong)) {
+        return;
+      }
+    }
+    if (!readValue(file, numTags)) {
+      return;
+    }
+    for (uint32_t j = 0; j < numTags; j++) {
+      std::string tag, value;
+      if (!readString(file, tag) || !readString(file, value)) {
+        return;
+      }
+      entry.tags[tag] = value;
+    }
+    entries[key] = stored;
+  }
+}
+
+void MetadataCache::save()
+{
+  std::lock_guard<std::mutex> lock(mutex);
+  if (path.empty()) {
+    return;
+  }
+  createParentDirectories(path);
+  // Written under a temporary name and renamed so that other processes
+  // never read a partial file.
+  std::string tempName = path + "." + std::to_string(std::hash<std::thread::id>()(std::this_thread::get_id()) & 0xFFFFFF) + ".tmp";
+  {
+    std::ofstream file(tempName, std::ios::out | std::ios::binary | std::ios::trunc);
+    file.write("B2WM", 4);
+    writeValue<uint32_t>(file, cacheVersion);
+    writeValue<uint32_t>(file, entries.size());
+    for (const auto& iter : entries) {
+      const Entry& entry = iter.second.entry;
+      writeString(file, iter.first);
+      writeValue<int64_t>(file, iter.second.mtime);
+      writeValue<uint64_t>(file, iter.second.size);
+      writeValue<int32_t>(file, entry.fileType);
+      writeValue<double>(file, entry.duration);
+      writeValue<double>(file, entry.sampleRate);
+      writeValue<int64_t>(file, entry.tagsModified);
+      writeValue<uint64_t>(file, entry.pairedStamp);
+      writeValue<uint8_t>(file, (entry.hasSubsongs ? 1 : 0) | (entry.hasTags ? 2 : 0));
+      writeValue<uint32_t>(file, entry.subsongs.size());
+      for (const std::string& subsong : entry.subsongs) {
+        writeString(file, subsong);
+      }
+      writeValue<uint32_t>(file, entry.tags.size());
+      for (const auto& tag : entry.tags) {
+        writeString(file, tag.first);
+        writeString(file, tag.second);
+      }
+    }
+    if (!file) {
+      file.close();
+      std::remove(tempName.c_str());
+      return;
+    }
+  }
+  std::remove(path.c_str());
+  if (std::rename(tempName.c_str(), path.c_str()) != 0) {
+    std::remove(tempName.c_str());
+    return;
+  }
+  unsaved = 0;
+}
@@ -0,0 +1,80 @@
+#ifndef B2W_METADATACACHE_H
+#define B2W_METADATACACHE_H
+
+#include "tagmap.h"
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// Remembers what the plugin has learned about each file so that repeated
+// identify, length, tag, and subsong queries don't reopen and reparse it.
+// Entries are keyed by path and dropped when the file's modification time
+// or size changes. A "?N" subsong suffix is part of the key, but only the
+// file itself is checked. Results that also depend on other files are
+// validated by the caller through the entry's pairedStamp.
+//
+// If a path is given, entries are loaded from it on construction and
+// written back periodically and on destruction.
+class MetadataCache {
+public:
+  struct Entry {
+    int fileType = -1;
+    double duration = -1;
+    double sampleRate = -1;
+    bool hasSubsongs = false;
+    std::vector<std::string> subsongs;
+    bool hasTags = false;
+    TagMap tags;
+    // Modification time of the file the tags were read from, since it can
+    // change without the song changing
+    int64_t tagsModified = 0;
+    // Identifies the versions of the other files that the type and
+    // duration were worked out from, such as the other half of an IFS pair
+    // or the banks next to a chart. See pairedStamp().
+    uint64_t pairedStamp = 0;
+  };
+
+  static std::string defaultPath();
+
+  // Returns the file's modification time, or 0 if it doesn't exist.
+  static int64_t modifiedTime(const std::string& filename);
+
+  // Combines the modification times and sizes of the files that exist
+  // among filenames into a value that changes when any of them changes,
+  // appears, or disappears. Returns 0 if none of them exist.
+  static uint64_t pairedStamp(const std::vector<std::string>& filenames);
+
+  MetadataCache(const std::string& path = std::string());
+  ~MetadataCache();
+
+  // Returns what is known about the file. Unknown fields keep their
+  // default values. Returns false if the file can't be checked for changes,
+  // in which case nothing should be stored for it either.
+  bool get(const std::string& key, Entry& entry);
+
+  // Merges the known fields of entry into the cached entry for the file.
+  // A type or duration with a different pairedStamp than the cached entry
+  // replaces both of the cached ones.
+  void put(const std::string& key, const Entry& entry);
+
+  void save();
+
+private:
+  struct Stored {
+    int64_t mtime;
+    uint64_t size;
+    Entry entry;
+  };
+
+  static bool stat(const std::string& key, int64_t& mtime, uint64_t& size);
+  void load();
+
+  std::string path;
+  std::mutex mutex;
+  std::unordered_map<std::string, Stored> entries;
+  int unsaved;
+};
+
+#endif
@@ -1,5 +1,7 @@
 #include "onetrack.h"
+#include "bytesource.h"
 #include "utility.h"
+#include <algorithm>
 #include <stdexcept>
 #include <iostream>
 
@@ -20,35 +22,36 @@
 //
 // offset = 0x7fffffff means EOF
 
-OneTrack::OneTrack(std::istream& file, bool popn)
+OneTrack::OneTrack(ByteSource& file, bool popn)
 : BasicTrack()
 {
   std::vector<uint64_t> keySamples[2] = {
     { 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0 },
     { 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0 },
   };
-  std::vector<char> buffer(17);
-  file.read(buffer.data(), 17);
+  std::vector<uint8_t> buffer(18);
+  file.read(0, buffer.data(), std::min<uint64_t>(buffer.size(), file.size()));
   int eventSize = 8;
   if (popn && buffer[17] == 0x45) {
     // extended record format
     eventSize = 12;
   }
   uint32_t chartLen = popn ? 0x7FFFFFFF : parseInt<uint32_t>(buffer, 4) / eventSize;
-  file.seekg(parseInt<uint32_t>(buffer, 0));
+  uint64_t recordPos = parseInt<uint32_t>(buffer, 0);
   uint32_t offset;
   uint8_t command, param;
   uint16_t value;
   int32_t filepos = -8;
   for (int i = 0; i < chartLen; i++) {
     filepos += eventSize;
-    if (!file.read(buffer.data(), eventSize)) {
+    if (!file.read(recordPos, buffer.data(), eventSize)) {
       if (popn) {
         return;
       } else {
         throw std::runtime_error("Unexpected EOF parsing chart");
       }
     }
+    recordPos += eventSize;
     offset = parseInt<uint32_t>(buffer, 0);
     if (offset == 0x7FFFFFFF) {
       break;
@@ -2,12 +2,12 @@
 #define B2W_ONETRACK_H
 
 #include "seq/itrack.h"
-#include <iostream>
 #include <memory>
+class ByteSource;
 
 class OneTrack : public BasicTrack {
 public:
-  OneTrack(std::istream& file, bool popn = false);
+  OneTrack(ByteSource& file, bool popn = false);
 };
 
 #endif
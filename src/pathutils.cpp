@@ -0,0 +1,90 @@
+#include "pathutils.h"
+#include <algorithm>
+#include <cstdlib>
+#include <sys/stat.h>
+#ifdef _MSC_VER
+#include <windows.h>
+#else
+#include <dirent.h>
+#endif
+#ifdef _WIN32
+#include <direct.h>
+#else
+#include <sys/types.h>
+#endif
+
+bool isDirectory(const std::string& path)
+{
+  struct stat info;
+  return stat(path.c_str(), &info) == 0 && (info.st_mode & S_IFMT) == S_IFDIR;
+}
+
+std::vector<std::string> listDirectory(const std::string& path)
+{
+  std::vector<std::string> names;
+#ifdef _MSC_VER
+  WIN32_FIND_DATAA entry;
+  HANDLE find = FindFirstFileA((path + "\\*").c_str(), &entry);
+  if (find == INVALID_HANDLE_VALUE) {
+    return names;
+  }
+  do {
+    names.push_back(entry.cFileName);
+  } while (FindNextFileA(find, &entry));
+  FindClose(find);
+#else
+  DIR* dir = opendir(path.c_str());
+  if (!dir) {
+    return names;
+  }
+  while (dirent* entry = readdir(dir)) {
+    names.push_back(entry->d_name);
+  }
+  closedir(dir);
+#endif
+  names.erase(std::remove_if(names.begin(), names.end(), [](const std::string& name) {
+    return name == "." || name == "..";
+  }), names.end());
+  std::sort(names.begin(), names.end());
+  return names;
+}
+
+void createDirectories(const std::string& path)
+{
+  for (size_t pos = path.find_first_of("/\\", 1); ; pos = path.find_first_of("/\\", pos + 1)) {
+    std::string dir = path.substr(0, pos);
+    if (!dir.empty() && !isDirectory(dir)) {
+#ifdef _WIN32
+      _mkdir(dir.c_str());
+#else
+      mkdir(dir.c_str(), 0777);
+#endif
+    }
+    if (pos == std::string::npos) {
+      break;
+    }
+  }
+}
+
+void createParentDirectories(const std::string& filename)
+{
+  size_t slashPos = filename.find_last_of("/\\");
+  if (slashPos != std::string::npos && slashPos > 0) {
+    createDirectories(filename.substr(0, slashPos));
+  }
+}
+
+std::string userCacheDirectory()
+{
+#ifdef _WIN32
+  const char* base = std::getenv("LOCALAPPDATA");
+  return base ? std::string(base) + "\\bemani-clef" : std::string();
+#else
+  const char* base = std::getenv("XDG_CACHE_HOME");
+  if (base && *base) {
+    return std::string(base) + "/bemani-clef";
+  }
+  base = std::getenv("HOME");
+  return base ? std::string(base) + "/.cache/bemani-clef" : std::string();
+#endif
+}
@@ -0,0 +1,23 @@
+#ifndef B2W_PATHUTILS_H
+#define B2W_PATHUTILS_H
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+bool isDirectory(const std::string& path);
+
+// Returns the names of the entries in a directory, sorted, without "." and "..".
+std::vector<std::string> listDirectory(const std::string& path);
+
+// Creates a directory along with any missing parents.
+void createDirectories(const std::string& path);
+
+// Creates the directories leading up to a file.
+void createParentDirectories(const std::string& filename);
+
+// Returns the per-user directory for bemani-clef's caches, or an empty
+// string if it can't be determined.
+std::string userCacheDirectory();
+
+#endif
@@ -0,0 +1,468 @@
+#ifndef _WIN32
+#include "renderdaemon.h"
+#include "ifs/ifs.h"
+#include "ifs/ifssequence.h"
+#include "iidxsequence.h"
+#include "bankloaders.h"
+#include "bytesource.h"
+#include "identify.h"
+#include "renderwindow.h"
+#include "timeline.h"
+#include "samplestore.h"
+#include "clefcontext.h"
+#include "codec/sampledata.h"
+#include "plugin/baseplugin.h"
+#include "synth/synthcontext.h"
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <stdexcept>
+#include <thread>
+#include <unordered_set>
+#include <csignal>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
+
+static const size_t maxRequestBytes = 65536;
+static const size_t blockFrames = 4096;
+
+struct RenderDaemon::Song {
+  // Held for the duration of a render, since the sequence's tracks
+  // can only be played back by one context at a time.
+  std::mutex mutex;
+  ClefContext clef;
+  std::unique_ptr<IFSSequence> ifs;
+  std::unique_ptr<IIDXSequence> iidx;
+  std::unique_ptr<StreamSequence> stream;
+  std::unique_ptr<SynthContext> streamSynth;
+  ISequence* seq = nullptr;
+  size_t bytes = 0;
+
+  ~Song();
+  SynthContext* prepare(const RenderRequest& request);
+  // Gives shared keysounds back to the store between renders
+  void unload();
+};
+
+RenderDaemon::Song::~Song()
+{
+  if (SampleStore* store = SampleStore::get()) {
+    store->release(&clef);
+    store->lend(&clef, false);
+  }
+}
+
+void RenderDaemon::Song::unload()
+{
+  if (SampleStore* store = SampleStore::get()) {
+    store->unload(&clef);
+  }
+}
+
+SynthContext* RenderDaemon::Song::prepare(const RenderRequest& request)
+{
+  if (SampleStore* store = SampleStore::get()) {
+    store->reload(&clef);
+  }
+  for (int i = 0; i < seq->numTracks(); i++) {
+    seq->getTrack(i)->reset();
+  }
+  if (ifs) {
+    if (!request.solo.empty()) {
+      ifs->setSolo(request.solo);
+    } else {
+      ifs->setMutes(request.mute);
+    }
+    return ifs->initContext();
+  } else if (iidx) {
+    return iidx->initContext();
+  }
+  streamSynth.reset(new SynthContext(&clef, 44100));
+  streamSynth->addChannel(stream->getTrack(0));
+  return streamSynth.get();
+}
+
+std::string RenderRequest::serialize() const
+{
+  std::ostringstream ss;
+  ss << "file=" << file << "\n";
+  ss << "subsong=" << subsong << "\n";
+  if (!mute.empty()) {
+    ss << "mute=" << mute << "\n";
+  }
+  if (!solo.empty()) {
+    ss << "solo=" << solo << "\n";
+  }
+  if (start > 0) {
+    ss << "start=" << start << "\n";
+  }
+  if (end > 0) {
+    ss << "end=" << end << "\n";
+  }
+  ss << "format=" << format << "\n\n";
+  return ss.str();
+}
+
+RenderRequest RenderRequest::parse(const std::string& text)
+{
+  RenderRequest request;
+  std::istringstream ss(text);
+  std::string line;
+  while (std::getline(ss, line) && !line.empty()) {
+    int eqPos = line.find('=');
+    if (eqPos == std::string::npos) {
+      throw std::runtime_error("malformed request line: " + line);
+    }
+    std::string key = line.substr(0, eqPos);
+    std::string value = line.substr(eqPos + 1);
+    if (key == "file") {
+      request.file = value;
+    } else if (key == "subsong") {
+      request.subsong = std::stoi(value);
+    } else if (key == "mute") {
+      request.mute = value;
+    } else if (key == "solo") {
+      request.solo = value;
+    } else if (key == "start") {
+      request.start = std::stod(value);
+    } else if (key == "end") {
+      request.end = std::stod(value);
+    } else if (key == "format") {
+      if (value != "pcm" && value != "wav") {
+        throw std::runtime_error("unsupported format: " + value);
+      }
+      request.format = value;
+    } else {
+      throw std::runtime_error("unknown request key: " + key);
+    }
+  }
+  if (request.file.empty()) {
+    throw std::runtime_error("no file specified");
+  }
+  return request;
+}
+
+static bool sendAll(int fd, const void* data, size_t length)
+{
+  const char* pos = static_cast<const char*>(data);
+  while (length > 0) {
+    ssize_t sent = ::send(fd, pos, length, MSG_NOSIGNAL);
+    if (sent < 0 && errno == EINTR) {
+      continue;
+    } else if (sent <= 0) {
+      return false;
+    }
+    pos += sent;
+    length -= sent;
+  }
+  return true;
+}
+
+static std::string wavHeader(uint32_t sampleRate, uint32_t dataBytes)
+{
+  std::string header("RIFF\0\0\0\0WAVEfmt \x10\0\0\0\x01\0\x02\0", 24);
+  auto put32 = [&header](uint32_t value) {
+    for (int i = 0; i < 4; i++) {
+      header.push_back(char((value >> (i * 8)) & 0xFF));
+    }
+  };
+  put32(sampleRate);
+  put32(sampleRate * 4);
+  header.append("\x04\0\x10\0data", 8);
+  put32(dataBytes);
+  uint32_t riffSize = dataBytes + 36;
+  for (int i = 0; i < 4; i++) {
+    header[4 + i] = char((riffSize >> (i * 8)) & 0xFF);
+  }
+  return header;
+}
+
+RenderDaemon::RenderDaemon(const std::string& socketPath, size_t cacheBytes)
+: socketPath(socketPath), listenFd(-1), cacheBytes(cacheBytes), usedBytes(0)
+{
+  // initializers only
+}
+
+RenderDaemon::~RenderDaemon()
+{
+  if (listenFd >= 0) {
+    ::close(listenFd);
+    ::unlink(socketPath.c_str());
+  }
+}
+
+void RenderDaemon::run()
+{
+  std::signal(SIGPIPE, SIG_IGN);
+  sockaddr_un addr;
+  std::memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  if (socketPath.size() >= sizeof(addr.sun_path)) {
+    throw std::runtime_error("socket path too long");
+  }
+  std::strcpy(addr.sun_path, socketPath.c_str());
+
+  listenFd = ::socket(AF_UNIX, SOCK_STREAM, 0);
+  if (listenFd < 0) {
+    throw std::runtime_error(std::string("unable to create socket: ") + std::strerror(errno));
+  }
+  // Replace a socket left behind by a previous daemon
+  ::unlink(socketPath.c_str());
+  if (::bind(listenFd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) < 0 || ::listen(listenFd, 16) < 0) {
+    throw std::runtime_error("unable to listen on " + socketPath + ": " + std::strerror(errno));
+  }
+  std::cerr << "Listening on " << socketPath << " (cache limit " << (cacheBytes >> 20) << " MB)" << std::endl;
+
+  while (true) {
+    int fd = ::accept(listenFd, nullptr, nullptr);
+    if (fd < 0) {
+      if (errno == EINTR || errno == ECONNABORTED) {
+        continue;
+      }
+      throw std::runtime_error(std::string("accept failed: ") + std::strerror(errno));
+    }
+    std::thread(&RenderDaemon::serve, this, fd).detach();
+  }
+}
+
+void RenderDaemon::serve(int fd)
+{
+  std::string text;
+  char ch;
+  while (text.size() < maxRequestBytes && ::recv(fd, &ch, 1, 0) == 1) {
+    text.push_back(ch);
+    if (text.size() >= 2 && text.compare(text.size() - 2, 2, "\n\n") == 0) {
+      break;
+    }
+  }
+
+  try {
+    RenderRequest request = RenderRequest::parse(text);
+    std::shared_ptr<Song> song = getSong(request);
+    std::lock_guard<std::mutex> lock(song->mutex);
+    SynthContext* ctx = song->prepare(request);
+    // Unloads the shared keysounds again however the render ends
+    std::unique_ptr<Song, void(*)(Song*)> unload(song.get(), [](Song* song) { song->unload(); });
+    // Voices already playing at the start time are picked up partway
+    // through, so nothing before the window is rendered.
+    RenderWindow window(&song->clef, ctx, request.start, request.end);
+
+    double sampleRate = ctx->sampleRate;
+    std::ostringstream header;
+    header << "OK " << sampleRate << " 2 " << window.frames() << "\n";
+    if (request.format == "wav") {
+      header << wavHeader(sampleRate, window.frames() * 4);
+    }
+    if (!sendAll(fd, header.str().data(), header.str().size())) {
+      ::close(fd);
+      return;
+    }
+
+    // The window pads a short render so the stream matches the announced length
+    std::vector<int16_t> buffer(blockFrames * 2);
+    size_t frames;
+    while ((frames = window.fillBuffer(buffer.data(), blockFrames)) > 0) {
+      if (!sendAll(fd, buffer.data(), frames * 4)) {
+        // Client went away
+        break;
+      }
+    }
+  } catch (std::exception& e) {
+    std::string message = std::string("ERROR ") + e.what() + "\n";
+    sendAll(fd, message.data(), message.size());
+  }
+  ::close(fd);
+}
+
+std::shared_ptr<RenderDaemon::Song> RenderDaemon::getSong(const RenderRequest& request)
+{
+  std::string key = request.file + "?" + std::to_string(request.subsong);
+  {
+    std::lock_guard<std::mutex> lock(cacheMutex);
+    auto iter = cache.find(key);
+    if (iter != cache.end()) {
+      lru.splice(lru.begin(), lru, iter->second.second);
+      return iter->second.first;
+    }
+  }
+
+  // Loading happens outside the lock so requests for cached songs aren't blocked
+  std::shared_ptr<Song> song = loadSong(request);
+
+  std::lock_guard<std::mutex> lock(cacheMutex);
+  auto iter = cache.find(key);
+  if (iter != cache.end()) {
+    // Another request loaded the same song first
+    lru.splice(lru.begin(), lru, iter->second.second);
+    return iter->second.first;
+  }
+  lru.push_front(key);
+  cache[key] = std::make_pair(song, lru.begin());
+  usedBytes += song->bytes;
+  std::cerr << "Loaded " << key << " (" << (song->bytes >> 10) << " kB, " << cache.size() << " cached)" << std::endl;
+  SampleStore* store = SampleStore::get();
+  if (store) {
+    store->report(std::cerr);
+  }
+  // Keysounds shared through the store are counted once, in the store
+  while (usedBytes + (store ? store->storedBytes() : 0) > cacheBytes && lru.size() > 1) {
+    // Songs still being rendered stay alive until their request finishes
+    auto evicted = cache.find(lru.back());
+    usedBytes -= evicted->second.first->bytes;
+    std::cerr << "Evicted " << evicted->first << std::endl;
+    cache.erase(evicted);
+    lru.pop_back();
+  }
+  return song;
+}
+
+std::shared_ptr<RenderDaemon::Song> RenderDaemon::loadSong(const RenderRequest& request)
+{
+  std::shared_ptr<Song> song(new Song);
+  ClefContext* clef = &song->clef;
+  if (SampleStore* store = SampleStore::get()) {
+    store->lend(clef);
+  }
+  BemaniFileType fileType = identifyFileType(clef, request.file);
+  if (fileType == FT_invalid) {
+    throw std::runtime_error(request.file + " - unknown file type");
+  }
+
+  std::vector<ITrack*> tracks;
+  if (fileType == FT_ifs) {
+    song->ifs.reset(new IFSSequence(clef));
+    // Load every part so mute and solo can change between requests
+    song->ifs->setSplitParts(true);
+    std::vector<std::string> files{ request.file };
+    std::string paired = IFS::pairedFile(request.file);
+    if (!paired.empty() && std::ifstream(paired)) {
+      files.push_back(paired);
+    }
+    std::vector<std::unique_ptr<ByteSource>> sources;
+    std::vector<ByteSource*> sourcePtrs;
+    for (const std::string& fn : files) {
+      sources.emplace_back(ByteSource::open(clef, fn));
+      if (!sources.back()) {
+        throw std::runtime_error("unable to open " + fn);
+      }
+      sourcePtrs.push_back(sources.back().get());
+    }
+    for (std::unique_ptr<IFS>& ifs : IFS::parseAll(sourcePtrs)) {
+      song->ifs->addIFS(ifs.release());
+    }
+    song->ifs->load();
+    if (!song->ifs->numTracks()) {
+      throw std::runtime_error("no playable tracks found");
+    }
+    song->ifs->waitForStreams();
+    song->seq = song->ifs.get();
+  } else if (fileType == FT_2dx) {
+    std::unique_ptr<ByteSource> file(ByteSource::open(clef, request.file));
+    uint64_t sampleID = request.subsong + 1;
+    if (file) {
+      ::load2DX(clef, file.get(), 0, sampleID);
+    }
+    SampleData* sample = clef->getSample(sampleID);
+    if (!sample) {
+      throw std::runtime_error("index " + std::to_string(request.subsong) + " not in bank");
+    }
+    song->stream.reset(new StreamSequence(clef, sampleID));
+    song->seq = song->stream.get();
+    song->unload();
+    song->bytes = sample->numSamples() * sample->channels.size() * sizeof(int16_t);
+    return song;
+  } else {
+    song->iidx.reset(new IIDXSequence(clef, request.file));
+    // Loads the samples, which stay loaded for later requests
+    song->iidx->initContext();
+    song->seq = song->iidx.get();
+  }
+
+  // Only the samples the song doesn't share through the store stay loaded
+  song->unload();
+  for (int i = 0; i < song->seq->numTracks(); i++) {
+    tracks.push_back(song->seq->getTrack(i));
+  }
+  Timeline timeline(clef, tracks);
+  std::unordered_set<uint64_t> counted;
+  for (const Timeline::Voice& voice : timeline.voices()) {
+    SampleData* sample = clef->getSample(voice.sampleID);
+    if (sample && counted.insert(voice.sampleID).second) {
+      song->bytes += sample->numSamples() * sample->channels.size() * sizeof(int16_t);
+    }
+  }
+  return song;
+}
+
+RenderClient::RenderClient(const std::string& socketPath, const RenderRequest& request)
+: sampleRate(0), frames(0), fd(-1)
+{
+  sockaddr_un addr;
+  std::memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  if (socketPath.size() >= sizeof(addr.sun_path)) {
+    throw std::runtime_error("socket path too long");
+  }
+  std::strcpy(addr.sun_path, socketPath.c_str());
+  fd = ::socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd < 0 || ::connect(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) < 0) {
+    std::string error = std::strerror(errno);
+    if (fd >= 0) {
+      ::close(fd);
+      fd = -1;
+    }
+    throw std::runtime_error("unable to connect to " + socketPath + ": " + error);
+  }
+
+  std::string text = request.serialize();
+  std::string line;
+  char ch;
+  if (sendAll(fd, text.data(), text.size())) {
+    while (::recv(fd, &ch, 1, 0) == 1 && ch != '\n') {
+      line.push_back(ch);
+    }
+  }
+  if (line.compare(0, 3, "OK ") != 0) {
+    ::close(fd);
+    fd = -1;
+    if (line.compare(0, 6, "ERROR ") == 0) {
+      throw std::runtime_error(line.substr(6));
+    }
+    throw std::runtime_error("no response from " + socketPath);
+  }
+  int channels;
+  std::istringstream(line.substr(3)) >> sampleRate >> channels >> frames;
+}
+
+RenderClient::~RenderClient()
+{
+  if (fd >= 0) {
+    ::close(fd);
+  }
+}
+
+size_t RenderClient::read(int16_t* buffer, size_t numFrames)
+{
+  uint8_t* pos = reinterpret_cast<uint8_t*>(buffer);
+  size_t remaining = numFrames * 4;
+  while (remaining > 0) {
+    ssize_t received = ::recv(fd, pos, remaining, 0);
+    if (received < 0 && errno == EINTR) {
+      continue;
+    } else if (received <= 0) {
+      break;
+    }
+    pos += received;
+    remaining -= received;
+  }
+  return numFrames - remaining / 4;
+}
+#endif
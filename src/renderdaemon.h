@@ -0,0 +1,78 @@
+#ifndef B2W_RENDERDAEMON_H
+#define B2W_RENDERDAEMON_H
+
+#ifndef _WIN32
+#include <cstdint>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+// A render request sent to the daemon. On the wire it is a list of
+// key=value lines ending with an empty line. The daemon responds with
+// "OK <sampleRate> <channels> <frames>" followed by interleaved 16-bit
+// little-endian stereo PCM (or a WAV file if format=wav), or with
+// "ERROR <message>" and closes the connection.
+struct RenderRequest {
+  std::string file;
+  int subsong = 0;
+  std::string mute;
+  std::string solo;
+  double start = 0;
+  double end = 0;
+  std::string format = "pcm";
+
+  std::string serialize() const;
+  static RenderRequest parse(const std::string& text);
+};
+
+// Serves render requests over a Unix domain socket. Loaded songs are kept in
+// a cache bounded by the size of their decoded samples and evicted in least
+// recently used order, so repeated requests for the same song skip parsing
+// and decoding. Keysounds shared through the sample store are only copied
+// into a song while it renders, so they are counted once, in the store.
+class RenderDaemon {
+public:
+  RenderDaemon(const std::string& socketPath, size_t cacheBytes);
+  ~RenderDaemon();
+
+  // Accepts connections until the process exits. Each connection is
+  // handled on its own thread.
+  void run();
+
+private:
+  struct Song;
+
+  void serve(int fd);
+  std::shared_ptr<Song> getSong(const RenderRequest& request);
+  std::shared_ptr<Song> loadSong(const RenderRequest& request);
+
+  std::string socketPath;
+  int listenFd;
+  size_t cacheBytes;
+  size_t usedBytes;
+  std::mutex cacheMutex;
+  std::list<std::string> lru;
+  std::unordered_map<std::string, std::pair<std::shared_ptr<Song>, std::list<std::string>::iterator>> cache;
+};
+
+// Sends a request to a daemon and reads back the rendered audio.
+// The constructor throws if the daemon reports an error.
+class RenderClient {
+public:
+  RenderClient(const std::string& socketPath, const RenderRequest& request);
+  ~RenderClient();
+
+  double sampleRate;
+  uint64_t frames;
+
+  // Reads interleaved stereo frames and returns the number read, or 0 at the end.
+  size_t read(int16_t* buffer, size_t frames);
+
+private:
+  int fd;
+};
+
+#endif
+#endif
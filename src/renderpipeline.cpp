@@ -0,0 +1,109 @@
+#include "renderpipeline.h"
+#include "synth/synthcontext.h"
+#include <condition_variable>
+#include <exception>
+#include <mutex>
+#include <thread>
+
+RenderPipeline::Producer RenderPipeline::fromSynth(SynthContext* ctx)
+{
+  return [ctx](int16_t* buffer, size_t frames) -> size_t {
+    size_t frameBytes = 2 * sizeof(int16_t);
+    return ctx->fillBuffer(reinterpret_cast<uint8_t*>(buffer), frames * frameBytes) / frameBytes;
+  };
+}
+
+RenderPipeline::RenderPipeline(const Producer& producer, size_t blockFrames, int numBlocks)
+: producer(producer), blockFrames(blockFrames), numBlocks(numBlocks < 2 ? 2 : numBlocks)
+{
+  // initializers only
+}
+
+size_t RenderPipeline::run(const Consumer& consumer)
+{
+  struct Block {
+    std::vector<int16_t> samples;
+    size_t frames;
+  };
+  std::vector<Block> ring(numBlocks);
+  for (Block& block : ring) {
+    block.samples.resize(blockFrames * 2);
+  }
+  std::mutex mutex;
+  std::condition_variable blockReady, slotFree;
+  int readPos = 0, writePos = 0, filled = 0;
+  bool finished = false, cancelled = false;
+  std::exception_ptr error;
+
+  std::thread renderThread([&]{
+    try {
+      while (true) {
+        {
+          std::unique_lock<std::mutex> lock(mutex);
+          slotFree.wait(lock, [&]{ return filled < numBlocks || cancelled; });
+          if (cancelled) {
+            break;
+          }
+        }
+        // Only the render thread touches the slot at writePos until it is published
+        Block& block = ring[writePos];
+        block.frames = producer(block.samples.data(), blockFrames);
+        std::lock_guard<std::mutex> lock(mutex);
+        if (!block.frames) {
+          break;
+        }
+        writePos = (writePos + 1) % numBlocks;
+        filled++;
+        blockReady.notify_one();
+      }
+    } catch (...) {
+      std::lock_guard<std::mutex> lock(mutex);
+      error = std::current_exception();
+    }
+    std::lock_guard<std::mutex> lock(mutex);
+    finished = true;
+    blockReady.notify_one();
+  });
+
+  size_t total = 0;
+  std::vector<int16_t> left(blockFrames), right(blockFrames);
+  try {
+    while (true) {
+      {
+        std::unique_lock<std::mutex> lock(mutex);
+        blockReady.wait(lock, [&]{ return filled > 0 || finished; });
+        if (!filled) {
+          break;
+        }
+      }
+      const Block& block = ring[readPos];
+      left.resize(block.frames);
+      right.resize(block.frames);
+      for (size_t i = 0; i < block.frames; i++) {
+        left[i] = block.samples[i * 2];
+        right[i] = block.samples[i * 2 + 1];
+      }
+      total += block.frames;
+      {
+        std::lock_guard<std::mutex> lock(mutex);
+        readPos = (readPos + 1) % numBlocks;
+        filled--;
+        slotFree.notify_one();
+      }
+      consumer(left, right);
+    }
+  } catch (...) {
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      cancelled = true;
+      slotFree.notify_one();
+    }
+    renderThread.join();
+    throw;
+  }
+  renderThread.join();
+  if (error) {
+    std::rethrow_exception(error);
+  }
+  return total;
+}
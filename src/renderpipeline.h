@@ -0,0 +1,32 @@
+#ifndef B2W_RENDERPIPELINE_H
+#define B2W_RENDERPIPELINE_H
+
+#include <cstdint>
+#include <functional>
+#include <vector>
+class SynthContext;
+
+// Renders audio on a background thread into a small ring of fixed-size
+// blocks while the calling thread writes finished blocks out. Memory use is
+// bounded by the size of the ring regardless of the length of the song.
+class RenderPipeline {
+public:
+  // Fills an interleaved stereo buffer and returns the number of frames written, or 0 at the end.
+  using Producer = std::function<size_t(int16_t* buffer, size_t frames)>;
+  using Consumer = std::function<void(const std::vector<int16_t>& left, const std::vector<int16_t>& right)>;
+
+  static Producer fromSynth(SynthContext* ctx);
+
+  RenderPipeline(const Producer& producer, size_t blockFrames = 4096, int numBlocks = 4);
+
+  // Returns the total number of frames passed to the consumer.
+  // Exceptions thrown while rendering are rethrown here.
+  size_t run(const Consumer& consumer);
+
+private:
+  Producer producer;
+  size_t blockFrames;
+  int numBlocks;
+};
+
+#endif
@@ -0,0 +1,221 @@
+#include "renderwindow.h"
+#include "timeline.h"
+#include "clefcontext.h"
+#include "codec/sampledata.h"
+#include "synth/synthcontext.h"
+#include "synth/channel.h"
+#include <algorithm>
+#include <cmath>
+#include <atomic>
+#include <mutex>
+#include <unordered_map>
+#include <utility>
+
+// Copies of trimmed samples get IDs far above any that the loaders assign.
+// A destroyed window's IDs go back to a pool for its context, so a context
+// that plays many windows reuses the same few samples instead of
+// registering new ones every time.
+static const uint64_t trimmedSpace = 1ULL << 62;
+static std::atomic<uint64_t> nextTrimmedID(0);
+static std::mutex freeIDsMutex;
+static std::unordered_map<ClefContext*, std::vector<uint64_t>> freeTrimmedIDs;
+
+static uint64_t takeTrimmedID(ClefContext* ctx)
+{
+  std::lock_guard<std::mutex> lock(freeIDsMutex);
+  auto iter = freeTrimmedIDs.find(ctx);
+  if (iter == freeTrimmedIDs.end() || iter->second.empty()) {
+    return trimmedSpace | nextTrimmedID++;
+  }
+  uint64_t sampleID = iter->second.back();
+  iter->second.pop_back();
+  return sampleID;
+}
+
+// Extra frames copied past the end of the window for the resampler
+static const size_t resampleMargin = 64;
+
+RenderWindow::RenderWindow(ClefContext* ctx, SynthContext* song, double start, double end)
+: ctx(ctx), start(std::max(0.0, start)), end(end), totalFrames(0), position(0), finished(false)
+{
+  std::vector<ITrack*> songTracks;
+  std::vector<Channel*> channels;
+  for (int i = 0; i < song->numChannels(); i++) {
+    Channel* channel = song->channel(i);
+    if (!channel->mute) {
+      songTracks.push_back(channel->track);
+      channels.push_back(channel);
+    }
+  }
+  build(Timeline(ctx, songTracks), song->sampleRate, song->maximumTime(), channels);
+}
+
+RenderWindow::RenderWindow(ClefContext* ctx, const Timeline& timeline, double sampleRate, double start, double end)
+: ctx(ctx), start(std::max(0.0, start)), end(end), totalFrames(0), position(0), finished(false)
+{
+  build(timeline, sampleRate, timeline.length(), {});
+}
+
+void RenderWindow::build(const Timeline& timeline, double sampleRate, double songEnd, const std::vector<Channel*>& channels)
+{
+  if (end <= 0 || end > songEnd) {
+    end = songEnd;
+  }
+  if (end < start) {
+    end = start;
+  }
+  double length = end - start;
+  totalFrames = std::llround(length * sampleRate);
+
+  windowSynth.reset(new SynthContext(ctx, sampleRate));
+  for (int i = 0; i < timeline.numTracks(); i++) {
+    std::unique_ptr<BasicTrack> window(timeline.windowTrack(i, start, end));
+    BasicTrack* shifted = new BasicTrack;
+    while (!window->isFinished()) {
+      std::shared_ptr<SequenceEvent> event = window->nextEvent();
+      if (!event) {
+        break;
+      } else if (event->timestamp >= end) {
+        // Nothing after the end is rendered
+        continue;
+      }
+      if (SampleEvent* sampleEvent = dynamic_cast<SampleEvent*>(event.get())) {
+        SampleData* sample = ctx->getSample(sampleEvent->sampleID);
+        double offset = start - sampleEvent->timestamp;
+        if (offset > 0 && !sample) {
+          continue;
+        }
+        SampleEvent* copy = new SampleEvent(*sampleEvent);
+        double remaining = copy->duration > 0 ? copy->duration : sample ? sample->duration() : 0;
+        if (offset > 0) {
+          copy->sampleID = trimSample(sample, offset, length);
+          copy->timestamp = 0;
+          remaining -= offset;
+          if (copy->duration > 0) {
+            copy->duration = remaining;
+          }
+        } else {
+          copy->timestamp -= start;
+        }
+        if (copy->timestamp + remaining > length) {
+          copy->duration = length - copy->timestamp;
+        }
+        shifted->addEvent(copy);
+      } else if (KillEvent* kill = dynamic_cast<KillEvent*>(event.get())) {
+        KillEvent* copy = new KillEvent(*kill);
+        copy->timestamp = std::max(0.0, copy->timestamp - start);
+        shifted->addEvent(copy);
+      }
+    }
+    tracks.emplace_back(shifted);
+    windowSynth->addChannel(shifted);
+    if (i < channels.size()) {
+      Channel* channel = windowSynth->channel(windowSynth->numChannels() - 1);
+      channel->gain = channels[i]->gain;
+      channel->pan = channels[i]->pan;
+    }
+  }
+}
+
+RenderWindow::~RenderWindow()
+{
+  // The copies stay registered with the context, but with no PCM, until
+  // another window reuses them
+  for (uint64_t sampleID : trimmed) {
+    SampleData* sample = ctx->getSample(sampleID);
+    if (sample) {
+      std::vector<std::vector<int16_t>>().swap(sample->channels);
+    }
+  }
+  std::lock_guard<std::mutex> lock(freeIDsMutex);
+  std::vector<uint64_t>& freeIDs = freeTrimmedIDs[ctx];
+  freeIDs.insert(freeIDs.end(), trimmed.begin(), trimmed.end());
+}
+
+uint64_t RenderWindow::trimSample(SampleData* sample, double offset, double length)
+{
+  size_t numSamples = sample->numSamples();
+  size_t first = std::min<size_t>(offset * sample->sampleRate, numSamples);
+  int loopStart = -1, loopEnd = -1;
+  std::vector<std::pair<size_t, size_t>> spans;
+  if (sample->loopStart >= 0 && sample->loopEnd > sample->loopStart && size_t(sample->loopEnd) <= numSamples) {
+    size_t loopLength = sample->loopEnd - sample->loopStart;
+    if (first >= size_t(sample->loopEnd)) {
+      first = sample->loopStart + (first - sample->loopStart) % loopLength;
+    }
+    if (first <= size_t(sample->loopStart)) {
+      spans.emplace_back(first, numSamples);
+      loopStart = sample->loopStart - first;
+    } else {
+      // Finish the current pass through the loop, then continue from the
+      // start of the loop as before
+      spans.emplace_back(first, sample->loopEnd);
+      spans.emplace_back(sample->loopStart, numSamples);
+      loopStart = sample->loopEnd - first;
+    }
+    loopEnd = loopStart + loopLength;
+  } else {
+    // Only the part heard in the window is copied
+    spans.emplace_back(first, std::min<size_t>(numSamples, first + size_t(length * sample->sampleRate) + resampleMargin));
+  }
+
+  uint64_t sampleID = takeTrimmedID(ctx);
+  SampleData* copy = ctx->getSample(sampleID);
+  if (copy) {
+    copy->sampleRate = sample->sampleRate;
+    copy->loopStart = loopStart;
+    copy->loopEnd = loopEnd;
+    copy->channels.clear();
+  } else {
+    copy = new SampleData(ctx, sampleID, sample->sampleRate, loopStart, loopEnd);
+  }
+  copy->channels.resize(sample->channels.size());
+  for (size_t i = 0; i < sample->channels.size(); i++) {
+    const std::vector<int16_t>& channel = sample->channels[i];
+    for (const auto& span : spans) {
+      size_t last = std::min(span.second, channel.size());
+      if (span.first < last) {
+        copy->channels[i].insert(copy->channels[i].end(), channel.begin() + span.first, channel.begin() + last);
+      }
+    }
+  }
+  trimmed.push_back(sampleID);
+  return sampleID;
+}
+
+SynthContext* RenderWindow::synth() const
+{
+  return windowSynth.get();
+}
+
+SynthContext* RenderWindow::releaseSynth()
+{
+  return windowSynth.release();
+}
+
+double RenderWindow::duration() const
+{
+  return end - start;
+}
+
+uint64_t RenderWindow::frames() const
+{
+  return totalFrames;
+}
+
+size_t RenderWindow::fillBuffer(int16_t* buffer, size_t numFrames)
+{
+  numFrames = std::min<uint64_t>(numFrames, totalFrames - position);
+  size_t frameBytes = 2 * sizeof(int16_t);
+  size_t written = 0;
+  while (!finished && written < numFrames) {
+    size_t frames = windowSynth->fillBuffer(reinterpret_cast<uint8_t*>(buffer + written * 2), (numFrames - written) * frameBytes) / frameBytes;
+    if (!frames) {
+      finished = true;
+    }
+    written += frames;
+  }
+  std::fill(buffer + written * 2, buffer + numFrames * 2, 0);
+  position += numFrames;
+  return numFrames;
+}
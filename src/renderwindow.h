@@ -0,0 +1,60 @@
+#ifndef B2W_RENDERWINDOW_H
+#define B2W_RENDERWINDOW_H
+
+#include "seq/itrack.h"
+#include <cstdint>
+#include <memory>
+#include <vector>
+class ClefContext;
+class SynthContext;
+class SampleData;
+class Channel;
+class Timeline;
+
+// Plays the part of a song between two times without rendering anything
+// before it. Each unmuted channel of the song's context is rebuilt with
+// only the voices that can be heard in the window, shifted so that the
+// window begins at time zero, and voices still sounding at the end are cut
+// off there. A voice that began before the window plays from a copy of the
+// rest of its sample, so it picks up where it would have been.
+//
+// The copies are registered with the song's context under IDs of their own
+// and their PCM is freed when the window is destroyed, after which later
+// windows on the same context reuse them. Every sample the
+// window plays must already be loaded when it is created, and since
+// creating a window registers samples, windows sharing a context must be
+// created on one thread. Once created, they can render in parallel.
+class RenderWindow {
+public:
+  // An end of zero or less, or past the end of the song, plays to the end.
+  RenderWindow(ClefContext* ctx, SynthContext* song, double start, double end);
+  // Plays every track of the timeline with the default channel settings.
+  RenderWindow(ClefContext* ctx, const Timeline& timeline, double sampleRate, double start, double end);
+  ~RenderWindow();
+
+  SynthContext* synth() const;
+  // Hands the context to the caller. fillBuffer() can't be used afterward.
+  SynthContext* releaseSynth();
+
+  double duration() const;
+  uint64_t frames() const;
+
+  // Fills an interleaved stereo buffer and returns the number of frames
+  // written, or 0 at the end of the window. A window that goes quiet
+  // before its end is padded with silence.
+  size_t fillBuffer(int16_t* buffer, size_t numFrames);
+
+private:
+  void build(const Timeline& timeline, double sampleRate, double songEnd, const std::vector<Channel*>& channels);
+  uint64_t trimSample(SampleData* sample, double offset, double length);
+
+  ClefContext* ctx;
+  double start, end;
+  uint64_t totalFrames, position;
+  bool finished;
+  std::vector<std::unique_ptr<BasicTrack>> tracks;
+  std::vector<uint64_t> trimmed;
+  std::unique_ptr<SynthContext> windowSynth;
+};
+
+#endif
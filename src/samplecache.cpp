@@ -0,0 +1,260 @@
+#include "samplecache.h"
+#include "samplestore.h"
+#include "decodescheduler.h"
+#include "pathutils.h"
+#include "codec/icodec.h"
+#include "codec/sampledata.h"
+#include <algorithm>
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <memory>
+#include <thread>
+#include <sys/stat.h>
+#ifdef _MSC_VER
+#include <sys/utime.h>
+#define utime _utime
+#else
+#include <utime.h>
+#endif
+
+// Bump when a decoder change would make existing entries stale
+static const uint32_t cacheVersion = 1;
+static const size_t headerBytes = 64;
+
+static std::unique_ptr<SampleCache> instance;
+
+struct CacheHeader {
+  char magic[4];
+  uint32_t version;
+  uint64_t sourceBytes;
+  uint64_t key;
+  double sampleRate;
+  uint32_t numChannels;
+  int32_t loopStart;
+  int32_t loopEnd;
+  uint32_t reserved;
+  uint64_t numSamples;
+};
+static_assert(sizeof(CacheHeader) <= headerBytes, "cache header too large");
+
+void SampleCache::configure(const std::string& path, uint64_t maxBytes)
+{
+  if (path.empty() || !maxBytes) {
+    instance.reset();
+    return;
+  }
+  instance.reset(new SampleCache(path, maxBytes));
+}
+
+std::string SampleCache::defaultPath()
+{
+  std::string base = userCacheDirectory();
+#ifdef _WIN32
+  return base.empty() ? base : base + "\\samples";
+#else
+  return base.empty() ? base : base + "/samples";
+#endif
+}
+
+uint64_t SampleCache::hash(std::vector<uint8_t>::const_iterator start, std::vector<uint8_t>::const_iterator end, const std::string& params)
+{
+  // 64-bit FNV-1a
+  uint64_t hash = 14695981039346656037ULL;
+  for (char ch : params) {
+    hash = (hash ^ uint8_t(ch)) * 1099511628211ULL;
+  }
+  hash = (hash ^ 0) * 1099511628211ULL;
+  for (auto iter = start; iter != end; ++iter) {
+    hash = (hash ^ *iter) * 1099511628211ULL;
+  }
+  return hash;
+}
+
+SampleData* SampleCache::decode(ICodec* codec, const std::string& params, const std::vector<uint8_t>& data, uint64_t sampleID)
+{
+  return decode(codec, params, data.begin(), data.end(), sampleID);
+}
+
+SampleData* SampleCache::decode(ICodec* codec, const std::string& params,
+    std::vector<uint8_t>::const_iterator start, std::vector<uint8_t>::const_iterator end, uint64_t sampleID)
+{
+  DecodeScheduler* scheduler = DecodeScheduler::forContext(codec->context());
+  if (scheduler) {
+    scheduler->defer(params, start, end, sampleID);
+    return nullptr;
+  }
+  SampleCache* cache = instance.get();
+  SampleStore* store = SampleStore::get();
+  if (!cache && !store) {
+    return codec->decodeRange(start, end, sampleID);
+  }
+  uint64_t key = hash(start, end, params);
+  auto decodeEntry = [=]() -> SampleData* {
+    if (!cache) {
+      return codec->decodeRange(start, end, sampleID);
+    }
+    SampleData* sample = cache->load(codec->context(), key, end - start, sampleID);
+    if (sample) {
+      return sample;
+    }
+    sample = codec->decodeRange(start, end, sampleID);
+    if (sample) {
+      cache->store(key, end - start, sample);
+    }
+    return sample;
+  };
+  if (store) {
+    return store->acquire(codec->context(), key, end - start, sampleID, decodeEntry);
+  }
+  return decodeEntry();
+}
+
+SampleCache::SampleCache(const std::string& path, uint64_t maxBytes)
+: path(path), maxBytes(maxBytes), totalBytes(0), scanned(false)
+{
+  // initializers only
+}
+
+std::string SampleCache::entryPath(uint64_t key) const
+{
+  char name[32];
+  std::snprintf(name, sizeof(name), "%02x/%016llx.pcm", unsigned(key >> 56), (unsigned long long)key);
+  return path + "/" + name;
+}
+
+SampleData* SampleCache::load(ClefContext* ctx, uint64_t key, uint64_t sourceBytes, uint64_t sampleID)
+{
+  std::string filename = entryPath(key);
+  std::ifstream file(filename, std::ios::in | std::ios::binary);
+  if (!file) {
+    return nullptr;
+  }
+  char buffer[headerBytes];
+  CacheHeader header;
+  if (!file.read(buffer, headerBytes)) {
+    return nullptr;
+  }
+  std::memcpy(&header, buffer, sizeof(header));
+  if (std::memcmp(header.magic, "B2WS", 4) != 0 || header.version != cacheVersion || header.key != key ||
+      header.sourceBytes != sourceBytes || header.numChannels < 1 || header.numChannels > 8) {
+    return nullptr;
+  }
+  std::vector<std::vector<int16_t>> channels(header.numChannels);
+  for (auto& channel : channels) {
+    channel.resize(header.numSamples);
+    if (!file.read(reinterpret_cast<char*>(channel.data()), header.numSamples * sizeof(int16_t))) {
+      return nullptr;
+    }
+  }
+  // Refresh the entry's position in the eviction order
+  utime(filename.c_str(), nullptr);
+  SampleData* sample = new SampleData(ctx, sampleID, header.sampleRate, header.loopStart, header.loopEnd);
+  sample->channels.swap(channels);
+  return sample;
+}
+
+void SampleCache::store(uint64_t key, uint64_t sourceBytes, const SampleData* sample)
+{
+  std::string filename = entryPath(key);
+  createParentDirectories(filename);
+
+  CacheHeader header;
+  std::memset(&header, 0, sizeof(header));
+  std::memcpy(header.magic, "B2WS", 4);
+  header.version = cacheVersion;
+  header.sourceBytes = sourceBytes;
+  header.key = key;
+  header.sampleRate = sample->sampleRate;
+  header.numChannels = sample->channels.size();
+  header.loopStart = sample->loopStart;
+  header.loopEnd = sample->loopEnd;
+  header.numSamples = sample->channels.empty() ? 0 : sample->channels[0].size();
+  char buffer[headerBytes] = { 0 };
+  std::memcpy(buffer, &header, sizeof(header));
+
+  // Written under a unique name and renamed into place so that concurrent
+  // readers never see a partial entry.
+  static std::atomic<uint32_t> counter(0);
+  std::string tempName = filename + "." + std::to_string(std::hash<std::thread::id>()(std::this_thread::get_id()) & 0xFFFFFF) +
+    "-" + std::to_string(counter++) + ".tmp";
+  uint64_t bytes = headerBytes;
+  {
+    std::ofstream file(tempName, std::ios::out | std::ios::binary | std::ios::trunc);
+    file.write(buffer, headerBytes);
+    for (const auto& channel : sample->channels) {
+      file.write(reinterpret_cast<const char*>(channel.data()), header.numSamples * sizeof(int16_t));
+      bytes += header.numSamples * sizeof(int16_t);
+    }
+    if (!file) {
+      file.close();
+      std::remove(tempName.c_str());
+      return;
+    }
+  }
+  std::remove(filename.c_str());
+  if (std::rename(tempName.c_str(), filename.c_str()) != 0) {
+    std::remove(tempName.c_str());
+    return;
+  }
+
+  std::lock_guard<std::mutex> lock(mutex);
+  if (!scanned) {
+    scan();
+  } else {
+    totalBytes += bytes;
+  }
+  if (totalBytes > maxBytes) {
+    evict();
+  }
+}
+
+void SampleCache::scan()
+{
+  totalBytes = 0;
+  for (const std::string& dir : listDirectory(path)) {
+    for (const std::string& name : listDirectory(path + "/" + dir)) {
+      struct stat info;
+      if (stat((path + "/" + dir + "/" + name).c_str(), &info) == 0) {
+        totalBytes += info.st_size;
+      }
+    }
+  }
+  scanned = true;
+}
+
+void SampleCache::evict()
+{
+  struct Entry {
+    std::string filename;
+    time_t lastUsed;
+    uint64_t bytes;
+  };
+  std::vector<Entry> entries;
+  totalBytes = 0;
+  for (const std::string& dir : listDirectory(path)) {
+    for (const std::string& name : listDirectory(path + "/" + dir)) {
+      std::string filename = path + "/" + dir + "/" + name;
+      struct stat info;
+      if (stat(filename.c_str(), &info) == 0) {
+        entries.push_back(Entry{ filename, info.st_mtime, uint64_t(info.st_size) });
+        totalBytes += info.st_size;
+      }
+    }
+  }
+  std::sort(entries.begin(), entries.end(), [](const Entry& lhs, const Entry& rhs) {
+    return lhs.lastUsed < rhs.lastUsed;
+  });
+  // Trim below the limit so that eviction doesn't run on every store
+  uint64_t target = maxBytes - maxBytes / 10;
+  for (const Entry& entry : entries) {
+    if (totalBytes <= target) {
+      break;
+    }
+    if (std::remove(entry.filename.c_str()) == 0) {
+      totalBytes -= entry.bytes;
+    }
+  }
+}
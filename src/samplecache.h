@@ -0,0 +1,48 @@
+#ifndef B2W_SAMPLECACHE_H
+#define B2W_SAMPLECACHE_H
+
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <vector>
+class ClefContext;
+class ICodec;
+class SampleData;
+
+// A persistent cache of decoded samples, keyed by a hash of the compressed
+// data and the codec parameters. Each entry is a small header followed by
+// the PCM for each channel stored contiguously, so an entry can be read or
+// mapped directly into sample buffers. Entries are evicted least recently
+// used first once the cache grows past its size limit.
+class SampleCache {
+public:
+  // Decodes through the in-memory sample store and the disk cache if either
+  // is enabled, otherwise decodes directly. Returns null without decoding
+  // if a DecodeScheduler is attached to the codec's context.
+  // params must describe every codec setting that affects the output.
+  static SampleData* decode(ICodec* codec, const std::string& params,
+      std::vector<uint8_t>::const_iterator start, std::vector<uint8_t>::const_iterator end, uint64_t sampleID = 0);
+  static SampleData* decode(ICodec* codec, const std::string& params, const std::vector<uint8_t>& data, uint64_t sampleID = 0);
+
+  static void configure(const std::string& path, uint64_t maxBytes);
+  static std::string defaultPath();
+
+  static uint64_t hash(std::vector<uint8_t>::const_iterator start, std::vector<uint8_t>::const_iterator end, const std::string& params);
+
+private:
+  SampleCache(const std::string& path, uint64_t maxBytes);
+
+  std::string entryPath(uint64_t key) const;
+  SampleData* load(ClefContext* ctx, uint64_t key, uint64_t sourceBytes, uint64_t sampleID);
+  void store(uint64_t key, uint64_t sourceBytes, const SampleData* sample);
+  void scan();
+  void evict();
+
+  std::string path;
+  uint64_t maxBytes;
+  uint64_t totalBytes;
+  bool scanned;
+  std::mutex mutex;
+};
+
+#endif
@@ -0,0 +1,90 @@
+#include "samplereleaser.h"
+#include "timeline.h"
+#include "clefcontext.h"
+#include "samplestore.h"
+#include "codec/sampledata.h"
+#include <algorithm>
+#include <iomanip>
+#include <memory>
+#include <unordered_map>
+
+// Voices may keep reading a little past their resolved end (release
+// envelopes, kill fades), so samples are kept for a while longer.
+static const double releaseMargin = 2.0;
+static const double snapshotInterval = 10.0;
+
+static uint64_t pcmBytes(const SampleData* sample)
+{
+  uint64_t bytes = 0;
+  for (const auto& channel : sample->channels) {
+    bytes += channel.size() * sizeof(int16_t);
+  }
+  return bytes;
+}
+
+SampleReleaser::SampleReleaser(ClefContext* ctx, const std::vector<ITrack*>& tracks)
+: ctx(ctx), nextRelease(0), resident(0), nextSnapshot(0)
+{
+  Timeline spans(ctx, tracks);
+  std::unordered_map<uint64_t, double> lastUse;
+  for (const Timeline::Voice& voice : spans.voices()) {
+    double& end = lastUse[voice.sampleID];
+    end = std::max(end, std::max(voice.start, voice.end));
+  }
+  for (const auto& iter : lastUse) {
+    SampleData* sample = ctx->getSample(iter.first);
+    if (sample) {
+      resident += pcmBytes(sample);
+      releases.emplace_back(iter.second + releaseMargin, iter.first);
+    }
+  }
+  std::sort(releases.begin(), releases.end());
+}
+
+RenderPipeline::Producer SampleReleaser::wrap(const RenderPipeline::Producer& producer, double sampleRate)
+{
+  std::shared_ptr<uint64_t> position(new uint64_t(0));
+  return [this, producer, sampleRate, position](int16_t* buffer, size_t frames) -> size_t {
+    size_t written = producer(buffer, frames);
+    *position += written;
+    advance(*position / sampleRate);
+    return written;
+  };
+}
+
+void SampleReleaser::advance(double time)
+{
+  while (nextRelease < releases.size() && releases[nextRelease].first <= time) {
+    SampleData* sample = ctx->getSample(releases[nextRelease++].second);
+    if (sample) {
+      resident -= pcmBytes(sample);
+      if (SampleStore* store = SampleStore::get()) {
+        // A shared keysound goes back to the store for the next song
+        store->unload(sample);
+      } else {
+        std::vector<std::vector<int16_t>>().swap(sample->channels);
+      }
+    }
+  }
+  while (nextSnapshot <= time) {
+    timeline.emplace_back(nextSnapshot, resident);
+    nextSnapshot += snapshotInterval;
+  }
+}
+
+uint64_t SampleReleaser::residentBytes() const
+{
+  return resident;
+}
+
+void SampleReleaser::printTimeline(std::ostream& stream) const
+{
+  std::ios::fmtflags flags = stream.flags();
+  std::streamsize precision = stream.precision();
+  stream << "Resident sample memory:" << std::endl << std::fixed << std::setprecision(1);
+  for (const auto& snapshot : timeline) {
+    stream << std::setw(8) << snapshot.first << "s " << std::setw(8) << (snapshot.second / 1048576.0) << " MB" << std::endl;
+  }
+  stream.flags(flags);
+  stream.precision(precision);
+}
@@ -0,0 +1,41 @@
+#ifndef B2W_SAMPLERELEASER_H
+#define B2W_SAMPLERELEASER_H
+
+#include "renderpipeline.h"
+#include "seq/itrack.h"
+#include <cstdint>
+#include <iostream>
+#include <utility>
+#include <vector>
+class ClefContext;
+
+// Frees the decoded PCM of each sample once a streaming render has passed
+// the last point where any voice could still be playing it. The sample
+// stays registered with the context, but with no channel data.
+//
+// Release points come from the same voice spans that Timeline resolves,
+// so the tracks must include every track the renderer will play, muted
+// or not.
+class SampleReleaser {
+public:
+  SampleReleaser(ClefContext* ctx, const std::vector<ITrack*>& tracks);
+
+  // Returns a producer that releases samples as the render advances.
+  RenderPipeline::Producer wrap(const RenderPipeline::Producer& producer, double sampleRate);
+
+  // Releases every sample no longer needed at the given song time.
+  void advance(double time);
+
+  uint64_t residentBytes() const;
+  void printTimeline(std::ostream& stream) const;
+
+private:
+  ClefContext* ctx;
+  std::vector<std::pair<double, uint64_t>> releases;
+  size_t nextRelease;
+  uint64_t resident;
+  double nextSnapshot;
+  std::vector<std::pair<double, uint64_t>> timeline;
+};
+
+#endif
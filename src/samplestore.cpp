@@ -0,0 +1,269 @@
+#include "samplestore.h"
+#include "clefcontext.h"
+#include "codec/sampledata.h"
+#include <iomanip>
+
+static std::unique_ptr<SampleStore> instance;
+
+static uint64_t pcmBytes(const std::vector<std::vector<int16_t>>& channels)
+{
+  uint64_t bytes = 0;
+  for (const auto& channel : channels) {
+    bytes += channel.size() * sizeof(int16_t);
+  }
+  return bytes;
+}
+
+void SampleStore::enable(uint64_t idleLimit)
+{
+  if (!instance) {
+    instance.reset(new SampleStore(idleLimit));
+  }
+}
+
+SampleStore* SampleStore::get()
+{
+  return instance.get();
+}
+
+SampleStore::SampleStore(uint64_t idleLimit)
+: idleLimit(idleLimit), idleBytes(0), requests(0), shared(0), requestedBytes(0), decodedBytes(0), residentBytes(0)
+{
+  // initializers only
+}
+
+void SampleStore::lend(ClefContext* ctx, bool borrow)
+{
+  std::lock_guard<std::mutex> lock(mutex);
+  if (borrow) {
+    borrowers.insert(ctx);
+  } else {
+    borrowers.erase(ctx);
+  }
+}
+
+SampleData* SampleStore::acquire(ClefContext* ctx, uint64_t key, uint64_t sourceBytes, uint64_t sampleID, const std::function<SampleData*()>& decode)
+{
+  std::shared_ptr<Entry> entry;
+  {
+    std::unique_lock<std::mutex> lock(mutex);
+    while (!entry) {
+      auto iter = entries.find(key);
+      if (iter == entries.end()) {
+        entry = std::make_shared<Entry>();
+        entry->sourceBytes = sourceBytes;
+        entries[key] = entry;
+      } else if (iter->second->sourceBytes != sourceBytes) {
+        // Hash collision with a different payload; don't share
+        lock.unlock();
+        return decode();
+      } else if (iter->second->ready) {
+        Entry& stored = *iter->second;
+        if (holders[ctx].emplace(key, sampleID).second && stored.refs++ == 0 && stored.idle) {
+          idle.erase(stored.idlePos);
+          idleBytes -= stored.bytes;
+          stored.idle = false;
+        }
+        requests++;
+        shared++;
+        requestedBytes += stored.bytes;
+        // The buffer may be lent to a sample that's rendering, which only
+        // reads it, so it's copied under the lock
+        SampleData* sample = new SampleData(ctx, sampleID, stored.sampleRate, stored.loopStart, stored.loopEnd);
+        fill(sample, ctx, key, stored);
+        return sample;
+      } else {
+        // Another song is decoding the same payload
+        decoded.wait(lock);
+      }
+    }
+  }
+
+  SampleData* sample = nullptr;
+  try {
+    sample = decode();
+  } catch (...) {
+    std::lock_guard<std::mutex> lock(mutex);
+    entries.erase(key);
+    decoded.notify_all();
+    throw;
+  }
+  std::lock_guard<std::mutex> lock(mutex);
+  if (!sample) {
+    entries.erase(key);
+  } else {
+    entry->sampleRate = sample->sampleRate;
+    entry->loopStart = sample->loopStart;
+    entry->loopEnd = sample->loopEnd;
+    entry->bytes = pcmBytes(sample->channels);
+    entry->ready = true;
+    entry->refs = 1;
+    holders[ctx][key] = sampleID;
+    if (borrowers.count(ctx)) {
+      // The decoded sample already holds the only copy
+      entry->lentTo = sample;
+      entry->lentCtx = ctx;
+      lent[sample] = key;
+    } else {
+      entry->pcm = sample->channels;
+    }
+    requests++;
+    requestedBytes += entry->bytes;
+    decodedBytes += entry->bytes;
+    residentBytes += entry->bytes;
+  }
+  decoded.notify_all();
+  return sample;
+}
+
+// Only called with the mutex held
+void SampleStore::fill(SampleData* sample, ClefContext* ctx, uint64_t key, Entry& entry)
+{
+  auto held = holders.find(ctx);
+  bool holder = held != holders.end() && held->second.count(key) && held->second.at(key) == sample->sampleID;
+  if (!entry.lentTo && holder && borrowers.count(ctx)) {
+    sample->channels.swap(entry.pcm);
+    entry.lentTo = sample;
+    entry.lentCtx = ctx;
+    lent[sample] = key;
+  } else {
+    sample->channels = entry.lentTo ? entry.lentTo->channels : entry.pcm;
+  }
+}
+
+// Only called with the mutex held. Returns false if the sample wasn't lent
+// a buffer.
+bool SampleStore::giveBack(SampleData* sample)
+{
+  auto iter = lent.find(sample);
+  if (iter == lent.end()) {
+    return false;
+  }
+  auto entry = entries.find(iter->second);
+  if (entry != entries.end() && entry->second->lentTo == sample) {
+    entry->second->pcm.swap(sample->channels);
+    entry->second->lentTo = nullptr;
+    entry->second->lentCtx = nullptr;
+  }
+  PCM().swap(sample->channels);
+  lent.erase(iter);
+  return true;
+}
+
+void SampleStore::release(ClefContext* ctx)
+{
+  std::lock_guard<std::mutex> lock(mutex);
+  auto iter = holders.find(ctx);
+  if (iter == holders.end()) {
+    return;
+  }
+  for (const auto& held : iter->second) {
+    SampleData* sample = ctx->getSample(held.second);
+    if (sample) {
+      giveBack(sample);
+    }
+    auto entry = entries.find(held.first);
+    if (entry != entries.end() && entry->second->lentCtx == ctx && entry->second->lentTo) {
+      // The borrowing sample was purged along with the buffer
+      lent.erase(entry->second->lentTo);
+      residentBytes -= entry->second->bytes;
+      entries.erase(entry);
+    }
+    releaseEntry(held.first);
+  }
+  holders.erase(iter);
+}
+
+void SampleStore::unload(ClefContext* ctx)
+{
+  std::lock_guard<std::mutex> lock(mutex);
+  auto iter = holders.find(ctx);
+  if (iter == holders.end()) {
+    return;
+  }
+  for (const auto& held : iter->second) {
+    SampleData* sample = ctx->getSample(held.second);
+    if (sample && !giveBack(sample)) {
+      PCM().swap(sample->channels);
+    }
+  }
+}
+
+void SampleStore::reload(ClefContext* ctx)
+{
+  std::lock_guard<std::mutex> lock(mutex);
+  auto iter = holders.find(ctx);
+  if (iter == holders.end()) {
+    return;
+  }
+  for (const auto& held : iter->second) {
+    SampleData* sample = ctx->getSample(held.second);
+    auto entry = entries.find(held.first);
+    if (sample && sample->channels.empty() && entry != entries.end()) {
+      fill(sample, ctx, held.first, *entry->second);
+    }
+  }
+}
+
+void SampleStore::unload(SampleData* sample)
+{
+  std::lock_guard<std::mutex> lock(mutex);
+  if (!giveBack(sample)) {
+    PCM().swap(sample->channels);
+  }
+}
+
+uint64_t SampleStore::storedBytes()
+{
+  std::lock_guard<std::mutex> lock(mutex);
+  return residentBytes;
+}
+
+void SampleStore::releaseEntry(uint64_t key)
+{
+  auto iter = entries.find(key);
+  if (iter == entries.end() || --iter->second->refs > 0) {
+    return;
+  }
+  Entry& entry = *iter->second;
+  if (entry.bytes > idleLimit) {
+    residentBytes -= entry.bytes;
+    entries.erase(iter);
+    return;
+  }
+  // Kept for the next song that uses it
+  entry.idle = true;
+  entry.idlePos = idle.insert(idle.end(), key);
+  idleBytes += entry.bytes;
+  evictIdle();
+}
+
+void SampleStore::evictIdle()
+{
+  while (idleBytes > idleLimit && !idle.empty()) {
+    auto iter = entries.find(idle.front());
+    idle.pop_front();
+    if (iter != entries.end()) {
+      idleBytes -= iter->second->bytes;
+      residentBytes -= iter->second->bytes;
+      entries.erase(iter);
+    }
+  }
+}
+
+void SampleStore::report(std::ostream& stream)
+{
+  std::lock_guard<std::mutex> lock(mutex);
+  if (!requests) {
+    return;
+  }
+  double ratio = decodedBytes ? double(requestedBytes) / decodedBytes : 1.0;
+  std::ios::fmtflags flags = stream.flags();
+  std::streamsize precision = stream.precision();
+  stream << std::fixed << std::setprecision(1) << "Keysound dedup: " << shared << " of " << requests << " samples shared, "
+    << (decodedBytes / 1048576.0) << " MB decoded for " << (requestedBytes / 1048576.0) << " MB used (ratio "
+    << std::setprecision(2) << ratio << ":1), " << std::setprecision(1) << (residentBytes / 1048576.0) << " MB resident, "
+    << (idleBytes / 1048576.0) << " MB kept for later songs" << std::endl;
+  stream.flags(flags);
+  stream.precision(precision);
+}
@@ -0,0 +1,104 @@
+#ifndef B2W_SAMPLESTORE_H
+#define B2W_SAMPLESTORE_H
+
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <iostream>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+class ClefContext;
+class SampleData;
+
+// An in-memory store of decoded samples shared by every song loaded in the
+// process, keyed by the same content hash as the sample cache. When several
+// songs use identical keysounds, the payload is decoded once into a single
+// buffer.
+//
+// A context can only play PCM held by its own samples, so the buffer is
+// lent to a sample of the first context that asks for it, without copying,
+// and goes back to the store when that context unloads or releases it.
+// Only contexts that call lend() borrow buffers; any other context, or one
+// asking while the buffer is lent out, receives a copy. A context that
+// isn't rendering can drop its samples' PCM with unload() and take it back
+// with reload(), leaving the stored buffer as the only resident PCM.
+//
+// Each context holds a reference to the entries it used until it releases
+// them. Entries that no context refers to are kept, oldest first, until
+// they take more than the idle limit given to enable().
+class SampleStore {
+public:
+  static void enable(uint64_t idleLimit = 0);
+  static SampleStore* get();
+
+  // Lets the samples of ctx borrow stored buffers, until called again with
+  // false, which must happen before ctx is destroyed. The PCM of its
+  // samples must then only be freed or moved through the store.
+  void lend(ClefContext* ctx, bool borrow = true);
+
+  // Returns a sample registered with ctx holding the PCM stored for key,
+  // calling decode to produce it if no other context has done so yet.
+  SampleData* acquire(ClefContext* ctx, uint64_t key, uint64_t sourceBytes, uint64_t sampleID, const std::function<SampleData*()>& decode);
+
+  // Drops every reference held by ctx and takes back the buffers its
+  // samples borrowed. Call before purging its samples.
+  void release(ClefContext* ctx);
+
+  // Frees the PCM of ctx's samples that came from the store, keeping their
+  // references, and puts it back again. Samples must not be playing while
+  // they are unloaded.
+  void unload(ClefContext* ctx);
+  void reload(ClefContext* ctx);
+
+  // Frees the PCM of one sample, returning it to the store if it was lent.
+  void unload(SampleData* sample);
+
+  // The bytes of PCM held by the store itself
+  uint64_t storedBytes();
+
+  void report(std::ostream& stream);
+
+private:
+  typedef std::vector<std::vector<int16_t>> PCM;
+
+  struct Entry {
+    uint64_t sourceBytes = 0;
+    uint64_t bytes = 0;
+    bool ready = false;
+    int refs = 0;
+    double sampleRate = 0;
+    int loopStart = -1;
+    int loopEnd = -1;
+    // Empty while lent to a sample
+    PCM pcm;
+    SampleData* lentTo = nullptr;
+    ClefContext* lentCtx = nullptr;
+    bool idle = false;
+    std::list<uint64_t>::iterator idlePos;
+  };
+
+  SampleStore(uint64_t idleLimit);
+  void fill(SampleData* sample, ClefContext* ctx, uint64_t key, Entry& entry);
+  bool giveBack(SampleData* sample);
+  void releaseEntry(uint64_t key);
+  void evictIdle();
+
+  std::mutex mutex;
+  std::condition_variable decoded;
+  std::unordered_map<uint64_t, std::shared_ptr<Entry>> entries;
+  // The keys each context refers to, with the ID of its sample for each
+  std::unordered_map<ClefContext*, std::unordered_map<uint64_t, uint64_t>> holders;
+  std::unordered_set<ClefContext*> borrowers;
+  // The samples holding stored buffers, with the key of each
+  std::unordered_map<SampleData*, uint64_t> lent;
+  // Entries no context refers to, oldest first
+  std::list<uint64_t> idle;
+  uint64_t idleLimit, idleBytes;
+  uint64_t requests, shared, requestedBytes, decodedBytes, residentBytes;
+};
+
+#endif
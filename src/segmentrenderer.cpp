@@ -0,0 +1,188 @@
+#include "segmentrenderer.h"
+#include "synth/synthcontext.h"
+#include <atomic>
+#include <thread>
+#include <algorithm>
+#include <cstdlib>
+#include <limits>
+
+// Segments and the serial render both fill buffers of this size, so that
+// every context sees the same blocks.
+static const size_t blockFrames = 4096;
+
+struct SegmentRenderer::Segment {
+  size_t start, end;
+  std::vector<std::unique_ptr<ITrack>> tracks;
+  std::unique_ptr<SynthContext> synth;
+  std::vector<int16_t> left, right;
+};
+
+SegmentRenderer::SegmentRenderer(ClefContext* ctx, double sampleRate, const std::vector<ITrack*>& tracks)
+: sampleRate(sampleRate), ctx(ctx), tracks(tracks), timeline(ctx, tracks)
+{
+  // initializers only
+}
+
+SegmentRenderer::~SegmentRenderer()
+{
+  // defined here, where Segment is complete
+}
+
+std::vector<size_t> SegmentRenderer::findBoundaries(size_t numSegments) const
+{
+  // Merge the voices into the spans of time where anything is sounding
+  std::vector<Timeline::Voice> voices = timeline.voices();
+  std::sort(voices.begin(), voices.end(), [](const Timeline::Voice& a, const Timeline::Voice& b) { return a.start < b.start; });
+  std::vector<std::pair<double, double>> spans;
+  for (const Timeline::Voice& voice : voices) {
+    if (voice.end <= voice.start) {
+      continue;
+    } else if (!spans.empty() && voice.start <= spans.back().second) {
+      spans.back().second = std::max(spans.back().second, voice.end);
+    } else {
+      spans.emplace_back(voice.start, voice.end);
+    }
+  }
+
+  // A block of margin on either side covers events that the synthesizer
+  // only acts on at the start of a block
+  double margin = blockFrames / sampleRate;
+  size_t totalFrames = timeline.length() * sampleRate;
+  std::vector<size_t> boundaries;
+  size_t span = 0;
+  for (size_t i = 1; i < numSegments; i++) {
+    size_t frame = (totalFrames * i / numSegments + blockFrames - 1) / blockFrames * blockFrames;
+    if (!boundaries.empty()) {
+      frame = std::max(frame, boundaries.back() + blockFrames);
+    }
+    while (frame < totalFrames) {
+      double time = frame / sampleRate;
+      while (span < spans.size() && spans[span].second + margin <= time) {
+        span++;
+      }
+      if (span == spans.size() || spans[span].first - margin >= time) {
+        break;
+      }
+      // Inside a span, so try the first block after it
+      frame = size_t((spans[span].second + margin) * sampleRate + blockFrames) / blockFrames * blockFrames;
+    }
+    if (frame >= totalFrames) {
+      break;
+    }
+    boundaries.push_back(frame);
+  }
+  return boundaries;
+}
+
+void SegmentRenderer::render(int numThreads)
+{
+  if (numThreads < 1) {
+    numThreads = 1;
+  }
+  // More segments than threads keeps the threads busy when some parts of
+  // the song are denser than others.
+  std::vector<size_t> boundaries = findBoundaries(numThreads > 1 ? numThreads * 4 : 1);
+  boundaries.insert(boundaries.begin(), 0);
+
+  std::vector<Segment> segments(boundaries.size());
+  for (size_t i = 0; i < segments.size(); i++) {
+    Segment& segment = segments[i];
+    segment.start = boundaries[i];
+    // The last segment plays until the song ends, like a serial render
+    segment.end = i + 1 < boundaries.size() ? boundaries[i + 1] : std::numeric_limits<size_t>::max();
+    double start = segment.start / sampleRate;
+    double end = i + 1 < boundaries.size() ? segment.end / sampleRate : std::numeric_limits<double>::infinity();
+    segment.synth.reset(new SynthContext(ctx, sampleRate));
+    for (int j = 0; j < timeline.numTracks(); j++) {
+      segment.tracks.emplace_back(timeline.segmentTrack(j, start, end));
+      segment.synth->addChannel(segment.tracks.back().get());
+    }
+  }
+
+  std::atomic<size_t> nextSegment(0);
+  auto worker = [this, &segments, &nextSegment]{
+    size_t index;
+    while ((index = nextSegment++) < segments.size()) {
+      renderSegment(segments[index]);
+    }
+  };
+  std::vector<std::thread> threads;
+  for (int i = 1; i < numThreads && i < segments.size(); i++) {
+    threads.emplace_back(worker);
+  }
+  worker();
+  for (std::thread& thread : threads) {
+    thread.join();
+  }
+
+  left.clear();
+  right.clear();
+  for (Segment& segment : segments) {
+    left.insert(left.end(), segment.left.begin(), segment.left.end());
+    right.insert(right.end(), segment.right.begin(), segment.right.end());
+  }
+}
+
+void SegmentRenderer::renderSegment(Segment& segment)
+{
+  std::vector<int16_t> buffer(blockFrames * 2);
+  size_t pos = 0;
+  while (pos < segment.end) {
+    size_t bytes = segment.synth->fillBuffer(reinterpret_cast<uint8_t*>(buffer.data()), buffer.size() * sizeof(int16_t));
+    size_t frames = bytes / (2 * sizeof(int16_t));
+    if (!frames) {
+      break;
+    }
+    // Everything before the segment is silent in this context
+    for (size_t i = 0; i < frames && pos < segment.end; i++, pos++) {
+      if (pos >= segment.start) {
+        segment.left.push_back(buffer[i * 2]);
+        segment.right.push_back(buffer[i * 2 + 1]);
+      }
+    }
+  }
+  if (segment.end != std::numeric_limits<size_t>::max()) {
+    // The serial render keeps going through the silence after the voices end
+    segment.left.resize(segment.end - segment.start, 0);
+    segment.right.resize(segment.end - segment.start, 0);
+  }
+  segment.synth.reset();
+}
+
+size_t SegmentRenderer::compareSerial(int& maxDifference)
+{
+  SynthContext synth(ctx, sampleRate);
+  for (ITrack* track : tracks) {
+    track->reset();
+    synth.addChannel(track);
+  }
+  std::vector<int16_t> buffer(blockFrames * 2);
+  size_t pos = 0;
+  size_t mismatched = 0;
+  maxDifference = 0;
+  while (true) {
+    size_t bytes = synth.fillBuffer(reinterpret_cast<uint8_t*>(buffer.data()), buffer.size() * sizeof(int16_t));
+    size_t frames = bytes / (2 * sizeof(int16_t));
+    if (!frames) {
+      break;
+    }
+    for (size_t i = 0; i < frames; i++, pos++) {
+      if (pos >= left.size()) {
+        mismatched++;
+        continue;
+      }
+      int difference = std::max(std::abs(left[pos] - buffer[i * 2]), std::abs(right[pos] - buffer[i * 2 + 1]));
+      maxDifference = std::max(maxDifference, difference);
+      if (difference) {
+        mismatched++;
+      }
+    }
+  }
+  if (pos < left.size()) {
+    mismatched += left.size() - pos;
+  }
+  for (ITrack* track : tracks) {
+    track->reset();
+  }
+  return mismatched;
+}
@@ -0,0 +1,47 @@
+#ifndef B2W_SEGMENTRENDERER_H
+#define B2W_SEGMENTRENDERER_H
+
+#include "timeline.h"
+#include <cstdint>
+#include <memory>
+#include <vector>
+class ClefContext;
+class SynthContext;
+
+// Renders a song by splitting it into segments of time and rendering each
+// segment on its own thread, with output identical to a serial render.
+//
+// Segments only begin at block boundaries where no voice is sounding, so
+// no voice has to be resumed partway through. Each segment has a context
+// of its own that plays the voices starting in the segment along with
+// every event that doesn't start a voice, and it renders from the start of
+// the song in the same blocks as a serial render, discarding the silence
+// before the segment. A song with no silent boundaries renders serially.
+class SegmentRenderer {
+public:
+  SegmentRenderer(ClefContext* ctx, double sampleRate, const std::vector<ITrack*>& tracks);
+  ~SegmentRenderer();
+
+  void render(int numThreads);
+
+  // Renders the tracks again on one thread, the way a render without
+  // segments would, and compares the result with the last call to render().
+  // Returns the number of frames that differ, counting any difference in
+  // length.
+  size_t compareSerial(int& maxDifference);
+
+  double sampleRate;
+  std::vector<int16_t> left, right;
+
+private:
+  struct Segment;
+
+  std::vector<size_t> findBoundaries(size_t numSegments) const;
+  void renderSegment(Segment& segment);
+
+  ClefContext* ctx;
+  std::vector<ITrack*> tracks;
+  Timeline timeline;
+};
+
+#endif
@@ -0,0 +1,159 @@
+#include "timeline.h"
+#include "clefcontext.h"
+#include "codec/sampledata.h"
+#include <algorithm>
+
+// How long a voice keeps sounding after it's stopped. The channel only
+// fades a voice out if its event has an envelope, and otherwise cuts it
+// off right away.
+static double releaseTime(const SampleEvent* event)
+{
+  return event->useEnvelope ? std::max(0.0, event->release) : 0.0;
+}
+
+namespace {
+// Plays events shared with a timeline instead of copies of them, since
+// events of any type can be shared but only known types can be copied.
+class SharedEventTrack : public ITrack {
+public:
+  SharedEventTrack(double trackLength)
+  : trackLength(trackLength), next(0)
+  {
+    // initializers only
+  }
+
+  bool isFinished() const
+  {
+    return next >= events.size();
+  }
+
+  double length() const
+  {
+    return trackLength;
+  }
+
+  std::vector<std::shared_ptr<SequenceEvent>> events;
+
+protected:
+  std::shared_ptr<SequenceEvent> readNextEvent()
+  {
+    return next < events.size() ? events[next++] : nullptr;
+  }
+
+  void internalReset()
+  {
+    next = 0;
+  }
+
+private:
+  double trackLength;
+  size_t next;
+};
+}
+
+Timeline::Timeline(ClefContext* ctx, const std::vector<ITrack*>& tracks)
+: events(tracks.size()), eventVoices(tracks.size()), lengths(tracks.size())
+{
+  for (int i = 0; i < tracks.size(); i++) {
+    ITrack* track = tracks[i];
+    lengths[i] = track->length();
+    // Playback IDs can be reused, so a kill applies to the most recent
+    // voice started with its ID on the same track
+    std::unordered_map<uint64_t, int> playing;
+    std::unordered_map<int, double> releases;
+    track->reset();
+    while (!track->isFinished()) {
+      std::shared_ptr<SequenceEvent> event = track->nextEvent();
+      if (!event) {
+        break;
+      }
+      int voiceIndex = -1;
+      if (SampleEvent* sampleEvent = dynamic_cast<SampleEvent*>(event.get())) {
+        double release = releaseTime(sampleEvent);
+        double end = sampleEvent->timestamp + sampleEvent->duration + release;
+        if (sampleEvent->duration <= 0) {
+          SampleData* sample = ctx->getSample(sampleEvent->sampleID);
+          end = sampleEvent->timestamp + (sample ? sample->duration() : 0);
+        }
+        voiceIndex = _voices.size();
+        playing[sampleEvent->playbackID] = voiceIndex;
+        releases[voiceIndex] = release;
+        _voices.push_back(Voice{ sampleEvent->timestamp, end, sampleEvent->sampleID, sampleEvent->playbackID, i });
+      } else if (KillEvent* kill = dynamic_cast<KillEvent*>(event.get())) {
+        auto iter = playing.find(kill->playbackID);
+        if (iter != playing.end()) {
+          voiceIndex = iter->second;
+          Voice& voice = _voices[voiceIndex];
+          voice.end = std::min(voice.end, kill->timestamp + releases[voiceIndex]);
+        }
+      }
+      events[i].push_back(event);
+      eventVoices[i].push_back(voiceIndex);
+    }
+    track->reset();
+  }
+}
+
+int Timeline::numTracks() const
+{
+  return events.size();
+}
+
+const std::vector<Timeline::Voice>& Timeline::voices() const
+{
+  return _voices;
+}
+
+double Timeline::length() const
+{
+  double maxEnd = 0;
+  for (const Voice& voice : _voices) {
+    if (voice.end > maxEnd) {
+      maxEnd = voice.end;
+    }
+  }
+  return maxEnd;
+}
+
+BasicTrack* Timeline::windowTrack(int track, double start, double end) const
+{
+  BasicTrack* window = new BasicTrack;
+  bool keepAlive = false;
+  for (size_t i = 0; i < events[track].size(); i++) {
+    SequenceEvent* event = events[track][i].get();
+    int voiceIndex = eventVoices[track][i];
+    if (voiceIndex < 0) {
+      continue;
+    }
+    const Voice& voice = _voices[voiceIndex];
+    if (SampleEvent* sampleEvent = dynamic_cast<SampleEvent*>(event)) {
+      if (voice.start >= end) {
+        // One event past the end keeps the track from finishing early,
+        // so that the window doesn't stop before the full render would.
+        if (!keepAlive) {
+          window->addEvent(new SampleEvent(*sampleEvent));
+          keepAlive = true;
+        }
+      } else if (voice.end > start) {
+        window->addEvent(new SampleEvent(*sampleEvent));
+      }
+    } else if (KillEvent* kill = dynamic_cast<KillEvent*>(event)) {
+      if (voice.start < end && voice.end > start) {
+        window->addEvent(new KillEvent(*kill));
+      }
+    }
+  }
+  return window;
+}
+
+ITrack* Timeline::segmentTrack(int track, double start, double end) const
+{
+  SharedEventTrack* segment = new SharedEventTrack(lengths[track]);
+  for (size_t i = 0; i < events[track].size(); i++) {
+    int voiceIndex = eventVoices[track][i];
+    if (voiceIndex < 0 || (_voices[voiceIndex].start >= start && _voices[voiceIndex].start < end)) {
+      segment->events.push_back(events[track][i]);
+    }
+  }
+  return segment;
+}
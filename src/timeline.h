@@ -0,0 +1,50 @@
+#ifndef B2W_TIMELINE_H
+#define B2W_TIMELINE_H
+
+#include "seq/itrack.h"
+#include <memory>
+#include <vector>
+#include <unordered_map>
+class ClefContext;
+
+// A fully-expanded view of a set of tracks, with the time span of every
+// sample voice resolved (including early KillEvent truncation and the
+// release of the voice's envelope).
+class Timeline {
+public:
+  struct Voice {
+    double start;
+    double end;
+    uint64_t sampleID;
+    uint64_t playbackID;
+    int track;
+  };
+
+  // Reads every event from the tracks and rewinds them afterward.
+  // Sample lengths are looked up in ctx; samples that aren't loaded yet
+  // are treated as zero-length.
+  Timeline(ClefContext* ctx, const std::vector<ITrack*>& tracks);
+
+  int numTracks() const;
+  const std::vector<Voice>& voices() const;
+  double length() const;
+
+  // Builds a copy of a track with only the events needed to render [start, end).
+  // Events other than sample and kill events are left out.
+  BasicTrack* windowTrack(int track, double start, double end) const;
+
+  // Builds a track that plays the voices of a track that start in
+  // [start, end), with their kills, and every event that doesn't start a
+  // voice. The events keep their times and are shared with the timeline,
+  // which must outlive the track.
+  ITrack* segmentTrack(int track, double start, double end) const;
+
+private:
+  std::vector<std::vector<std::shared_ptr<SequenceEvent>>> events;
+  // The voice each event starts or kills, or -1
+  std::vector<std::vector<int>> eventVoices;
+  std::vector<double> lengths;
+  std::vector<Voice> _voices;
+};
+
+#endif
@@ -35,7 +35,7 @@ std::pair<Iter8, Iter8> findWma(Iter8 start, Iter8 end) {
   return std::make_pair(start, wmaEnd);
 }
 
-AsfCodec::AsfCodec(ClefContext* ctx) : ICodec(ctx)
+AsfCodec::AsfCodec(ClefContext* ctx) : ICodec(ctx), cancel(nullptr), downsample(1)
 {
   // initializers only
 }
@@ -72,9 +72,21 @@ SampleData* AsfCodec::decodeRange(std::vector<uint8_t>::const_iterator start, st
     std::cerr << e.what() << std::endl;
     return nullptr;
   }
+  wmaCodec->setCancelToken(cancel);
+  wmaCodec->setDownsample(downsample);
   return wmaCodec->decodeRange(wma.first, wma.second);
 }
 
+void AsfCodec::setCancelToken(const CancelToken* cancel)
+{
+  this->cancel = cancel;
+}
+
+void AsfCodec::setDownsample(int factor)
+{
+  downsample = factor;
+}
+
 double AsfCodec::duration(Iter8 start, Iter8 end)
 {
   Iter8 iter = findGuid(fileProps, start, end);
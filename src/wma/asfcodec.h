@@ -3,6 +3,7 @@
 
 #include "codec/icodec.h"
 #include "utility.h"
+class CancelToken;
 
 class AsfCodec : public ICodec {
 public:
@@ -10,6 +11,14 @@ public:
 
   virtual SampleData* decodeRange(std::vector<uint8_t>::const_iterator start, std::vector<uint8_t>::const_iterator end, uint64_t sampleID = 0);
   static double duration(std::vector<uint8_t>::const_iterator start, std::vector<uint8_t>::const_iterator end);
+
+  void setCancelToken(const CancelToken* cancel);
+  // See WmaCodec::setDownsample().
+  void setDownsample(int factor);
+
+private:
+  const CancelToken* cancel;
+  int downsample;
 };
 
 #endif
@@ -1,8 +1,12 @@
 #include "mdct.h"
 #include <unordered_map>
+#include <mutex>
 
 MDCT* MDCT::get(int numBits) {
+  // Tables are shared by every decoder, including those on other threads
+  static std::mutex mutex;
   static std::unordered_map<int, MDCT> cache;
+  std::lock_guard<std::mutex> lock(mutex);
   if (!cache.count(numBits)) {
     cache.emplace(numBits, numBits);
   }
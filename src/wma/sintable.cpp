@@ -2,10 +2,14 @@
 #include "sintable.h"
 #include <cmath>
 #include <unordered_map>
+#include <mutex>
 #include <iostream>
 
 SinTable* SinTable::get(int resolution) {
+  // Tables are shared by every decoder, including those on other threads
+  static std::mutex mutex;
   static std::unordered_map<int, SinTable> cache;
+  std::lock_guard<std::mutex> lock(mutex);
   if (!cache.count(resolution)) {
     cache.emplace(resolution, resolution);
   }
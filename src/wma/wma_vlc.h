@@ -24,6 +24,8 @@
  *   USA
  */
 
+#include <mutex>
+
 struct VLCode {
   VLCode() {}
   VLCode(uint8_t bits, uint32_t code, uint16_t symbol, int8_t order)
@@ -48,6 +50,8 @@ struct VLC {
       static VLC expVlc;
       return &expVlc;
     }
+    static std::mutex mutex;
+    std::lock_guard<std::mutex> lock(mutex);
     if (!cache.count(tableID)) {
       cache.emplace(tableID, tableID);
     }
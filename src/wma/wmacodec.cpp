@@ -33,6 +33,7 @@
 #include "mdct.h"
 #include "wma_vlc.h"
 #include "codec/riffcodec.h"
+#include "../canceltoken.h"
 #include <unordered_map>
 #include <utility>
 #include <memory>
@@ -59,7 +60,7 @@ static inline int ff_wma_total_gain_to_bits(int total_gain)
 }
 
 WmaCodec::WmaCodec(ClefContext* ctx, const WaveFormatEx& fmt, uint32_t maxPacketSize)
-: ICodec(ctx), fmt(fmt), maxPacketSize(maxPacketSize)
+: ICodec(ctx), fmt(fmt), cancel(nullptr), maxPacketSize(maxPacketSize), rateShift(0)
 {
   std::memset(exponents, 0, sizeof(exponents));
   std::memset(coefs1, 0, sizeof(coefs1));
@@ -100,7 +101,7 @@ WmaCodec::WmaCodec(ClefContext* ctx, const WaveFormatEx& fmt, uint32_t maxPacket
 SampleData* WmaCodec::decodeRange(std::vector<uint8_t>::const_iterator start, std::vector<uint8_t>::const_iterator end, uint64_t sampleID)
 {
   sampleData = sampleID ? new SampleData(context(), sampleID) : new SampleData(context());
-  sampleData->sampleRate = fmt.sampleRate;
+  sampleData->sampleRate = fmt.sampleRate >> rateShift;
   for (int i = 0; i < fmt.channels; i++) {
     sampleData->channels.emplace_back(0);
   }
@@ -142,6 +143,7 @@ SampleData* WmaCodec::decodeRange(std::vector<uint8_t>::const_iterator start, st
 
   samplesDone = 0;
   while (bitstream.remaining()) {
+    CancelToken::check(cancel);
     parseSuperframe(bitstream);
     bitstream.nextPacket();
   }
@@ -149,6 +151,19 @@ SampleData* WmaCodec::decodeRange(std::vector<uint8_t>::const_iterator start, st
   return sampleData;
 }
 
+void WmaCodec::setCancelToken(const CancelToken* cancel)
+{
+  this->cancel = cancel;
+}
+
+void WmaCodec::setDownsample(int factor)
+{
+  rateShift = factor >= 4 ? 2 : factor >= 2 ? 1 : 0;
+  // Blocks can be as short as 1/16 of a frame, and the inverse MDCT needs
+  // at least 32 coefficients
+  rateShift = std::max(0, std::min<int>(rateShift, frameBits - 9));
+}
+
 void WmaCodec::parseSuperframe(BitStream& bitstream)
 {
   bitstream.resetBitsConsumed();
@@ -162,7 +177,7 @@ void WmaCodec::parseSuperframe(BitStream& bitstream)
   }
 
   for (int i = 0; i < fmt.channels; i++) {
-    sampleData->channels[i].resize(sampleData->channels[i].size() + (numFrames + 1) * frameLen);
+    sampleData->channels[i].resize(sampleData->channels[i].size() + ((numFrames + 1) * frameLen >> rateShift));
   }
   int bitOffset = bitstream.read(byteOffsetBits + 3);
   if (bitOffset > bitstream.remaining()) {
@@ -286,14 +301,18 @@ void WmaCodec::parseBlock(BitStream& bitstream, int frameNum, int blockNum)
       }
     }
 
+    // The inverse transform's gain doesn't depend on its size, so a
+    // reduced-rate decode uses the same scale and drops the upper part of
+    // the spectrum.
     float mdctNorm = 2.0 / blockSize;
+    int keptCoefs = std::min<int>(numCoefs, blockSize >> rateShift);
     for (int ch = 0; ch < fmt.channels; ch++) {
       if (!channelCoded[ch]) {
         continue;
       }
       float mult = mdctNorm * std::pow(10, totalGain * 0.05) / maxExponent[ch];
       std::memset(coefs[ch], 0, sizeof(coefs[ch]));
-      for (int j = 0; j < numCoefs; j++) {
+      for (int j = 0; j < keptCoefs; j++) {
         coefs[ch][j] = coefs1[ch][j] * exponents[ch][j << (frameBits - blockBits) >> expBits[ch]] * mult;
       }
     }
@@ -303,7 +322,7 @@ void WmaCodec::parseBlock(BitStream& bitstream, int frameNum, int blockNum)
         channelCoded[0] = true;
       }
       // butterfly
-      for (int j = 0; j < frameLen; j++) {
+      for (int j = 0; j < (frameLen >> rateShift); j++) {
         float t = coefs[0][j] - coefs[1][j];
         coefs[0][j] += coefs[1][j];
         coefs[1][j] = t;
@@ -311,17 +330,20 @@ void WmaCodec::parseBlock(BitStream& bitstream, int frameNum, int blockNum)
     }
   }
 
-  MDCT* mdct = MDCT::get(blockBits + 1);
-  int fadeIn = std::min(blockSize, lastBlockSize);
+  // Positions in the output are scaled down to the output rate
+  int outBlockSize = blockSize >> rateShift;
+  int outLastBlockSize = lastBlockSize >> rateShift;
+  MDCT* mdct = MDCT::get(blockBits + 1 - rateShift);
+  int fadeIn = std::min(outBlockSize, outLastBlockSize);
   SinTable* sin = SinTable::get(fadeIn);
-  int numSamples = blockSize * 2;
+  int numSamples = outBlockSize * 2;
   for (int ch = 0; ch < fmt.channels; ch++) {
     if (channelCoded[ch]) {
       auto& output = sampleData->channels[ch];
       std::vector<float> samples(numSamples, 0);
       mdct->calcInverse(coefs[ch], samples);
-      int i = (blockSize > lastBlockSize) ? (blockSize - lastBlockSize) >> 1 : 0;
-      int j = i + samplesDone + ((frameLen - blockSize) >> 1);
+      int i = (outBlockSize > outLastBlockSize) ? (outBlockSize - outLastBlockSize) >> 1 : 0;
+      int j = i + ((samplesDone + ((frameLen - blockSize) >> 1)) >> rateShift);
       int fadeInSample = 0;
       for (; fadeInSample < fadeIn; i++, j++, fadeInSample++) {
         int32_t outSample = output[j] * sin->floatOut(fadeInSample);
@@ -31,6 +31,7 @@
 #include <stdexcept>
 class VLC;
 class MDCT;
+class CancelToken;
 
 class WmaException : public std::runtime_error {
 public:
@@ -43,12 +44,22 @@ public:
 
   virtual SampleData* decodeRange(std::vector<uint8_t>::const_iterator start, std::vector<uint8_t>::const_iterator end, uint64_t sampleID = 0);
 
+  // Checked between superframes; decodeRange() throws CancelledException once it's set.
+  void setCancelToken(const CancelToken* cancel);
+
+  // Decodes at 1/2 or 1/4 of the stream's sample rate by keeping only the
+  // lower part of each block's spectrum and running a smaller inverse MDCT.
+  // Streams whose shortest blocks are too small for the factor use the
+  // largest one they can. A factor of 1 decodes at the full rate.
+  void setDownsample(int factor);
+
 private:
   void parseSuperframe(BitStream& bitstream);
   void parseFrame(BitStream& bitstream, int frameNum);
   void parseBlock(BitStream& bitstream, int frameNum, int blockNum);
 
   WaveFormatEx fmt;
+  const CancelToken* cancel;
   SampleData* sampleData;
   VLC* coefVlc[2];
   VLC* expVlc;
@@ -66,6 +77,7 @@ private:
   uint32_t expBits[2];
   int lastBlockSize, blockBits;
   int samplesDone;
+  int rateShift;
   std::vector<std::vector<uint16_t>> bandTables;
 };
 
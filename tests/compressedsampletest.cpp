@@ -0,0 +1,78 @@
+// Checks the on-demand OKI4s decoder against libclef's AdpcmCodec. Random
+// payloads are decoded both ways, in full and from random seek points, in
+// both channel layouts.
+
+#include "compressedsample.h"
+#include "clefcontext.h"
+#include "codec/adpcmcodec.h"
+#include "codec/sampledata.h"
+#include <algorithm>
+#include <iostream>
+#include <memory>
+#include <random>
+
+static bool checkLayout(std::mt19937& rng, int channels)
+{
+  std::uniform_int_distribution<int> byte(0, 255);
+  for (int round = 0; round < 50; round++) {
+    // Sizes around the checkpoint interval catch off-by-one seeks
+    size_t size = round < 10 ? round + 1 : 1 + rng() % (CompressedSample::checkpointInterval * 3);
+    std::vector<uint8_t> data(size);
+    for (uint8_t& b : data) {
+      b = byte(rng);
+    }
+
+    ClefContext clef;
+    AdpcmCodec codec(&clef, AdpcmCodec::OKI4s, channels > 1 ? -1 : 0);
+    std::unique_ptr<SampleData> reference(codec.decodeRange(data.begin(), data.end()));
+    CompressedSample sample(data.data(), data.size(), channels, 48000);
+    size_t length = sample.numSamples();
+    if (reference->channels.size() != size_t(channels) || reference->channels[0].size() != length) {
+      std::cerr << "FAIL: " << channels << " channel(s), " << size << " bytes: codec produced " << reference->channels.size()
+        << " channel(s) of " << reference->channels[0].size() << " frames, expected " << length << std::endl;
+      return false;
+    }
+
+    std::vector<int16_t> left(length), right(length);
+    CompressedSample::Cursor cursor = sample.seek(0);
+    sample.decode(cursor, left.data(), right.data(), length);
+    if (left != reference->channels[0] || (channels > 1 && right != reference->channels[1])) {
+      std::cerr << "FAIL: " << channels << " channel(s), " << size << " bytes: full decode differs from the codec" << std::endl;
+      return false;
+    }
+
+    std::vector<int16_t> allLeft(length), allRight(length);
+    CompressedSample::decodeAll(data.data(), data.size(), channels, allLeft.data(), allRight.data(), nullptr);
+    if (allLeft != left || (channels > 1 && allRight != right)) {
+      std::cerr << "FAIL: " << channels << " channel(s), " << size << " bytes: decodeAll differs from the codec" << std::endl;
+      return false;
+    }
+
+    for (int i = 0; i < 20; i++) {
+      size_t frame = rng() % length;
+      size_t frames = std::min<size_t>(length - frame, 1 + rng() % 5000);
+      std::vector<int16_t> partLeft(frames), partRight(frames);
+      cursor = sample.seek(frame);
+      sample.decode(cursor, partLeft.data(), partRight.data(), frames);
+      if (!std::equal(partLeft.begin(), partLeft.end(), left.begin() + frame) ||
+          (channels > 1 && !std::equal(partRight.begin(), partRight.end(), right.begin() + frame))) {
+        std::cerr << "FAIL: " << channels << " channel(s), " << size << " bytes: decode from frame " << frame << " differs from the codec" << std::endl;
+        return false;
+      }
+    }
+  }
+  return true;
+}
+
+int main(int, char**)
+{
+  std::mt19937 rng(12345);
+  int failures = 0;
+  for (int channels : { 1, 2 }) {
+    if (!checkLayout(rng, channels)) {
+      failures++;
+    }
+  }
+  std::cout << "Mono and stereo OKI4s decoding: " << failures << " failures" << std::endl;
+  return failures ? 1 : 0;
+}
@@ -0,0 +1,93 @@
+// Benchmark for the keysound mixer on a synthetic dense drum chart. Every
+// voice rings for half a second and a new one starts 128 times a second,
+// so 64 voices play at once for most of the song. Most samples are at
+// rates other than the output rate, so most voices are resampled. The same
+// chart is also rendered with SynthContext for comparison.
+
+#include "keysoundmixer.h"
+#include "clefcontext.h"
+#include "codec/sampledata.h"
+#include "synth/synthcontext.h"
+#include <chrono>
+#include <cmath>
+#include <iostream>
+#include <random>
+
+static const double outputRate = 44100;
+static const int numSamples = 16;
+static const double triggersPerSecond = 128;
+static const double voiceLength = 0.5;
+
+static void makeSamples(ClefContext* ctx, std::mt19937& rng)
+{
+  const double rates[] = { 44100, 22050, 32000, 48000 };
+  std::uniform_real_distribution<double> noise(-1, 1);
+  for (int i = 0; i < numSamples; i++) {
+    double rate = rates[i % 4];
+    SampleData* sample = new SampleData(ctx, i + 1, rate);
+    size_t length = voiceLength * rate;
+    sample->channels.resize(i % 2 ? 2 : 1);
+    for (auto& channel : sample->channels) {
+      channel.resize(length);
+      for (size_t j = 0; j < length; j++) {
+        // Decaying noise, roughly like a drum hit
+        channel[j] = 12000 * noise(rng) * std::exp(-6.0 * j / length);
+      }
+    }
+  }
+}
+
+static BasicTrack* makeChart(double seconds, std::mt19937& rng)
+{
+  BasicTrack* track = new BasicTrack;
+  int numTriggers = seconds * triggersPerSecond;
+  for (int i = 0; i < numTriggers; i++) {
+    SampleEvent* event = new SampleEvent;
+    event->timestamp = i / triggersPerSecond;
+    event->sampleID = 1 + rng() % numSamples;
+    event->playbackID = i;
+    event->volume = 0.25;
+    event->pan = (rng() % 101) / 100.0;
+    track->addEvent(event);
+  }
+  return track;
+}
+
+template <typename Fill>
+static double timeRender(Fill fill)
+{
+  std::vector<int16_t> buffer(4096 * 2);
+  auto started = std::chrono::steady_clock::now();
+  while (fill(buffer.data(), 4096)) {
+    // keep rendering
+  }
+  return std::chrono::duration<double>(std::chrono::steady_clock::now() - started).count();
+}
+
+int main(int argc, char** argv)
+{
+  double seconds = argc > 1 ? std::stod(argv[1]) : 60;
+  std::mt19937 rng(12345);
+  ClefContext ctx;
+  makeSamples(&ctx, rng);
+  std::unique_ptr<BasicTrack> chart(makeChart(seconds, rng));
+
+  KeysoundMixer mixer(&ctx, outputRate);
+  mixer.addTrack(chart.get());
+  double songLength = mixer.maximumTime();
+  double mixerTime = timeRender([&mixer](int16_t* buffer, size_t frames) {
+    return mixer.fillBuffer(buffer, frames);
+  });
+
+  chart->reset();
+  SynthContext synth(&ctx, outputRate);
+  synth.addChannel(chart.get());
+  double synthTime = timeRender([&synth](int16_t* buffer, size_t frames) {
+    return synth.fillBuffer(reinterpret_cast<uint8_t*>(buffer), frames * 2 * sizeof(int16_t));
+  });
+
+  std::cout << songLength << " seconds, " << int(triggersPerSecond * voiceLength) << " voices at once" << std::endl;
+  std::cout << "KeysoundMixer: " << mixerTime << " s (" << songLength / mixerTime << "x realtime)" << std::endl;
+  std::cout << "SynthContext:  " << synthTime << " s (" << songLength / synthTime << "x realtime)" << std::endl;
+  return 0;
+}
@@ -0,0 +1,170 @@
+// Stress test for the phased stream solver. Random sets of synthetic bgm
+// streams are solved for every combination of muted parts and the results
+// are checked against the exhaustive search the solver replaced.
+
+#include "ifs/phasesolver.h"
+#include "ifs/ifssequence.h"
+#include "utility.h"
+#include <algorithm>
+#include <chrono>
+#include <iostream>
+#include <random>
+
+// The original recursive search, kept as a reference. It tries every
+// ordering of the streams, so it's only used on small sets.
+static ScoreResult referenceSearch(uint64_t mute, uint32_t base, std::vector<uint64_t> add, ScoreResult before = { 0, {} })
+{
+  ScoreResult result{ 0, {} };
+  int neededChannels = 4 - countBits(mute);
+  for (uint64_t streamID : add) {
+    if (streamID & mute) {
+      continue;
+    }
+    bool invert = streamID & SampleSpaces::Invert;
+    uint32_t v = (streamID >> 16) & 0xF;
+    uint32_t score = 0;
+    uint32_t chanSum = 0;
+    int goodChannels = 0;
+    bool reject = false;
+    for (int i = 0; i < 4; i++) {
+      uint8_t chanScore = (v >> i) & 0x01;
+      uint8_t baseScore = (base >> (i * 8)) & 0xFF;
+      if (chanScore && invert == !(baseScore & 1)) {
+        reject = true;
+        break;
+      }
+      chanScore += baseScore;
+      chanSum |= chanScore << (i * 8);
+      if (chanScore == 1) {
+        score += 10;
+        goodChannels++;
+      } else if (chanScore & 1) {
+        score += (chanScore == 3 ? 7 : 6);
+        goodChannels++;
+      }
+    }
+    if (reject) {
+      continue;
+    }
+    if (goodChannels < neededChannels) {
+      std::vector<uint64_t> rest;
+      for (uint64_t v : add) {
+        if ((v & ~SampleSpaces::Invert) != (streamID & ~SampleSpaces::Invert)) {
+          rest.push_back(v);
+        }
+      }
+      ScoreResult recScore = referenceSearch(mute, chanSum, rest, result);
+      if (recScore.score > result.score) {
+        result = recScore;
+        result.streams.push_back(streamID);
+      }
+    } else if (score > result.score) {
+      result.score = score;
+      result.streams = before.streams;
+      result.streams.push_back(streamID);
+    }
+  }
+  return result;
+}
+
+static std::vector<uint64_t> candidates(const std::vector<uint64_t>& streams)
+{
+  std::vector<uint64_t> result;
+  for (uint64_t streamID : streams) {
+    result.push_back(streamID);
+    result.push_back(SampleSpaces::Invert | streamID);
+  }
+  return result;
+}
+
+// Returns an error message, or an empty string if the result plays every
+// unmuted part exactly once and nothing that was muted.
+static std::string checkResult(uint64_t mute, const ScoreResult& result)
+{
+  if (!result.score) {
+    return result.streams.empty() ? std::string() : "streams returned without a score";
+  }
+  int amplitude[4] = { 0, 0, 0, 0 };
+  for (uint64_t streamID : result.streams) {
+    if (streamID & mute) {
+      return "used a stream with a muted part";
+    }
+    for (int i = 0; i < 4; i++) {
+      if (streamID & (SampleSpaces::Drums << i)) {
+        amplitude[i] += (streamID & SampleSpaces::Invert) ? -1 : 1;
+      }
+    }
+  }
+  for (int i = 0; i < 4; i++) {
+    bool muted = mute & (SampleSpaces::Drums << i);
+    if (amplitude[i] != (muted ? 0 : 1)) {
+      return "part " + std::to_string(i) + " has amplitude " + std::to_string(amplitude[i]);
+    }
+  }
+  return std::string();
+}
+
+static void dump(const char* label, const std::vector<uint64_t>& streams)
+{
+  std::cerr << label << ":";
+  for (uint64_t streamID : streams) {
+    std::cerr << " " << std::hex << streamID << std::dec;
+  }
+  std::cerr << std::endl;
+}
+
+int main(int argc, char** argv)
+{
+  int numSets = argc > 1 ? std::stoi(argv[1]) : 20000;
+  std::mt19937 rng(12345);
+  int failures = 0;
+  int solved = 0;
+  for (int set = 0; set < numSets && failures < 10; set++) {
+    // Up to 6 of the 16 possible streams, each with the backing
+    std::vector<uint64_t> streams;
+    size_t numStreams = 1 + rng() % 6;
+    while (streams.size() < numStreams) {
+      uint64_t streamID = SampleSpaces::Backing | (uint64_t(rng() % 16) << 16);
+      if (std::find(streams.begin(), streams.end(), streamID) == streams.end()) {
+        streams.push_back(streamID);
+      }
+    }
+    std::vector<uint64_t> all = candidates(streams);
+    for (uint64_t mute = 0; mute <= 0xF0000; mute += 0x10000) {
+      ScoreResult result = scoreCombination(mute, all);
+      ScoreResult reference = referenceSearch(mute, 0, all);
+      std::string error = checkResult(mute, result);
+      if (error.empty() && result.score != reference.score) {
+        error = "score " + std::to_string(result.score) + ", expected " + std::to_string(reference.score);
+      }
+      if (!error.empty()) {
+        std::cerr << "FAIL: set " << set << ", mute " << std::hex << mute << std::dec << ": " << error << std::endl;
+        dump("  streams", streams);
+        dump("  result", result.streams);
+        failures++;
+      } else if (result.score) {
+        solved++;
+      }
+    }
+  }
+
+  // Every stream present is the largest case the solver can see
+  std::vector<uint64_t> streams;
+  for (uint64_t parts = 0; parts < 16; parts++) {
+    streams.push_back(SampleSpaces::Backing | (parts << 16));
+  }
+  std::vector<uint64_t> all = candidates(streams);
+  auto started = std::chrono::steady_clock::now();
+  for (uint64_t mute = 0; mute <= 0xF0000; mute += 0x10000) {
+    std::string error = checkResult(mute, scoreCombination(mute, all));
+    if (!error.empty()) {
+      std::cerr << "FAIL: all streams, mute " << std::hex << mute << std::dec << ": " << error << std::endl;
+      failures++;
+    }
+  }
+  auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - started);
+
+  std::cout << numSets << " stream sets, " << solved << " solved combinations, " << failures << " failures" << std::endl;
+  std::cout << "All 16 streams, every mute: " << elapsed.count() << " ms" << std::endl;
+  return failures ? 1 : 0;
+}